@@ -11,6 +11,7 @@
 
 #include <google/protobuf/compiler/mysql/mysql_generator.h>
 
+#include <algorithm>
 #include <limits>
 #include <map>
 #include <utility>
@@ -26,6 +27,7 @@
 #include <google/protobuf/stubs/stringprintf.h>
 #include <google/protobuf/stubs/strutil.h>
 #include <google/protobuf/stubs/substitute.h>
+#include <google/protobuf/unknown_field_set.h>
 #include <google/protobuf/wire_format_lite.h>
 
 namespace google {
@@ -57,17 +59,18 @@ const char* PrimitiveTypeName(FieldDescriptor::Type type) {
     case FieldDescriptor::TYPE_DOUBLE  : return "double";
     case FieldDescriptor::TYPE_FLOAT   : return "float";
     case FieldDescriptor::TYPE_INT64   : return "bigint";
-    case FieldDescriptor::TYPE_UINT64  : return "bigint";
+    case FieldDescriptor::TYPE_UINT64  : return "bigint unsigned";
     case FieldDescriptor::TYPE_INT32   : return "int";
-    case FieldDescriptor::TYPE_FIXED64 : return "bigint";
-    case FieldDescriptor::TYPE_FIXED32 : return "int";
+    case FieldDescriptor::TYPE_FIXED64 : return "bigint unsigned";
+    case FieldDescriptor::TYPE_FIXED32 : return "int unsigned";
     case FieldDescriptor::TYPE_BOOL    : return "tinyint";
     case FieldDescriptor::TYPE_STRING  : return "varchar(64)";
     case FieldDescriptor::TYPE_GROUP   : return NULL;
     case FieldDescriptor::TYPE_MESSAGE : return NULL;
     case FieldDescriptor::TYPE_BYTES   : return "blob";
-    case FieldDescriptor::TYPE_UINT32  : return "int";
-    case FieldDescriptor::TYPE_ENUM    : return NULL;
+    case FieldDescriptor::TYPE_UINT32  : return "int unsigned";
+    // Narrowed to the values of the enum by ColumnType().
+    case FieldDescriptor::TYPE_ENUM    : return "int";
     case FieldDescriptor::TYPE_SFIXED32: return "int";
     case FieldDescriptor::TYPE_SFIXED64: return "bigint";
     case FieldDescriptor::TYPE_SINT32  : return "int";
@@ -113,22 +116,434 @@ int FixedSize(FieldDescriptor::Type type) {
   return -1;
 }
 
+// Accessor name in the generated C++ code. SQL identifiers are the field
+// names as declared, like pmo::TableSchema uses them.
 string FieldName(const FieldDescriptor* field) {
   string result = field->name();
   LowerString(&result);
   return result;
 }
 
-void SetPrimitiveVariables(const FieldDescriptor* descriptor,
-                           map<string, string>* variables) {
-  (*variables)["type"] = PrimitiveTypeName(descriptor->type());
-  (*variables)["name"] = FieldName(descriptor);
-  // (*variables)["default"] = DefaultValue(descriptor);
-  // (*variables)["tag"] = SimpleItoa(internal::WireFormat::MakeTag(descriptor));
-  int fixed_size = FixedSize(descriptor->type());
-  if (fixed_size != -1) {
-    (*variables)["fixed_size"] = SimpleItoa(fixed_size);
+// Whether the field is stored in a column of its own.
+bool IsColumnField(const FieldDescriptor* field) {
+  if (field->is_repeated()) {
+    return false;
   }
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_INT64:
+    case FieldDescriptor::CPPTYPE_UINT32:
+    case FieldDescriptor::CPPTYPE_UINT64:
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CPPTYPE_FLOAT:
+    case FieldDescriptor::CPPTYPE_BOOL:
+    case FieldDescriptor::CPPTYPE_ENUM:
+    case FieldDescriptor::CPPTYPE_STRING:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// The fixed width C type the pmo helpers take for a field's C++ type.
+const char* OrmValueType(const FieldDescriptor* field) {
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32 : return "int32_t";
+    case FieldDescriptor::CPPTYPE_INT64 : return "int64_t";
+    case FieldDescriptor::CPPTYPE_UINT32: return "uint32_t";
+    case FieldDescriptor::CPPTYPE_UINT64: return "uint64_t";
+    case FieldDescriptor::CPPTYPE_DOUBLE: return "double";
+    case FieldDescriptor::CPPTYPE_FLOAT : return "float";
+    case FieldDescriptor::CPPTYPE_ENUM  : return "int32_t";
+    default: return NULL;
+  }
+}
+
+// Name of the pmo::parseXxx() helper decoding a text cell for the field.
+const char* OrmParseFunction(const FieldDescriptor* field) {
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32 : return "parseInt32";
+    case FieldDescriptor::CPPTYPE_INT64 : return "parseInt64";
+    case FieldDescriptor::CPPTYPE_UINT32: return "parseUInt32";
+    case FieldDescriptor::CPPTYPE_UINT64: return "parseUInt64";
+    case FieldDescriptor::CPPTYPE_DOUBLE: return "parseDouble";
+    case FieldDescriptor::CPPTYPE_FLOAT : return "parseFloat";
+    case FieldDescriptor::CPPTYPE_BOOL  : return "parseBool";
+    case FieldDescriptor::CPPTYPE_ENUM  : return "parseInt32";
+    default: return NULL;
+  }
+}
+
+string OrmClassName(const Descriptor& message_descriptor) {
+  return message_descriptor.name() + "Orm";
+}
+
+// Fully qualified C++ name of a generated enum, nested ones are prefixed
+// with their containing messages: ::pkg::Outer_Inner.
+string OrmEnumName(const EnumDescriptor* enum_descriptor) {
+  string name = enum_descriptor->name();
+  for (const Descriptor* parent = enum_descriptor->containing_type();
+       parent != NULL; parent = parent->containing_type()) {
+    name = parent->name() + "_" + name;
+  }
+  string package = enum_descriptor->file()->package();
+  if (package.empty()) {
+    return "::" + name;
+  }
+  return "::" + StringReplace(package, ".", "::", true) + "::" + name;
+}
+
+string OrmHeaderGuard(const string& basename) {
+  string guard = "PMO_ORM_" + basename + "_PB_ORM_H";
+  UpperString(&guard);
+  for (int i = 0; i < guard.size(); ++i) {
+    if (!ascii_isalnum(guard[i])) {
+      guard[i] = '_';
+    }
+  }
+  return guard;
+}
+
+void PrintNamespaceOpen(io::Printer* printer, const string& package) {
+  vector<string> parts;
+  SplitStringUsing(package, ".", &parts);
+  for (int i = 0; i < parts.size(); ++i) {
+    printer->Print("namespace $part$ {\n", "part", parts[i]);
+  }
+  printer->Print("\n");
+}
+
+void PrintNamespaceClose(io::Printer* printer, const string& package) {
+  vector<string> parts;
+  SplitStringUsing(package, ".", &parts);
+  for (int i = parts.size() - 1; i >= 0; --i) {
+    printer->Print("}  // namespace $part$\n", "part", parts[i]);
+  }
+}
+
+// Field numbers of the extensions declared in src/pmo_options.proto.
+// pmo_options.proto is not linked into protoc, so its options reach the
+// generator as unknown fields of FieldOptions/MessageOptions.
+const int kPrimaryKeyOption = 51001;
+const int kUniqueOption = 51002;
+const int kIndexOption = 51003;
+const int kLengthOption = 51004;
+const int kCharsetOption = 51005;
+const int kCompositePrimaryKeyOption = 51101;
+const int kCompositeUniqueOption = 51102;
+const int kCompositeIndexOption = 51103;
+const int kBlobStorageOption = 51104;
+const int kRowFormatOption = 51105;
+const int kKeyBlockSizeOption = 51106;
+
+bool GetBoolOption(const UnknownFieldSet& unknown_fields, int number) {
+  bool value = false;
+  for (int i = 0; i < unknown_fields.field_count(); ++i) {
+    const UnknownField& field = unknown_fields.field(i);
+    if (field.number() == number && field.type() == UnknownField::TYPE_VARINT) {
+      value = field.varint() != 0;
+    }
+  }
+  return value;
+}
+
+uint32 GetUInt32Option(const UnknownFieldSet& unknown_fields, int number) {
+  uint32 value = 0;
+  for (int i = 0; i < unknown_fields.field_count(); ++i) {
+    const UnknownField& field = unknown_fields.field(i);
+    if (field.number() == number && field.type() == UnknownField::TYPE_VARINT) {
+      value = static_cast<uint32>(field.varint());
+    }
+  }
+  return value;
+}
+
+// The last value of a non-repeated string option, empty when not set.
+string GetStringOption(const UnknownFieldSet& unknown_fields, int number) {
+  string value;
+  for (int i = 0; i < unknown_fields.field_count(); ++i) {
+    const UnknownField& field = unknown_fields.field(i);
+    if (field.number() == number &&
+        field.type() == UnknownField::TYPE_LENGTH_DELIMITED) {
+      value = field.length_delimited();
+    }
+  }
+  return value;
+}
+
+void GetStringOptions(const UnknownFieldSet& unknown_fields, int number,
+                      vector<string>* values) {
+  for (int i = 0; i < unknown_fields.field_count(); ++i) {
+    const UnknownField& field = unknown_fields.field(i);
+    if (field.number() == number &&
+        field.type() == UnknownField::TYPE_LENGTH_DELIMITED) {
+      values->push_back(field.length_delimited());
+    }
+  }
+}
+
+// Resolves a "a, b" column list against the message fields.
+bool ParseColumnList(const Descriptor& message_descriptor, const string& list,
+                     vector<const FieldDescriptor*>* fields) {
+  vector<string> names;
+  SplitStringUsing(list, ",", &names);
+  for (int i = 0; i < names.size(); ++i) {
+    StripWhitespace(&names[i]);
+    const FieldDescriptor* field = message_descriptor.FindFieldByName(names[i]);
+    if (field == NULL) {
+      GOOGLE_LOG(ERROR) << message_descriptor.full_name()
+                        << ": unknown key column " << names[i];
+      return false;
+    }
+    fields->push_back(field);
+  }
+  return !fields->empty();
+}
+
+void GetPrimaryKey(const Descriptor& message_descriptor,
+                   vector<const FieldDescriptor*>* fields) {
+  for (int i = 0; i < message_descriptor.field_count(); ++i) {
+    const FieldDescriptor* field = message_descriptor.field(i);
+    if (GetBoolOption(field->options().unknown_fields(), kPrimaryKeyOption)) {
+      fields->push_back(field);
+    }
+  }
+  if (!fields->empty()) {
+    return;
+  }
+
+  vector<string> composite;
+  GetStringOptions(message_descriptor.options().unknown_fields(),
+                   kCompositePrimaryKeyOption, &composite);
+  if (!composite.empty()) {
+    ParseColumnList(message_descriptor, composite.back(), fields);
+  }
+}
+
+// Messages stored as key columns plus the serialized message, see
+// pmo::TableSchema::blobStorage().
+bool IsBlobStorage(const Descriptor& message_descriptor) {
+  return GetBoolOption(message_descriptor.options().unknown_fields(),
+                       kBlobStorageOption);
+}
+
+// Whether the field is part of the primary key or of any index.
+bool IsIndexedField(const Descriptor& message_descriptor,
+                    const FieldDescriptor* field) {
+  const UnknownFieldSet& field_options = field->options().unknown_fields();
+  if (GetBoolOption(field_options, kPrimaryKeyOption) ||
+      GetBoolOption(field_options, kUniqueOption) ||
+      GetBoolOption(field_options, kIndexOption)) {
+    return true;
+  }
+
+  vector<string> lists;
+  const UnknownFieldSet& options = message_descriptor.options().unknown_fields();
+  GetStringOptions(options, kCompositePrimaryKeyOption, &lists);
+  GetStringOptions(options, kCompositeUniqueOption, &lists);
+  GetStringOptions(options, kCompositeIndexOption, &lists);
+  for (int i = 0; i < lists.size(); ++i) {
+    vector<const FieldDescriptor*> fields;
+    ParseColumnList(message_descriptor, lists[i], &fields);
+    if (find(fields.begin(), fields.end(), field) != fields.end()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The smallest integer type holding every value of the enum.
+string EnumColumnType(const EnumDescriptor* enum_descriptor) {
+  int min = 0;
+  int max = 0;
+  for (int i = 0; i < enum_descriptor->value_count(); ++i) {
+    int number = enum_descriptor->value(i)->number();
+    min = std::min(min, number);
+    max = std::max(max, number);
+  }
+  if (min >= 0) {
+    if (max <= 0xff) return "tinyint unsigned";
+    if (max <= 0xffff) return "smallint unsigned";
+    if (max <= 0xffffff) return "mediumint unsigned";
+    return "int unsigned";
+  }
+  if (min >= -0x80 && max <= 0x7f) return "tinyint";
+  if (min >= -0x8000 && max <= 0x7fff) return "smallint";
+  if (min >= -0x800000 && max <= 0x7fffff) return "mediumint";
+  return "int";
+}
+
+// Column type of a field, also used for stored procedure parameters.
+string ColumnType(const FieldDescriptor* field) {
+  const UnknownFieldSet& options = field->options().unknown_fields();
+  uint32 length = GetUInt32Option(options, kLengthOption);
+  string charset = GetStringOption(options, kCharsetOption);
+
+  string type;
+  switch (field->type()) {
+    case FieldDescriptor::TYPE_ENUM:
+      return EnumColumnType(field->enum_type());
+    case FieldDescriptor::TYPE_STRING:
+      type = "varchar(" + SimpleItoa(length != 0 ? length : 64) + ")";
+      break;
+    case FieldDescriptor::TYPE_BYTES:
+      if (length == 0) {
+        return PrimitiveTypeName(field->type());
+      }
+      return "varbinary(" + SimpleItoa(length) + ")";
+    default:
+      return PrimitiveTypeName(field->type());
+  }
+  if (!charset.empty()) {
+    type += " CHARACTER SET " + charset;
+  }
+  return type;
+}
+
+// SQL literal of the DEFAULT of the field's column: its proto default, or
+// for required fields outside the primary key the implicit one (0, '' or
+// the first enum value), so that an upsert of only the set fields can
+// insert a new row. Empty when there is none or the column type can not
+// have a DEFAULT.
+string ColumnDefault(const FieldDescriptor* field, bool primary_key) {
+  if (!field->has_default_value() && (primary_key || !field->is_required())) {
+    return "";
+  }
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      return SimpleItoa(field->default_value_int32());
+    case FieldDescriptor::CPPTYPE_INT64:
+      return SimpleItoa(field->default_value_int64());
+    case FieldDescriptor::CPPTYPE_UINT32:
+      return SimpleItoa(field->default_value_uint32());
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return SimpleItoa(field->default_value_uint64());
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      return SimpleDtoa(field->default_value_double());
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      return SimpleFtoa(field->default_value_float());
+    case FieldDescriptor::CPPTYPE_BOOL:
+      return field->default_value_bool() ? "1" : "0";
+    case FieldDescriptor::CPPTYPE_ENUM:
+      return SimpleItoa(field->default_value_enum()->number());
+    case FieldDescriptor::CPPTYPE_STRING: {
+      // blob columns take no DEFAULT.
+      if (field->type() == FieldDescriptor::TYPE_BYTES &&
+          GetUInt32Option(field->options().unknown_fields(), kLengthOption) == 0) {
+        return "";
+      }
+      string value = field->default_value_string();
+      string literal = "'";
+      for (int i = 0; i < value.size(); ++i) {
+        if (value[i] == '\'' || value[i] == '\\') {
+          literal += '\\';
+        }
+        literal += value[i];
+      }
+      return literal + "'";
+    }
+    default:
+      return "";
+  }
+}
+
+// `name` type [NOT NULL] [DEFAULT value]. Columns with a default are NOT
+// NULL so that rows written without them take the default, primary key
+// columns always have a value. Required blob columns can not have a
+// DEFAULT and stay nullable.
+string ColumnDefinition(const FieldDescriptor* field, bool primary_key) {
+  string definition = "`" + field->name() + "` " + ColumnType(field);
+  string default_value = ColumnDefault(field, primary_key);
+  if (primary_key || !default_value.empty()) {
+    definition += " NOT NULL";
+  }
+  if (!default_value.empty()) {
+    definition += " DEFAULT " + default_value;
+  }
+  return definition;
+}
+
+string KeyColumns(const vector<const FieldDescriptor*>& fields) {
+  string columns;
+  for (int i = 0; i < fields.size(); ++i) {
+    columns += i == 0 ? "`" : ",`";
+    columns += fields[i]->name() + "`";
+  }
+  return columns;
+}
+
+string KeyName(const string& prefix, const vector<const FieldDescriptor*>& fields) {
+  string name = prefix;
+  for (int i = 0; i < fields.size(); ++i) {
+    name += "_" + fields[i]->name();
+  }
+  return name;
+}
+
+// PRIMARY KEY / UNIQUE KEY / KEY definitions of the CREATE TABLE statement.
+void GetKeyDefinitions(const Descriptor& message_descriptor,
+                       vector<string>* definitions) {
+  vector<const FieldDescriptor*> primary_key;
+  GetPrimaryKey(message_descriptor, &primary_key);
+  if (!primary_key.empty()) {
+    definitions->push_back("PRIMARY KEY (" + KeyColumns(primary_key) + ")");
+  }
+
+  for (int i = 0; i < message_descriptor.field_count(); ++i) {
+    vector<const FieldDescriptor*> fields(1, message_descriptor.field(i));
+    const UnknownFieldSet& options = fields[0]->options().unknown_fields();
+    if (GetBoolOption(options, kUniqueOption)) {
+      definitions->push_back("UNIQUE KEY `" + KeyName("uk", fields) + "` (" +
+                             KeyColumns(fields) + ")");
+    }
+    if (GetBoolOption(options, kIndexOption)) {
+      definitions->push_back("KEY `" + KeyName("idx", fields) + "` (" +
+                             KeyColumns(fields) + ")");
+    }
+  }
+
+  const UnknownFieldSet& options = message_descriptor.options().unknown_fields();
+  vector<string> lists;
+  GetStringOptions(options, kCompositeUniqueOption, &lists);
+  for (int i = 0; i < lists.size(); ++i) {
+    vector<const FieldDescriptor*> fields;
+    if (ParseColumnList(message_descriptor, lists[i], &fields)) {
+      definitions->push_back("UNIQUE KEY `" + KeyName("uk", fields) + "` (" +
+                             KeyColumns(fields) + ")");
+    }
+  }
+
+  lists.clear();
+  GetStringOptions(options, kCompositeIndexOption, &lists);
+  for (int i = 0; i < lists.size(); ++i) {
+    vector<const FieldDescriptor*> fields;
+    if (ParseColumnList(message_descriptor, lists[i], &fields)) {
+      definitions->push_back("KEY `" + KeyName("idx", fields) + "` (" +
+                             KeyColumns(fields) + ")");
+    }
+  }
+}
+
+// Stored procedure names, pmo::TableSchema derives the same ones:
+// pmo_save_<full_name> and pmo_load_<full_name>_by_<key columns> with
+// dots replaced by underscores.
+string ProcedureTableName(const Descriptor& message_descriptor) {
+  string name = message_descriptor.full_name();
+  StripString(&name, ".", '_');
+  return name;
+}
+
+string SaveProcedureName(const Descriptor& message_descriptor) {
+  return "pmo_save_" + ProcedureTableName(message_descriptor);
+}
+
+string LoadProcedureName(const Descriptor& message_descriptor,
+                         const vector<const FieldDescriptor*>& key) {
+  string name = "pmo_load_" + ProcedureTableName(message_descriptor) + "_by";
+  for (int i = 0; i < key.size(); ++i) {
+    name += "_" + key[i]->name();
+  }
+  return name;
 }
 
 // Prints the common boilerplate needed at the top of every .sql
@@ -167,6 +582,10 @@ bool Generator::Generate(const FileDescriptor* file,
 
   this->PrintMessages();
 
+  string orm_basename = StripProto(file->name());
+  PrintOrmHeader(orm_basename, context);
+  PrintOrmSource(orm_basename, context);
+
   return true;
 }
 
@@ -188,20 +607,413 @@ void Generator::PrintMessage(const Descriptor& message_descriptor) const {
       message_descriptor.full_name());
   printer_->Indent();
 
+  bool blob_storage = IsBlobStorage(message_descriptor);
+  vector<const FieldDescriptor*> primary_key;
+  GetPrimaryKey(message_descriptor, &primary_key);
+
+  // Repeated and message fields have no column, they only survive in blob
+  // storage tables.
+  vector<string> definitions;
   for (int i = 0; i < message_descriptor.field_count(); ++i) {
-    map<string, string> variables;
-    SetPrimitiveVariables(message_descriptor.field(i), &variables);
-    if (i == message_descriptor.field_count() - 1) {
-        printer_->Print(variables, "`$name$` $type$\n");
+    const FieldDescriptor* field = message_descriptor.field(i);
+    if (!IsColumnField(field) ||
+        (blob_storage && !IsIndexedField(message_descriptor, field))) {
+      continue;
+    }
+    bool key = find(primary_key.begin(), primary_key.end(), field) != primary_key.end();
+    definitions.push_back(ColumnDefinition(field, key));
+  }
+  if (blob_storage) {
+    definitions.push_back("`_pmo_data` MEDIUMBLOB NOT NULL");
+  }
+  GetKeyDefinitions(message_descriptor, &definitions);
+
+  for (int i = 0; i < definitions.size(); ++i) {
+    if (i == definitions.size() - 1) {
+        printer_->Print("$definition$\n", "definition", definitions[i]);
     } else {
-        printer_->Print(variables, "`$name$` $type$,\n");
+        printer_->Print("$definition$,\n", "definition", definitions[i]);
     }
   }
 
-  printer_->Print(") ENGINE=InnoDB DEFAULT CHARSET=utf8;");
+  const UnknownFieldSet& options = message_descriptor.options().unknown_fields();
+  string table_options = "ENGINE=InnoDB DEFAULT CHARSET=utf8";
+  string row_format = GetStringOption(options, kRowFormatOption);
+  if (!row_format.empty()) {
+    table_options += " ROW_FORMAT=" + row_format;
+  }
+  uint32 key_block_size = GetUInt32Option(options, kKeyBlockSizeOption);
+  if (key_block_size != 0) {
+    table_options += " KEY_BLOCK_SIZE=" + SimpleItoa(key_block_size);
+  }
+  printer_->Print(") $options$;", "options", table_options);
+  printer_->Outdent();
+  printer_->Outdent();
 }
 
 void Generator::PrintStoredProcedure(const Descriptor& message_descriptor) const {
+  // Blob storage rows are written with a prepared statement binding the
+  // serialized message, not through procedures.
+  if (IsBlobStorage(message_descriptor)) {
+    return;
+  }
+
+  vector<const FieldDescriptor*> columns;
+  for (int i = 0; i < message_descriptor.field_count(); ++i) {
+    if (IsColumnField(message_descriptor.field(i))) {
+      columns.push_back(message_descriptor.field(i));
+    }
+  }
+  if (columns.empty()) {
+    return;
+  }
+
+  vector<const FieldDescriptor*> primary_key;
+  GetPrimaryKey(message_descriptor, &primary_key);
+
+  string params;
+  string column_list;
+  string values;
+  string updates;
+  for (int i = 0; i < columns.size(); ++i) {
+    const FieldDescriptor* field = columns[i];
+    string separator = i == 0 ? "" : ", ";
+    params += separator + "IN `p_" + field->name() + "` " + ColumnType(field);
+    column_list += separator + "`" + field->name() + "`";
+    bool key = find(primary_key.begin(), primary_key.end(), field) != primary_key.end();
+    // NOT NULL DEFAULT columns take their default when not given.
+    if (ColumnDefault(field, key).empty()) {
+      values += separator + "`p_" + field->name() + "`";
+    } else {
+      values += separator + "COALESCE(`p_" + field->name() + "`, DEFAULT(`" +
+                field->name() + "`))";
+    }
+    if (!key) {
+      updates += (updates.empty() ? "" : ", ") + string("`") + field->name() +
+                 "`=COALESCE(`p_" + field->name() + "`, `" + field->name() + "`)";
+    }
+  }
+
+  // Arguments are positional over all columns, NULL means "not set" and
+  // keeps the stored value when the row already exists.
+  map<string, string> variables;
+  variables["table"] = message_descriptor.full_name();
+  variables["procedure"] = SaveProcedureName(message_descriptor);
+  variables["params"] = params;
+  variables["columns"] = column_list;
+  variables["values"] = values;
+  printer_->Print(variables,
+      "DROP PROCEDURE IF EXISTS `$procedure$`;\n"
+      "DELIMITER ;;\n"
+      "CREATE PROCEDURE `$procedure$`($params$)\n"
+      "BEGIN\n");
+  printer_->Indent();
+  if (primary_key.empty()) {
+    printer_->Print(variables,
+        "REPLACE INTO `$table$` ($columns$) VALUES ($values$);\n");
+  } else {
+    variables["updates"] = updates.empty()
+        ? "`" + primary_key[0]->name() + "`=`" + primary_key[0]->name() + "`"
+        : updates;
+    printer_->Print(variables,
+        "INSERT INTO `$table$` ($columns$) VALUES ($values$)\n"
+        "  ON DUPLICATE KEY UPDATE $updates$;\n");
+  }
+  printer_->Outdent();
+  printer_->Print(
+      "END;;\n"
+      "DELIMITER ;\n");
+
+  if (primary_key.empty()) {
+    return;
+  }
+
+  string key_params;
+  string conditions;
+  for (int i = 0; i < primary_key.size(); ++i) {
+    const FieldDescriptor* field = primary_key[i];
+    key_params += (i == 0 ? "" : ", ") + string("IN `p_") + field->name() + "` " +
+                  ColumnType(field);
+    conditions += (i == 0 ? "" : " AND ") + string("`") + field->name() +
+                  "`=`p_" + field->name() + "`";
+  }
+
+  variables["procedure"] = LoadProcedureName(message_descriptor, primary_key);
+  variables["params"] = key_params;
+  variables["conditions"] = conditions;
+  printer_->Print(variables,
+      "\n"
+      "DROP PROCEDURE IF EXISTS `$procedure$`;\n"
+      "DELIMITER ;;\n"
+      "CREATE PROCEDURE `$procedure$`($params$)\n"
+      "BEGIN\n"
+      "  SELECT $columns$ FROM `$table$` WHERE $conditions$;\n"
+      "END;;\n"
+      "DELIMITER ;\n");
+}
+
+void Generator::PrintOrmHeader(const string& basename,
+                               GeneratorContext* context) const {
+  scoped_ptr<io::ZeroCopyOutputStream> output(
+      context->Open(basename + ".pb.orm.h"));
+  GOOGLE_CHECK(output.get());
+  io::Printer printer(output.get(), '$');
+  io::Printer* sql_printer = printer_;
+  printer_ = &printer;
+
+  map<string, string> variables;
+  variables["filename"] = file_->name();
+  variables["guard"] = OrmHeaderGuard(basename);
+  variables["basename"] = basename;
+  printer_->Print(variables,
+      "// Generated by the protocol buffer compiler.  DO NOT EDIT!\n"
+      "// source: $filename$\n"
+      "\n"
+      "#ifndef $guard$\n"
+      "#define $guard$\n"
+      "\n"
+      "#include <string>\n"
+      "\n"
+      "#include \"message_orm.h\"\n"
+      "#include \"$basename$.pb.h\"\n"
+      "\n");
+
+  PrintNamespaceOpen(printer_, file_->package());
+  for (int i = 0; i < file_->message_type_count(); ++i) {
+    if (!IsBlobStorage(*file_->message_type(i))) {
+      PrintOrmClassDeclaration(*file_->message_type(i));
+    }
+  }
+  PrintNamespaceClose(printer_, file_->package());
+
+  printer_->Print(
+      "\n"
+      "#endif  // $guard$\n",
+      "guard", OrmHeaderGuard(basename));
+
+  printer_ = sql_printer;
+}
+
+void Generator::PrintOrmSource(const string& basename,
+                               GeneratorContext* context) const {
+  scoped_ptr<io::ZeroCopyOutputStream> output(
+      context->Open(basename + ".pb.orm.cc"));
+  GOOGLE_CHECK(output.get());
+  io::Printer printer(output.get(), '$');
+  io::Printer* sql_printer = printer_;
+  printer_ = &printer;
+
+  printer_->Print(
+      "// Generated by the protocol buffer compiler.  DO NOT EDIT!\n"
+      "// source: $filename$\n"
+      "//\n"
+      "// Link this object directly into the binary: types register themselves\n"
+      "// from static initializers, which an unreferenced archive member skips.\n"
+      "\n"
+      "#include \"$basename$.pb.orm.h\"\n"
+      "\n",
+      "filename", file_->name(),
+      "basename", basename);
+
+  PrintNamespaceOpen(printer_, file_->package());
+  for (int i = 0; i < file_->message_type_count(); ++i) {
+    if (!IsBlobStorage(*file_->message_type(i))) {
+      PrintOrmClassDefinition(*file_->message_type(i));
+    }
+  }
+  PrintNamespaceClose(printer_, file_->package());
+
+  printer_ = sql_printer;
+}
+
+void Generator::PrintOrmClassDeclaration(const Descriptor& message_descriptor) const {
+  printer_->Print(
+      "class $classname$ : public ::pmo::MessageOrm {\n"
+      " public:\n"
+      "  virtual bool buildSave(const ::google::protobuf::Message &message, MYSQL *mysql, std::string &sql) const;\n"
+      "  virtual bool buildSelect(const ::google::protobuf::Message &query, MYSQL *mysql, std::string &sql) const;\n"
+      "  virtual void decodeRow(const MYSQL_ROW row, const unsigned long *lengths,\n"
+      "      ::google::protobuf::Message *message) const;\n"
+      "};\n"
+      "\n",
+      "classname", OrmClassName(message_descriptor));
+}
+
+void Generator::PrintOrmClassDefinition(const Descriptor& message_descriptor) const {
+  PrintOrmBuildSave(message_descriptor);
+  PrintOrmBuildSelect(message_descriptor);
+  PrintOrmDecodeRow(message_descriptor);
+  printer_->Print(
+      "static ::pmo::OrmRegistrar<$classname$> $classname$_registrar(\"$type$\");\n"
+      "\n",
+      "classname", OrmClassName(message_descriptor),
+      "type", message_descriptor.full_name());
+}
+
+// Prints the statements appending the value of |field| held by |object|.
+void PrintOrmAppendValue(io::Printer* printer, const FieldDescriptor* field,
+                         const string& object) {
+  map<string, string> variables;
+  variables["object"] = object;
+  variables["name"] = FieldName(field);
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_BOOL:
+      printer->Print(variables, "::pmo::appendBool(sql, $object$.$name$());\n");
+      break;
+    case FieldDescriptor::CPPTYPE_STRING:
+      printer->Print(variables, "::pmo::appendQuoted(sql, mysql, $object$.$name$());\n");
+      break;
+    default:
+      variables["type"] = OrmValueType(field);
+      printer->Print(variables,
+          "::pmo::appendNumber(sql, static_cast<$type$>($object$.$name$()));\n");
+      break;
+  }
+}
+
+void Generator::PrintOrmBuildSave(const Descriptor& message_descriptor) const {
+  // Tables with a primary key are upserted so that only the present
+  // columns are written, the others are replaced as a whole row.
+  vector<const FieldDescriptor*> primary_key;
+  GetPrimaryKey(message_descriptor, &primary_key);
+  bool upsert = !primary_key.empty();
+
+  map<string, string> variables;
+  variables["classname"] = OrmClassName(message_descriptor);
+  variables["message"] = message_descriptor.name();
+  variables["table"] = message_descriptor.full_name();
+  variables["verb"] = upsert ? "INSERT" : "REPLACE";
+  printer_->Print(variables,
+      "bool $classname$::buildSave(const ::google::protobuf::Message &message, MYSQL *mysql, std::string &sql) const {\n"
+      "  const $message$ &value = static_cast<const $message$ &>(message);\n"
+      "  const char *separator = \" \";\n"
+      "  sql.append(\"$verb$ INTO `$table$` SET\");\n");
+  printer_->Indent();
+  if (upsert) {
+    printer_->Print("std::string update;\n");
+  }
+
+  for (int i = 0; i < message_descriptor.field_count(); ++i) {
+    const FieldDescriptor* field = message_descriptor.field(i);
+    if (!IsColumnField(field)) {
+      continue;
+    }
+    printer_->Print(
+        "if (value.has_$name$()) {\n"
+        "  sql.append(separator);\n"
+        "  sql.append(\"`$column$`=\");\n",
+        "name", FieldName(field),
+        "column", field->name());
+    printer_->Indent();
+    PrintOrmAppendValue(printer_, field, "value");
+    printer_->Print("separator = \", \";\n");
+    if (upsert && find(primary_key.begin(), primary_key.end(), field) == primary_key.end()) {
+      printer_->Print(
+          "update.append(update.empty() ? \"`$column$`=VALUES(`$column$`)\" : \",`$column$`=VALUES(`$column$`)\");\n",
+          "column", field->name());
+    }
+    printer_->Outdent();
+    printer_->Print("}\n");
+  }
+
+  if (upsert) {
+    printer_->Print(
+        "sql.append(\" ON DUPLICATE KEY UPDATE \");\n"
+        "sql.append(update.empty() ? \"`$column$`=`$column$`\" : update);\n",
+        "column", primary_key[0]->name());
+  }
+  printer_->Print("return separator[0] == ',';\n");
+  printer_->Outdent();
+  printer_->Print("}\n\n");
+}
+
+void Generator::PrintOrmBuildSelect(const Descriptor& message_descriptor) const {
+  string columns;
+  for (int i = 0; i < message_descriptor.field_count(); ++i) {
+    const FieldDescriptor* field = message_descriptor.field(i);
+    if (!IsColumnField(field)) {
+      continue;
+    }
+    columns += columns.empty() ? "`" : ",`";
+    columns += field->name() + "`";
+  }
+
+  map<string, string> variables;
+  variables["classname"] = OrmClassName(message_descriptor);
+  variables["message"] = message_descriptor.name();
+  variables["columns"] = columns;
+  variables["table"] = message_descriptor.full_name();
+  printer_->Print(variables,
+      "bool $classname$::buildSelect(const ::google::protobuf::Message &query, MYSQL *mysql, std::string &sql) const {\n"
+      "  const $message$ &value = static_cast<const $message$ &>(query);\n"
+      "  const char *conjunction = \" WHERE \";\n"
+      "  sql.append(\"SELECT $columns$ FROM `$table$`\");\n");
+  printer_->Indent();
+
+  for (int i = 0; i < message_descriptor.field_count(); ++i) {
+    const FieldDescriptor* field = message_descriptor.field(i);
+    if (!IsColumnField(field)) {
+      continue;
+    }
+    printer_->Print(
+        "if (value.has_$name$()) {\n"
+        "  sql.append(conjunction);\n"
+        "  sql.append(\"`$column$`=\");\n",
+        "name", FieldName(field),
+        "column", field->name());
+    printer_->Indent();
+    PrintOrmAppendValue(printer_, field, "value");
+    printer_->Print("conjunction = \" AND \";\n");
+    printer_->Outdent();
+    printer_->Print("}\n");
+  }
+
+  printer_->Print("return true;\n");
+  printer_->Outdent();
+  printer_->Print("}\n\n");
+}
+
+void Generator::PrintOrmDecodeRow(const Descriptor& message_descriptor) const {
+  printer_->Print(
+      "void $classname$::decodeRow(const MYSQL_ROW row, const unsigned long *lengths,\n"
+      "    ::google::protobuf::Message *message) const {\n"
+      "  $message$ *value = static_cast<$message$ *>(message);\n",
+      "classname", OrmClassName(message_descriptor),
+      "message", message_descriptor.name());
+  printer_->Indent();
+
+  int column = 0;
+  for (int i = 0; i < message_descriptor.field_count(); ++i) {
+    const FieldDescriptor* field = message_descriptor.field(i);
+    if (!IsColumnField(field)) {
+      continue;
+    }
+    map<string, string> variables;
+    variables["name"] = FieldName(field);
+    variables["index"] = SimpleItoa(column++);
+    if (field->cpp_type() == FieldDescriptor::CPPTYPE_STRING) {
+      printer_->Print(variables,
+          "if (row[$index$] != NULL) {\n"
+          "  value->set_$name$(row[$index$], lengths[$index$]);\n"
+          "}\n");
+    } else if (field->cpp_type() == FieldDescriptor::CPPTYPE_ENUM) {
+      // Numbers unknown to this build of the enum are dropped.
+      variables["enum"] = OrmEnumName(field->enum_type());
+      printer_->Print(variables,
+          "if (row[$index$] != NULL && $enum$_IsValid(::pmo::parseInt32(row[$index$]))) {\n"
+          "  value->set_$name$(static_cast<$enum$>(::pmo::parseInt32(row[$index$])));\n"
+          "}\n");
+    } else {
+      variables["parse"] = OrmParseFunction(field);
+      printer_->Print(variables,
+          "if (row[$index$] != NULL) {\n"
+          "  value->set_$name$(::pmo::$parse$(row[$index$]));\n"
+          "}\n");
+    }
+  }
+
+  printer_->Outdent();
+  printer_->Print("}\n\n");
 }
 
 }  // namespace mysql
@@ -50,6 +50,16 @@ class LIBPROTOC_EXPORT Generator : public CodeGenerator {
   void PrintMessage(const Descriptor& message_descriptor) const;
   void PrintStoredProcedure(const Descriptor& message_descriptor) const;
 
+  // Typed C++ save/load code in .pb.orm.h/.pb.orm.cc, registered with
+  // pmo::OrmRegistry so pmo::Storage can skip Reflection.
+  void PrintOrmHeader(const string& basename, GeneratorContext* context) const;
+  void PrintOrmSource(const string& basename, GeneratorContext* context) const;
+  void PrintOrmClassDeclaration(const Descriptor& message_descriptor) const;
+  void PrintOrmClassDefinition(const Descriptor& message_descriptor) const;
+  void PrintOrmBuildSave(const Descriptor& message_descriptor) const;
+  void PrintOrmBuildSelect(const Descriptor& message_descriptor) const;
+  void PrintOrmDecodeRow(const Descriptor& message_descriptor) const;
+
   // Very coarse-grained lock to ensure that Generate() is reentrant.
   // Guards file_, printer_ and file_descriptor_serialized_.
   mutable Mutex mutex_;
@@ -0,0 +1,462 @@
+#include "async_storage.h"
+
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <google/protobuf/message.h>
+
+#include "connection_pool.h"
+#include "message_orm.h"
+#include "storage.h"
+#include "table_schema.h"
+
+namespace pmo {
+
+// epoll events taken per epoll_wait().
+static const int kMaxEvents = 64;
+
+static int waitOf(uint32_t events) {
+    int wait = 0;
+    if (events & EPOLLIN) {
+        wait |= MYSQL_WAIT_READ;
+    }
+    if (events & EPOLLOUT) {
+        wait |= MYSQL_WAIT_WRITE;
+    }
+    if (events & EPOLLPRI) {
+        wait |= MYSQL_WAIT_EXCEPT;
+    }
+    // Errors surface from the next read or write.
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        wait |= MYSQL_WAIT_READ | MYSQL_WAIT_WRITE;
+    }
+    return wait;
+}
+
+AsyncStorage::AsyncStorage(Storage &storage, const AsyncStorageOptions &options) :
+        storage_(storage),
+        options_(options),
+        epoll_fd_(::epoll_create1(EPOLL_CLOEXEC)),
+        running_(0) {
+    if (epoll_fd_ < 0) {
+        printf("epoll_create1 failed.\n");
+    }
+    if (options_.connections == 0) {
+        options_.connections = 1;
+    }
+
+    ConnectionPool::initLibrary();
+    // Connections are registered with epoll by address, the vector is
+    // never resized after this.
+    connections_.resize(options_.connections);
+    for (size_t i = 0; i < connections_.size(); ++i) {
+        advance(connections_[i], 0);
+    }
+}
+
+AsyncStorage::~AsyncStorage() {
+    for (size_t i = 0; i < connections_.size(); ++i) {
+        close(connections_[i]);
+    }
+    while (queue_.empty() == false) {
+        finish(queue_.front(), false, NULL);
+        queue_.pop_front();
+    }
+    runCallbacks();
+
+    if (epoll_fd_ >= 0) {
+        ::close(epoll_fd_);
+    }
+}
+
+void AsyncStorage::loadAsync(const ::google::protobuf::Message &query, const LoadCallback &callback) {
+    loadAsync(Query(query), callback);
+}
+
+void AsyncStorage::loadAsync(const Query &query, const LoadCallback &callback) {
+    Request *request = new Request();
+    request->message.reset(query.filter().New());
+    request->message->CopyFrom(query.filter());
+    request->query.reset(new Query(*request->message));
+
+    if (query.fields() != NULL) {
+        request->fields = *query.fields();
+        request->query->select(request->fields);
+    }
+    if (query.lower() != NULL) {
+        request->lower.reset(query.lower()->New());
+        request->lower->CopyFrom(*query.lower());
+        request->query->lowerBound(*request->lower, query.lowerInclusive());
+    }
+    if (query.upper() != NULL) {
+        request->upper.reset(query.upper()->New());
+        request->upper->CopyFrom(*query.upper());
+        request->query->upperBound(*request->upper, query.upperInclusive());
+    }
+    if (query.position() != NULL) {
+        request->query->after(*query.position());
+    }
+    if (query.ordered()) {
+        request->query->orderByKey(query.descending());
+    }
+    request->query->limit(query.limitCount());
+
+    request->load_callback = callback;
+    enqueue(request);
+}
+
+void AsyncStorage::saveAsync(const ::google::protobuf::Message &message, const SaveCallback &callback) {
+    Request *request = new Request();
+    request->save = true;
+    request->message.reset(message.New());
+    request->message->CopyFrom(message);
+    request->save_callback = callback;
+    enqueue(request);
+}
+
+size_t AsyncStorage::poll(int timeout_ms) {
+    Clock::time_point now = Clock::now();
+    if (completed_.empty() == false) {
+        timeout_ms = 0;
+    }
+
+    // Wake up for the earliest client timeout or reconnect too.
+    for (size_t i = 0; i < connections_.size() && timeout_ms != 0; ++i) {
+        const Connection &connection = connections_[i];
+        Clock::time_point wake;
+        if (connection.state == CLOSED) {
+            wake = connection.retry;
+        } else if (connection.wait & MYSQL_WAIT_TIMEOUT) {
+            wake = connection.deadline;
+        } else {
+            continue;
+        }
+        int ms = wake <= now ? 0 :
+            (int)std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() + 1;
+        if (timeout_ms < 0 || ms < timeout_ms) {
+            timeout_ms = ms;
+        }
+    }
+
+    struct epoll_event events[kMaxEvents];
+    int count = epoll_fd_ >= 0 ? ::epoll_wait(epoll_fd_, events, kMaxEvents, timeout_ms) : 0;
+    for (int i = 0; i < count; ++i) {
+        Connection &connection = *static_cast<Connection *>(events[i].data.ptr);
+        if (connection.state == IDLE) {
+            // Nothing was sent, the server closed the connection.
+            close(connection);
+            continue;
+        }
+        advance(connection, waitOf(events[i].events));
+    }
+
+    now = Clock::now();
+    for (size_t i = 0; i < connections_.size(); ++i) {
+        Connection &connection = connections_[i];
+        if (connection.state == CLOSED) {
+            if (now >= connection.retry) {
+                advance(connection, 0);
+            }
+        } else if ((connection.wait & MYSQL_WAIT_TIMEOUT) && now >= connection.deadline) {
+            advance(connection, MYSQL_WAIT_TIMEOUT);
+        } else if (connection.state == IDLE && queue_.empty() == false) {
+            advance(connection, 0);
+        }
+    }
+
+    return runCallbacks();
+}
+
+size_t AsyncStorage::runCallbacks() {
+    // Callbacks may queue more requests, they are dispatched right away.
+    std::vector<Request *> done;
+    done.swap(completed_);
+    for (size_t i = 0; i < done.size(); ++i) {
+        Request *request = done[i];
+        if (request->save) {
+            if (request->save_callback) {
+                request->save_callback(request->ok);
+            }
+        } else if (request->load_callback) {
+            request->load_callback(request->ok, request->rows);
+        }
+        for (size_t j = 0; j < request->rows.size(); ++j) {
+            delete request->rows[j];
+        }
+        delete request;
+    }
+    return done.size();
+}
+
+void AsyncStorage::enqueue(Request *request) {
+    queue_.push_back(request);
+    for (size_t i = 0; i < connections_.size() && queue_.empty() == false; ++i) {
+        if (connections_[i].state == IDLE) {
+            advance(connections_[i], 0);
+        }
+    }
+}
+
+void AsyncStorage::advance(Connection &connection, int events) {
+    const ConnectionPoolOptions &options = storage_.pool_.options();
+
+    for (;;) {
+        // A started call only continues once what it waits for is ready.
+        if (connection.started && events == 0) {
+            return;
+        }
+
+        int status = 0;
+        switch (connection.state) {
+            case CLOSED:
+                if (Clock::now() < connection.retry) {
+                    return;
+                }
+                connection.mysql = ::mysql_init(NULL);
+                if (connection.mysql == NULL) {
+                    printf("mysql_init failed.\n");
+                    connection.retry = Clock::now() + std::chrono::milliseconds(options_.reconnect_interval_ms);
+                    failQueued();
+                    return;
+                }
+                ::mysql_options(connection.mysql, MYSQL_OPT_NONBLOCK, 0);
+                connection.state = CONNECTING;
+                connection.started = false;
+                continue;
+
+            case CONNECTING:
+                status = connection.started ?
+                    ::mysql_real_connect_cont(&connection.connected, connection.mysql, events) :
+                    ::mysql_real_connect_start(&connection.connected, connection.mysql, options.host.c_str(),
+                        options.user.c_str(), options.passwd.c_str(), options.database.c_str(),
+                        options.port, NULL, 0);
+                break;
+
+            case IDLE:
+                if (dispatch(connection) == false) {
+                    if (queue_.empty()) {
+                        watch(connection, 0);
+                        return;
+                    }
+                    continue;
+                }
+                connection.state = QUERYING;
+                connection.started = false;
+                status = ::mysql_real_query_start(&connection.error, connection.mysql,
+                    connection.sql.str().data(), connection.sql.size());
+                break;
+
+            case QUERYING:
+                status = ::mysql_real_query_cont(&connection.error, connection.mysql, events);
+                break;
+
+            case STORING:
+                status = connection.started ?
+                    ::mysql_store_result_cont(&connection.res, connection.mysql, events) :
+                    ::mysql_store_result_start(&connection.res, connection.mysql);
+                break;
+        }
+
+        connection.started = true;
+        events = 0;
+        if (status != 0) {
+            watch(connection, status);
+            return;
+        }
+        completed(connection);
+    }
+}
+
+bool AsyncStorage::dispatch(Connection &connection) {
+    if (queue_.empty()) {
+        return false;
+    }
+    Request *request = queue_.front();
+    queue_.pop_front();
+
+    SqlBuilder &sql = connection.sql;
+    sql.reset(connection.mysql);
+    bool ret;
+    if (request->save) {
+        request->sample.reset(new Metrics::Sample(storage_.metrics_, request->message->GetDescriptor(),
+            Metrics::SAVE));
+        request->sample->addRowsOut(1);
+        ret = storage_.buildSave(sql, *request->message);
+    } else {
+        const Query &query = *request->query;
+        const ::google::protobuf::Message &filter = query.filter();
+        request->sample.reset(new Metrics::Sample(storage_.metrics_, filter.GetDescriptor(), Metrics::LOAD));
+        // Same choice of generated code as Storage::loadRows().
+        if (TableSchema::get(filter.GetDescriptor())->blobStorage() == false && query.fields() == NULL &&
+                query.isPlain()) {
+            request->orm = OrmRegistry::instance().find(filter.GetTypeName());
+        }
+        ret = storage_.buildSelect(sql, request->orm, query);
+    }
+
+    if (ret == false) {
+        finish(request, false, NULL);
+        return false;
+    }
+
+    request->sample->addBytesOut(sql.size());
+    request->sample->mark(Metrics::BUILD);
+    connection.request = request;
+    ++running_;
+    return true;
+}
+
+void AsyncStorage::completed(Connection &connection) {
+    const ConnectionPoolOptions &options = storage_.pool_.options();
+
+    switch (connection.state) {
+        case CONNECTING:
+            if (connection.connected == NULL) {
+                printf("mysql_real_connect(%s:%u/%s) failed: %s.\n", options.host.c_str(),
+                    options.port, options.database.c_str(), ::mysql_error(connection.mysql));
+                close(connection);
+                failQueued();
+                return;
+            }
+            connection.state = IDLE;
+            connection.started = false;
+            return;
+
+        case QUERYING:
+            if (connection.error != 0) {
+                printf("mysql_real_query failed: %s.\n", ::mysql_error(connection.mysql));
+                Request *request = connection.request;
+                connection.request = NULL;
+                --running_;
+                finish(request, false, NULL);
+                connection.state = IDLE;
+                connection.started = false;
+                // Client errors leave the connection unusable.
+                if (::mysql_errno(connection.mysql) >= 2000) {
+                    close(connection);
+                }
+                return;
+            }
+            connection.state = STORING;
+            connection.started = false;
+            return;
+
+        case STORING: {
+            Request *request = connection.request;
+            connection.request = NULL;
+            --running_;
+            storage_.metrics_.slowQuery(request->sample->mark(Metrics::ROUND_TRIP), connection.sql.str());
+
+            bool ok = connection.res != NULL || ::mysql_field_count(connection.mysql) == 0;
+            if (ok == false) {
+                printf("mysql_store_result failed: %s.\n", ::mysql_error(connection.mysql));
+            }
+            finish(request, ok, connection.res);
+            if (connection.res != NULL) {
+                ::mysql_free_result(connection.res);
+                connection.res = NULL;
+            }
+            connection.state = IDLE;
+            connection.started = false;
+            if (ok == false && ::mysql_errno(connection.mysql) >= 2000) {
+                close(connection);
+            }
+            return;
+        }
+
+        default:
+            return;
+    }
+}
+
+void AsyncStorage::watch(Connection &connection, int status) {
+    connection.wait = status;
+    if (status & MYSQL_WAIT_TIMEOUT) {
+        connection.deadline = Clock::now() + std::chrono::seconds(::mysql_get_timeout_value(connection.mysql));
+    }
+    if (epoll_fd_ < 0) {
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = 0;
+    if (status & MYSQL_WAIT_READ) {
+        event.events |= EPOLLIN;
+    }
+    if (status & MYSQL_WAIT_WRITE) {
+        event.events |= EPOLLOUT;
+    }
+    if (status & MYSQL_WAIT_EXCEPT) {
+        event.events |= EPOLLPRI;
+    }
+    event.data.ptr = &connection;
+
+    // The socket changes when the connection is reopened.
+    int fd = ::mysql_get_socket(connection.mysql);
+    if (fd == connection.fd) {
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event);
+        return;
+    }
+    if (connection.fd >= 0) {
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection.fd, NULL);
+    }
+    connection.fd = fd;
+    if (fd >= 0 && ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+        printf("epoll_ctl(%d) failed.\n", fd);
+    }
+}
+
+void AsyncStorage::close(Connection &connection) {
+    if (connection.request != NULL) {
+        --running_;
+        finish(connection.request, false, NULL);
+        connection.request = NULL;
+    }
+    if (connection.res != NULL) {
+        ::mysql_free_result(connection.res);
+        connection.res = NULL;
+    }
+    if (connection.fd >= 0 && epoll_fd_ >= 0) {
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection.fd, NULL);
+    }
+    if (connection.mysql != NULL) {
+        ::mysql_close(connection.mysql);
+    }
+
+    connection.mysql = NULL;
+    connection.connected = NULL;
+    connection.state = CLOSED;
+    connection.started = false;
+    connection.fd = -1;
+    connection.wait = 0;
+    connection.retry = Clock::now() + std::chrono::milliseconds(options_.reconnect_interval_ms);
+}
+
+void AsyncStorage::finish(Request *request, bool ok, MYSQL_RES *res) {
+    if (request->save) {
+        storage_.saved(*request->message, ok);
+    } else if (ok && res != NULL) {
+        ok = Storage::decodeRows(res, request->query->filter(), request->orm, request->rows, *request->sample);
+    }
+
+    request->ok = ok;
+    if (request->sample) {
+        request->sample->setFailed(ok == false);
+        request->sample.reset();
+    }
+    completed_.push_back(request);
+}
+
+void AsyncStorage::failQueued() {
+    for (size_t i = 0; i < connections_.size(); ++i) {
+        if (connections_[i].state != CLOSED) {
+            return;
+        }
+    }
+    while (queue_.empty() == false) {
+        finish(queue_.front(), false, NULL);
+        queue_.pop_front();
+    }
+}
+
+}  // namespace pmo
@@ -0,0 +1,167 @@
+#ifndef PMO_ASYNC_STORAGE_H
+#define PMO_ASYNC_STORAGE_H
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <mysql.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h"
+#include "query.h"
+#include "sql_builder.h"
+
+namespace google {
+namespace protobuf {
+
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+class MessageOrm;
+class Storage;
+
+struct AsyncStorageOptions {
+    AsyncStorageOptions() :
+            connections(4),
+            reconnect_interval_ms(1000) {}
+
+    // Non-blocking connections the requests are multiplexed over, each runs
+    // one statement at a time.
+    size_t connections;
+    // A connection that failed is reopened after this long.
+    uint32_t reconnect_interval_ms;
+};
+
+// Non-blocking loads and saves for a single threaded event loop, built on
+// the MariaDB client's mysql_*_start() / mysql_*_cont() calls, so it needs
+// libmariadb rather than libmysqlclient.
+//
+// Requests are queued and dispatched to the first idle connection, every
+// connection socket is watched by one epoll instance. The owner drives it
+// by calling poll() from its loop, or waits on fd() with its own poller
+// first; callbacks run inside poll(). Nothing is thread safe, every call
+// must come from the loop thread.
+//
+// SQL text, decoding, metrics and the load cache bookkeeping of saves are
+// shared with |storage|, which also gives the connection options. Loads
+// never read the cache, prepared statements and stored procedures are not
+// used.
+class AsyncStorage {
+public:
+    // |rows| are owned by the callback, rows it leaves in the vector are
+    // deleted when it returns.
+    typedef std::function<void (bool ok, std::vector<google::protobuf::Message *> &rows)> LoadCallback;
+    typedef std::function<void (bool ok)> SaveCallback;
+
+    AsyncStorage(Storage &storage, const AsyncStorageOptions &options = AsyncStorageOptions());
+    // Outstanding requests are failed, their callbacks run from here and
+    // must not queue new ones.
+    ~AsyncStorage();
+
+    // The messages are copied, they need not outlive the call.
+    void loadAsync(const google::protobuf::Message &query, const LoadCallback &callback);
+    void loadAsync(const Query &query, const LoadCallback &callback);
+    void saveAsync(const google::protobuf::Message &message, const SaveCallback &callback = SaveCallback());
+
+    // Advances every connection with pending I/O, dispatches queued
+    // requests and runs the callbacks of finished ones. Waits up to
+    // |timeout_ms| for I/O when nothing is ready, -1 waits until something
+    // is. Returns the number of finished requests.
+    size_t poll(int timeout_ms = 0);
+
+    // The epoll descriptor, readable when poll() has I/O to process.
+    int fd() const { return epoll_fd_; }
+    // Requests whose callback has not run yet.
+    size_t pending() const { return queue_.size() + running_ + completed_.size(); }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Request {
+        Request() : save(false), orm(NULL), ok(false) {}
+
+        bool save;
+        // Copies of what |query| points to.
+        std::unique_ptr<google::protobuf::Message> message;
+        std::unique_ptr<google::protobuf::Message> lower;
+        std::unique_ptr<google::protobuf::Message> upper;
+        Query::FieldList fields;
+        std::unique_ptr<Query> query;
+        const MessageOrm *orm;
+        LoadCallback load_callback;
+        SaveCallback save_callback;
+        std::unique_ptr<Metrics::Sample> sample;
+        bool ok;
+        std::vector<google::protobuf::Message *> rows;
+    };
+
+    enum State {
+        CLOSED,
+        CONNECTING,
+        IDLE,
+        QUERYING,
+        STORING
+    };
+
+    struct Connection {
+        Connection() : mysql(NULL), state(CLOSED), started(false), fd(-1), wait(0),
+                request(NULL), connected(NULL), error(0), res(NULL) {}
+
+        MYSQL *mysql;
+        State state;
+        // Whether the _start() call of |state| was made, the next one is
+        // _cont().
+        bool started;
+        // Socket registered with epoll, -1 when none.
+        int fd;
+        // MYSQL_WAIT_* the pending _cont() call waits for.
+        int wait;
+        Clock::time_point deadline;
+        Clock::time_point retry;
+        Request *request;
+        SqlBuilder sql;
+        // Results of the _start() / _cont() calls.
+        MYSQL *connected;
+        int error;
+        MYSQL_RES *res;
+    };
+
+    AsyncStorage(const AsyncStorage &);
+    AsyncStorage &operator=(const AsyncStorage &);
+
+    void enqueue(Request *request);
+    // Runs |connection| as far as it goes without blocking, |events| are
+    // the MYSQL_WAIT_* that are ready.
+    void advance(Connection &connection, int events);
+    // Takes the next queued request and builds its statement, returns false
+    // when there is nothing to send.
+    bool dispatch(Connection &connection);
+    void completed(Connection &connection);
+    void watch(Connection &connection, int status);
+    void close(Connection &connection);
+    // Queues the callback of |request|, callbacks only run from poll().
+    void finish(Request *request, bool ok, MYSQL_RES *res);
+    // Fails the queued requests when no connection is open or opening.
+    void failQueued();
+    size_t runCallbacks();
+
+    Storage &storage_;
+    AsyncStorageOptions options_;
+    int epoll_fd_;
+    std::vector<Connection> connections_;
+    std::deque<Request *> queue_;
+    size_t running_;
+    std::vector<Request *> completed_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_ASYNC_STORAGE_H
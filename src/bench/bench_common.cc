@@ -0,0 +1,287 @@
+#include "bench_common.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/message.h>
+
+#include "pmo_options.pb.h"
+
+namespace pmo {
+namespace bench {
+
+static const ::google::protobuf::FieldDescriptorProto::Type kFieldTypes[] = {
+    ::google::protobuf::FieldDescriptorProto::TYPE_INT32,
+    ::google::protobuf::FieldDescriptorProto::TYPE_INT64,
+    ::google::protobuf::FieldDescriptorProto::TYPE_UINT32,
+    ::google::protobuf::FieldDescriptorProto::TYPE_DOUBLE,
+    ::google::protobuf::FieldDescriptorProto::TYPE_STRING,
+    ::google::protobuf::FieldDescriptorProto::TYPE_BOOL,
+};
+static const size_t kFieldTypeCount = sizeof(kFieldTypes) / sizeof(kFieldTypes[0]);
+
+bool parseOptions(int argc, char **argv, BenchOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *equal = strchr(arg, '=');
+        if (strncmp(arg, "--", 2) != 0 || equal == NULL) {
+            printf("Bad argument(%s).\n", arg);
+            return false;
+        }
+
+        std::string name(arg + 2, equal - arg - 2);
+        const char *value = equal + 1;
+        if (name == "host") {
+            options.host = value;
+        } else if (name == "user") {
+            options.user = value;
+        } else if (name == "passwd") {
+            options.passwd = value;
+        } else if (name == "database") {
+            options.database = value;
+        } else if (name == "port") {
+            options.port = (uint32_t)strtoul(value, NULL, 10);
+        } else if (name == "width") {
+            options.width = (size_t)strtoul(value, NULL, 10);
+        } else if (name == "rows") {
+            options.rows = (size_t)strtoul(value, NULL, 10);
+        } else if (name == "threads") {
+            options.threads = std::max<size_t>(1, strtoul(value, NULL, 10));
+        } else if (name == "batch") {
+            options.batch = std::max<size_t>(1, strtoul(value, NULL, 10));
+        } else if (name == "string_length") {
+            options.string_length = std::max<size_t>(1, strtoul(value, NULL, 10));
+        } else if (name == "repeat") {
+            options.repeat = std::max<size_t>(1, strtoul(value, NULL, 10));
+        } else if (name == "prepared") {
+            options.prepared = strtol(value, NULL, 10) != 0;
+        } else if (name == "metrics") {
+            options.metrics = strtol(value, NULL, 10) != 0;
+        } else if (name == "only") {
+            options.only = value;
+        } else {
+            printf("Unknown option(%s).\n", name.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+void printUsage(const char *program) {
+    printf("Usage: %s [--name=value ...]\n"
+        "  --host --port --user --passwd --database   MySQL server (127.0.0.1:3307/pmo_bench)\n"
+        "  --width=16          payload fields per row\n"
+        "  --rows=10000        rows per benchmark\n"
+        "  --threads=4         concurrent clients\n"
+        "  --batch=500         rows per batched save\n"
+        "  --string_length=32  length of string fields\n"
+        "  --repeat=10         passes of each micro-benchmark\n"
+        "  --prepared=0        use server side prepared statements\n"
+        "  --metrics=0         print Storage metrics at the end\n"
+        "  --only=a,b          run only the named benchmarks\n", program);
+}
+
+bool selected(const BenchOptions &options, const std::string &name) {
+    if (options.only.empty()) {
+        return true;
+    }
+    std::string list = "," + options.only + ",";
+    return list.find("," + name + ",") != std::string::npos;
+}
+
+BenchTable::BenchTable(size_t width, size_t string_length) :
+        string_length_(string_length),
+        descriptor_(NULL),
+        prototype_(NULL) {
+    ::google::protobuf::FileDescriptorProto file;
+    file.set_name("pmo_bench.proto");
+    file.set_package("pmo.bench");
+
+    ::google::protobuf::DescriptorProto *message = file.add_message_type();
+    message->set_name("BenchRow");
+
+    ::google::protobuf::FieldDescriptorProto *id = message->add_field();
+    id->set_name("id");
+    id->set_number(1);
+    id->set_type(::google::protobuf::FieldDescriptorProto::TYPE_UINT64);
+    id->set_label(::google::protobuf::FieldDescriptorProto::LABEL_OPTIONAL);
+    id->mutable_options()->SetExtension(pmo::primary_key, true);
+
+    for (size_t i = 0; i < width; ++i) {
+        ::google::protobuf::FieldDescriptorProto *field = message->add_field();
+        char name[32];
+        snprintf(name, sizeof(name), "f%zu", i + 1);
+        field->set_name(name);
+        field->set_number(i + 2);
+        field->set_type(kFieldTypes[i % kFieldTypeCount]);
+        field->set_label(::google::protobuf::FieldDescriptorProto::LABEL_OPTIONAL);
+    }
+
+    const ::google::protobuf::FileDescriptor *file_descriptor = pool_.BuildFile(file);
+    if (file_descriptor == NULL) {
+        printf("BuildFile(pmo_bench.proto) failed.\n");
+        abort();
+    }
+    descriptor_ = file_descriptor->message_type(0);
+    prototype_ = factory_.GetPrototype(descriptor_);
+}
+
+void BenchTable::fill(::google::protobuf::Message *message, uint64_t id) const {
+    const ::google::protobuf::Reflection *reflection = message->GetReflection();
+    reflection->SetUInt64(message, descriptor_->field(0), id);
+
+    for (int i = 1; i < descriptor_->field_count(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor_->field(i);
+        switch (field_descriptor->cpp_type()) {
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+                reflection->SetInt32(message, field_descriptor, (int32_t)(id * 31 + i) - 1000);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+                reflection->SetInt64(message, field_descriptor, (int64_t)(id << 20) + i);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+                reflection->SetUInt32(message, field_descriptor, (uint32_t)(id + i));
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+                reflection->SetDouble(message, field_descriptor, id * 0.5 + i);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+                std::string value(string_length_, 'a');
+                for (size_t k = 0; k < value.size(); ++k) {
+                    value[k] = k % 16 == 15 ? '\'' : (char)('a' + (id + i + k) % 26);
+                }
+                reflection->SetString(message, field_descriptor, value);
+                break;
+            }
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+                reflection->SetBool(message, field_descriptor, ((id + i) & 1) != 0);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void BenchTable::cells(uint64_t id, std::vector<std::string> &cells) const {
+    ::google::protobuf::Message *message = newMessage();
+    fill(message, id);
+    const ::google::protobuf::Reflection *reflection = message->GetReflection();
+
+    cells.resize(descriptor_->field_count());
+    char buffer[64];
+    for (int i = 0; i < descriptor_->field_count(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor_->field(i);
+        switch (field_descriptor->cpp_type()) {
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+                snprintf(buffer, sizeof(buffer), "%d", reflection->GetInt32(*message, field_descriptor));
+                cells[i] = buffer;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+                snprintf(buffer, sizeof(buffer), "%lld", (long long)reflection->GetInt64(*message, field_descriptor));
+                cells[i] = buffer;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+                snprintf(buffer, sizeof(buffer), "%u", reflection->GetUInt32(*message, field_descriptor));
+                cells[i] = buffer;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+                snprintf(buffer, sizeof(buffer), "%llu",
+                    (unsigned long long)reflection->GetUInt64(*message, field_descriptor));
+                cells[i] = buffer;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+                snprintf(buffer, sizeof(buffer), "%.17g", reflection->GetDouble(*message, field_descriptor));
+                cells[i] = buffer;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+                cells[i] = reflection->GetString(*message, field_descriptor);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+                cells[i] = reflection->GetBool(*message, field_descriptor) ? "1" : "0";
+                break;
+            default:
+                cells[i].clear();
+                break;
+        }
+    }
+    delete message;
+}
+
+std::string BenchTable::dropTableSql() const {
+    return "DROP TABLE IF EXISTS `" + descriptor_->full_name() + "`";
+}
+
+std::string BenchTable::createTableSql() const {
+    std::string sql = "CREATE TABLE `" + descriptor_->full_name() + "` (`id` BIGINT UNSIGNED NOT NULL";
+    char varchar[32];
+    snprintf(varchar, sizeof(varchar), "VARCHAR(%zu)", string_length_);
+
+    for (int i = 1; i < descriptor_->field_count(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor_->field(i);
+        sql += ", `" + field_descriptor->name() + "` ";
+        switch (field_descriptor->cpp_type()) {
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+                sql += "INT";
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+                sql += "BIGINT";
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+                sql += "INT UNSIGNED";
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+                sql += "DOUBLE";
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+                sql += varchar;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+                sql += "TINYINT";
+                break;
+            default:
+                sql += "BLOB";
+                break;
+        }
+    }
+    sql += ", PRIMARY KEY (`id`)) ENGINE=InnoDB DEFAULT CHARSET=utf8";
+    return sql;
+}
+
+SyntheticResult::SyntheticResult(const BenchTable &table, size_t rows) :
+        cells_(rows),
+        pointers_(rows),
+        lengths_(rows) {
+    for (size_t i = 0; i < rows; ++i) {
+        table.cells(i + 1, cells_[i]);
+        for (size_t j = 0; j < cells_[i].size(); ++j) {
+            pointers_[i].push_back(&cells_[i][j][0]);
+            lengths_[i].push_back(cells_[i][j].size());
+        }
+    }
+}
+
+void LatencyRecorder::merge(const LatencyRecorder &other) {
+    samples_.insert(samples_.end(), other.samples_.begin(), other.samples_.end());
+}
+
+void LatencyRecorder::report(const std::string &name, uint64_t ops, uint64_t elapsed_ns) {
+    double seconds = elapsed_ns / 1e9;
+    double rate = seconds > 0 ? ops / seconds : 0;
+
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+    if (samples_.empty() == false) {
+        std::sort(samples_.begin(), samples_.end());
+        p50 = samples_[(samples_.size() - 1) * 50 / 100];
+        p99 = samples_[(samples_.size() - 1) * 99 / 100];
+    }
+
+    printf("%-12s %10llu ops in %8.3f s, %12.1f ops/s, p50 %9.1f us, p99 %9.1f us\n",
+        name.c_str(), (unsigned long long)ops, seconds, rate, p50 / 1e3, p99 / 1e3);
+}
+
+}  // namespace bench
+}  // namespace pmo
@@ -0,0 +1,135 @@
+#ifndef PMO_BENCH_COMMON_H
+#define PMO_BENCH_COMMON_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/dynamic_message.h>
+#include <mysql.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+namespace bench {
+
+struct BenchOptions {
+    BenchOptions() :
+            host("127.0.0.1"),
+            user("root"),
+            database("pmo_bench"),
+            port(3307),
+            width(16),
+            rows(10000),
+            threads(4),
+            batch(500),
+            string_length(32),
+            repeat(10),
+            prepared(false),
+            metrics(false) {}
+
+    std::string host;
+    std::string user;
+    std::string passwd;
+    std::string database;
+    uint32_t port;
+
+    // Payload fields next to the `id` primary key.
+    size_t width;
+    size_t rows;
+    size_t threads;
+    // Rows per batched save.
+    size_t batch;
+    size_t string_length;
+    // Passes over the rows of each micro-benchmark.
+    size_t repeat;
+    bool prepared;
+    // Prints Storage::dumpMetrics() at the end.
+    bool metrics;
+    // Comma separated benchmark names, empty runs all.
+    std::string only;
+};
+
+// Parses --name=value arguments, returns false on an unknown one.
+bool parseOptions(int argc, char **argv, BenchOptions &options);
+void printUsage(const char *program);
+bool selected(const BenchOptions &options, const std::string &name);
+
+inline uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Message type built at run time: an uint64 `id` primary key followed by
+// |width| fields cycling through int32, int64, uint32, double, string and
+// bool, so row width can be varied without regenerating code.
+class BenchTable {
+public:
+    BenchTable(size_t width, size_t string_length);
+
+    const google::protobuf::Descriptor *descriptor() const { return descriptor_; }
+    google::protobuf::Message *newMessage() const { return prototype_->New(); }
+
+    // Deterministic values for row |id|, strings contain quotes so escaping
+    // is exercised.
+    void fill(google::protobuf::Message *message, uint64_t id) const;
+
+    // The text protocol cells MySQL would return for row |id|.
+    void cells(uint64_t id, std::vector<std::string> &cells) const;
+
+    std::string dropTableSql() const;
+    std::string createTableSql() const;
+
+private:
+    BenchTable(const BenchTable &);
+    BenchTable &operator=(const BenchTable &);
+
+    size_t string_length_;
+    google::protobuf::DescriptorPool pool_;
+    google::protobuf::DynamicMessageFactory factory_;
+    const google::protobuf::Descriptor *descriptor_;
+    const google::protobuf::Message *prototype_;
+};
+
+// An in-memory stand-in for a MYSQL_RES: rows of NUL terminated cells.
+class SyntheticResult {
+public:
+    SyntheticResult(const BenchTable &table, size_t rows);
+
+    size_t rows() const { return cells_.size(); }
+    MYSQL_ROW row(size_t i) { return &pointers_[i][0]; }
+    const unsigned long *lengths(size_t i) const { return &lengths_[i][0]; }
+
+private:
+    std::vector<std::vector<std::string> > cells_;
+    std::vector<std::vector<char *> > pointers_;
+    std::vector<std::vector<unsigned long> > lengths_;
+};
+
+// Per operation latencies of one benchmark, merged across threads.
+class LatencyRecorder {
+public:
+    void add(uint64_t ns) { samples_.push_back(ns); }
+    void merge(const LatencyRecorder &other);
+
+    // "name: N ops in X s, Y ops/s, p50 Z us, p99 W us". |ops| may differ
+    // from the sample count when one sample covers several rows.
+    void report(const std::string &name, uint64_t ops, uint64_t elapsed_ns);
+
+private:
+    std::vector<uint64_t> samples_;
+};
+
+}  // namespace bench
+}  // namespace pmo
+
+#endif  // PMO_BENCH_COMMON_H
@@ -0,0 +1,6 @@
+cd `dirname $0`/..
+protoc --cpp_out=. pmo_options.proto
+LIB_SRCS="storage.cc query.cc parallel_loader.cc connection_pool.cc prepared_statement.cc row_decoder.cc message_orm.cc sql_builder.cc table_schema.cc load_cache.cc bulk_io.cc transaction.cc snapshot_tracker.cc metrics.cc pmo_options.pb.cc"
+LIBS="-lmysqlclient -lprotobuf -lpthread -L/home/taohan/open_src/protobuf/protobuf-2.6.1/src/.libs -L/usr/local/mysql/lib"
+g++ -O2 -g -std=c++11 -I. -o bench/micro_bench bench/micro_bench.cc bench/bench_common.cc $LIB_SRCS $LIBS
+g++ -O2 -g -std=c++11 -I. -o bench/storage_bench bench/storage_bench.cc bench/bench_common.cc $LIB_SRCS $LIBS
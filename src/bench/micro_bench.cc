@@ -0,0 +1,210 @@
+// CPU only benchmarks of the client side work around a statement: row
+// decoding from a synthetic text protocol result set, escaping, SQL
+// construction and the blob storage encoding. No server is needed.
+//
+// Percentiles are over passes (--repeat) of the per-row cost.
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <mysql.h>
+#include <stdio.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "bench_common.h"
+#include "message_orm.h"
+#include "row_decoder.h"
+#include "table_schema.h"
+
+namespace pmo {
+namespace bench {
+
+static void benchDecode(const BenchOptions &options, const BenchTable &table) {
+    SyntheticResult result(table, options.rows);
+
+    std::vector<std::string> column_names;
+    for (int i = 0; i < table.descriptor()->field_count(); ++i) {
+        column_names.push_back(table.descriptor()->field(i)->name());
+    }
+    RowDecoder decoder(table.descriptor(), column_names);
+    std::unique_ptr< ::google::protobuf::Message> message(table.newMessage());
+
+    LatencyRecorder recorder;
+    uint64_t begin = nowNs();
+    for (size_t pass = 0; pass < options.repeat; ++pass) {
+        uint64_t pass_begin = nowNs();
+        for (size_t i = 0; i < result.rows(); ++i) {
+            message->Clear();
+            decoder.decode(result.row(i), result.lengths(i), message.get());
+        }
+        recorder.add((nowNs() - pass_begin) / std::max<size_t>(1, result.rows()));
+    }
+    recorder.report("decode", options.repeat * result.rows(), nowNs() - begin);
+}
+
+static void benchEscape(const BenchOptions &options, const BenchTable &table, MYSQL *mysql) {
+    std::vector<std::string> values;
+    std::unique_ptr< ::google::protobuf::Message> message(table.newMessage());
+    const ::google::protobuf::Reflection *reflection = message->GetReflection();
+    for (size_t i = 0; i < options.rows; ++i) {
+        table.fill(message.get(), i + 1);
+        for (int j = 0; j < table.descriptor()->field_count(); ++j) {
+            const ::google::protobuf::FieldDescriptor *field_descriptor = table.descriptor()->field(j);
+            if (field_descriptor->cpp_type() == ::google::protobuf::FieldDescriptor::CPPTYPE_STRING) {
+                values.push_back(reflection->GetString(*message, field_descriptor));
+            }
+        }
+    }
+    if (values.empty()) {
+        printf("%-12s skipped, no string fields\n", "escape");
+        return;
+    }
+
+    std::string sql;
+    LatencyRecorder recorder;
+    uint64_t begin = nowNs();
+    for (size_t pass = 0; pass < options.repeat; ++pass) {
+        uint64_t pass_begin = nowNs();
+        for (size_t i = 0; i < values.size(); ++i) {
+            sql.clear();
+            appendQuoted(sql, mysql, values[i]);
+        }
+        recorder.add((nowNs() - pass_begin) / values.size());
+    }
+    recorder.report("escape", options.repeat * values.size(), nowNs() - begin);
+}
+
+static void appendValue(std::string &sql, MYSQL *mysql, const ::google::protobuf::Message &message,
+        const ::google::protobuf::FieldDescriptor *field_descriptor) {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            appendNumber(sql, (int32_t)reflection->GetInt32(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            appendNumber(sql, (int64_t)reflection->GetInt64(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            appendNumber(sql, (uint32_t)reflection->GetUInt32(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            appendNumber(sql, (uint64_t)reflection->GetUInt64(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+            appendNumber(sql, reflection->GetDouble(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+            appendQuoted(sql, mysql, reflection->GetString(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+            appendBool(sql, reflection->GetBool(message, field_descriptor));
+            break;
+        default:
+            sql.append("NULL");
+            break;
+    }
+}
+
+// Multi-row upserts of --batch rows, built the way the generated ORM code
+// builds them.
+static void benchBuild(const BenchOptions &options, const BenchTable &table, MYSQL *mysql) {
+    std::vector<std::unique_ptr< ::google::protobuf::Message> > messages(options.rows);
+    for (size_t i = 0; i < messages.size(); ++i) {
+        messages[i].reset(table.newMessage());
+        table.fill(messages[i].get(), i + 1);
+    }
+
+    const TableSchema *schema = TableSchema::get(table.descriptor());
+    std::string sql;
+    LatencyRecorder recorder;
+    uint64_t begin = nowNs();
+    for (size_t pass = 0; pass < options.repeat; ++pass) {
+        uint64_t pass_begin = nowNs();
+        for (size_t first = 0; first < messages.size(); first += options.batch) {
+            size_t last = std::min(messages.size(), first + options.batch);
+            sql.assign("INSERT INTO `").append(table.descriptor()->full_name()).append("` (");
+            for (size_t j = 0; j < schema->columns().size(); ++j) {
+                sql.append(j == 0 ? "`" : ",`").append(schema->columns()[j]->name()).append("`");
+            }
+            sql.append(") VALUES ");
+            for (size_t i = first; i < last; ++i) {
+                sql.append(i == first ? "(" : ",(");
+                for (size_t j = 0; j < schema->columns().size(); ++j) {
+                    if (j != 0) {
+                        sql.append(",");
+                    }
+                    appendValue(sql, mysql, *messages[i], schema->columns()[j]);
+                }
+                sql.append(")");
+            }
+            schema->appendUpsertClause(sql, schema->columns());
+        }
+        recorder.add((nowNs() - pass_begin) / std::max<size_t>(1, messages.size()));
+    }
+    recorder.report("build", options.repeat * messages.size(), nowNs() - begin);
+}
+
+// Encode and decode cost of the blob storage mode.
+static void benchBlob(const BenchOptions &options, const BenchTable &table) {
+    std::vector<std::unique_ptr< ::google::protobuf::Message> > messages(options.rows);
+    for (size_t i = 0; i < messages.size(); ++i) {
+        messages[i].reset(table.newMessage());
+        table.fill(messages[i].get(), i + 1);
+    }
+    std::unique_ptr< ::google::protobuf::Message> parsed(table.newMessage());
+
+    std::string data;
+    LatencyRecorder recorder;
+    uint64_t begin = nowNs();
+    for (size_t pass = 0; pass < options.repeat; ++pass) {
+        uint64_t pass_begin = nowNs();
+        for (size_t i = 0; i < messages.size(); ++i) {
+            data.clear();
+            messages[i]->AppendToString(&data);
+            parsed->ParseFromArray(data.data(), data.size());
+        }
+        recorder.add((nowNs() - pass_begin) / std::max<size_t>(1, messages.size()));
+    }
+    recorder.report("blob", options.repeat * messages.size(), nowNs() - begin);
+}
+
+}  // namespace bench
+}  // namespace pmo
+
+int main(int argc, char **argv) {
+    pmo::bench::BenchOptions options;
+    if (pmo::bench::parseOptions(argc, argv, options) == false) {
+        pmo::bench::printUsage(argv[0]);
+        return 1;
+    }
+
+    pmo::bench::BenchTable table(options.width, options.string_length);
+    printf("micro: width=%zu rows=%zu repeat=%zu string_length=%zu\n",
+        options.width, options.rows, options.repeat, options.string_length);
+
+    // Escaping only needs the character set of an initialized handle.
+    MYSQL *mysql = ::mysql_init(NULL);
+    if (mysql == NULL) {
+        printf("mysql_init failed.\n");
+        return 1;
+    }
+
+    if (pmo::bench::selected(options, "decode")) {
+        pmo::bench::benchDecode(options, table);
+    }
+    if (pmo::bench::selected(options, "escape")) {
+        pmo::bench::benchEscape(options, table, mysql);
+    }
+    if (pmo::bench::selected(options, "build")) {
+        pmo::bench::benchBuild(options, table, mysql);
+    }
+    if (pmo::bench::selected(options, "blob")) {
+        pmo::bench::benchBlob(options, table);
+    }
+
+    ::mysql_close(mysql);
+    return 0;
+}
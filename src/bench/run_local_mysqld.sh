@@ -0,0 +1,52 @@
+#!/bin/sh
+# Starts a throwaway mysqld/MariaDB on 127.0.0.1:$PORT with an empty root
+# password, runs storage_bench against it with the given arguments and
+# shuts it down again. The data directory lives in $BASEDIR and is wiped
+# on every run.
+#
+#   ./run_local_mysqld.sh --rows=100000 --threads=8 --width=32
+
+cd `dirname $0`
+
+PORT=${PORT:-3307}
+BASEDIR=${BASEDIR:-/tmp/pmo_bench_mysqld}
+MYSQLD=${MYSQLD:-mysqld}
+MYSQLADMIN=${MYSQLADMIN:-mysqladmin}
+
+rm -rf $BASEDIR
+mkdir -p $BASEDIR/data
+
+if command -v mariadb-install-db > /dev/null 2>&1; then
+    mariadb-install-db --no-defaults --datadir=$BASEDIR/data --auth-root-authentication-method=normal > $BASEDIR/install.log 2>&1
+elif command -v mysql_install_db > /dev/null 2>&1 && $MYSQLD --version | grep -qi mariadb; then
+    mysql_install_db --no-defaults --datadir=$BASEDIR/data --auth-root-authentication-method=normal > $BASEDIR/install.log 2>&1
+else
+    $MYSQLD --no-defaults --initialize-insecure --datadir=$BASEDIR/data > $BASEDIR/install.log 2>&1
+fi
+if [ $? -ne 0 ]; then
+    echo "initializing $BASEDIR/data failed, see $BASEDIR/install.log"
+    exit 1
+fi
+
+# Durability is traded for speed, this instance only holds benchmark rows.
+$MYSQLD --no-defaults --datadir=$BASEDIR/data --port=$PORT --bind-address=127.0.0.1 \
+    --socket=$BASEDIR/mysqld.sock --pid-file=$BASEDIR/mysqld.pid \
+    --skip-log-bin --innodb-flush-log-at-trx-commit=2 --innodb-buffer-pool-size=512M \
+    --max-connections=512 > $BASEDIR/mysqld.log 2>&1 &
+
+shutdown() {
+    $MYSQLADMIN --no-defaults -h127.0.0.1 -P$PORT -uroot shutdown > /dev/null 2>&1
+}
+trap shutdown EXIT INT TERM
+
+i=0
+until $MYSQLADMIN --no-defaults -h127.0.0.1 -P$PORT -uroot ping > /dev/null 2>&1; do
+    i=`expr $i + 1`
+    if [ $i -gt 60 ]; then
+        echo "mysqld did not start, see $BASEDIR/mysqld.log"
+        exit 1
+    fi
+    sleep 1
+done
+
+./storage_bench --host=127.0.0.1 --port=$PORT --user=root "$@"
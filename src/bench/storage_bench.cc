@@ -0,0 +1,289 @@
+// End to end throughput and latency of Storage against a live server,
+// usually the throwaway one started by run_local_mysqld.sh:
+//
+//   save        single row saves, ids split across --threads
+//   batch_save  batched saves of --batch rows
+//   load        load by primary key
+//   scan        streaming full table scan, one per thread
+//   warmup      full table load split into key ranges by ParallelLoader
+//
+// Each benchmark starts from the rows written by the previous ones, run
+// them together or after a save.
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mysql.h>
+#include <stdio.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "bench_common.h"
+#include "parallel_loader.h"
+#include "storage.h"
+
+namespace pmo {
+namespace bench {
+
+static bool prepareTable(const BenchOptions &options, const BenchTable &table) {
+    MYSQL *mysql = ::mysql_init(NULL);
+    if (mysql == NULL) {
+        printf("mysql_init failed.\n");
+        return false;
+    }
+
+    if (::mysql_real_connect(mysql, options.host.c_str(), options.user.c_str(),
+            options.passwd.c_str(), NULL, options.port, NULL, 0) == NULL) {
+        printf("mysql_real_connect(%s:%u) failed: %s.\n", options.host.c_str(),
+            options.port, ::mysql_error(mysql));
+        ::mysql_close(mysql);
+        return false;
+    }
+
+    std::vector<std::string> statements;
+    statements.push_back("CREATE DATABASE IF NOT EXISTS `" + options.database + "`");
+    statements.push_back("USE `" + options.database + "`");
+    statements.push_back(table.dropTableSql());
+    statements.push_back(table.createTableSql());
+
+    for (size_t i = 0; i < statements.size(); ++i) {
+        if (::mysql_real_query(mysql, statements[i].c_str(), statements[i].size()) != 0) {
+            printf("%s failed: %s.\n", statements[i].c_str(), ::mysql_error(mysql));
+            ::mysql_close(mysql);
+            return false;
+        }
+    }
+
+    ::mysql_close(mysql);
+    return true;
+}
+
+struct RunResult {
+    RunResult() : elapsed_ns(0), ops(0), failed(false) {}
+
+    uint64_t elapsed_ns;
+    // Operations completed by all threads, a failed thread stops early.
+    uint64_t ops;
+    bool failed;
+};
+
+// Runs |work(thread, recorder, ops)| on --threads threads and merges their
+// latencies. Work counts its completed operations in |ops| and returns
+// false on failure.
+template <typename Work>
+static RunResult runThreads(const BenchOptions &options, LatencyRecorder &recorder, Work work) {
+    std::vector<LatencyRecorder> recorders(options.threads);
+    std::vector<uint64_t> ops(options.threads);
+    std::vector<char> failed(options.threads);
+    std::vector<std::thread> threads;
+
+    uint64_t begin = nowNs();
+    for (size_t i = 0; i < options.threads; ++i) {
+        threads.push_back(std::thread([&, i]() {
+            failed[i] = work(i, recorders[i], ops[i]) == false;
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    RunResult result;
+    result.elapsed_ns = nowNs() - begin;
+    for (size_t i = 0; i < recorders.size(); ++i) {
+        recorder.merge(recorders[i]);
+        result.ops += ops[i];
+        result.failed = result.failed || failed[i];
+    }
+    return result;
+}
+
+static bool benchSave(const BenchOptions &options, const BenchTable &table, Storage &storage) {
+    LatencyRecorder recorder;
+    RunResult result = runThreads(options, recorder,
+            [&](size_t thread, LatencyRecorder &thread_recorder, uint64_t &ops) {
+        std::unique_ptr< ::google::protobuf::Message> message(table.newMessage());
+        for (size_t id = thread; id < options.rows; id += options.threads) {
+            table.fill(message.get(), id + 1);
+            uint64_t begin = nowNs();
+            if (storage.save(*message) == false) {
+                printf("save(%zu) failed.\n", id + 1);
+                return false;
+            }
+            thread_recorder.add(nowNs() - begin);
+            ++ops;
+        }
+        return true;
+    });
+    recorder.report("save", result.ops, result.elapsed_ns);
+    return result.failed == false;
+}
+
+// Latencies are per batch, throughput per row.
+static bool benchBatchSave(const BenchOptions &options, const BenchTable &table, Storage &storage) {
+    LatencyRecorder recorder;
+    RunResult result = runThreads(options, recorder,
+            [&](size_t thread, LatencyRecorder &thread_recorder, uint64_t &ops) {
+        std::vector<std::unique_ptr< ::google::protobuf::Message> > messages;
+        std::vector<const ::google::protobuf::Message *> batch;
+        for (size_t first = thread * options.batch; first < options.rows;
+                first += options.threads * options.batch) {
+            size_t last = std::min(options.rows, first + options.batch);
+            messages.resize(last - first);
+            batch.clear();
+            for (size_t id = first; id < last; ++id) {
+                std::unique_ptr< ::google::protobuf::Message> &message = messages[id - first];
+                if (!message) {
+                    message.reset(table.newMessage());
+                }
+                table.fill(message.get(), id + 1);
+                batch.push_back(message.get());
+            }
+
+            uint64_t begin = nowNs();
+            if (storage.save(batch) == false) {
+                printf("save(batch at %zu) failed.\n", first + 1);
+                return false;
+            }
+            thread_recorder.add(nowNs() - begin);
+            ops += batch.size();
+        }
+        return true;
+    });
+    recorder.report("batch_save", result.ops, result.elapsed_ns);
+    return result.failed == false;
+}
+
+static bool benchLoad(const BenchOptions &options, const BenchTable &table, Storage &storage) {
+    LatencyRecorder recorder;
+    RunResult result = runThreads(options, recorder,
+            [&](size_t thread, LatencyRecorder &thread_recorder, uint64_t &ops) {
+        std::unique_ptr< ::google::protobuf::Message> query(table.newMessage());
+        const ::google::protobuf::FieldDescriptor *id_field = table.descriptor()->field(0);
+        std::vector< ::google::protobuf::Message *> results;
+
+        // A fixed stride keeps threads on different rows.
+        uint64_t id = thread * 7919;
+        for (size_t i = thread; i < options.rows; i += options.threads) {
+            id = (id + 104729) % options.rows;
+            query->GetReflection()->SetUInt64(query.get(), id_field, id + 1);
+
+            uint64_t begin = nowNs();
+            if (storage.load(*query, results) == false) {
+                printf("load(%llu) failed.\n", (unsigned long long)(id + 1));
+                return false;
+            }
+            thread_recorder.add(nowNs() - begin);
+            ++ops;
+
+            for (size_t j = 0; j < results.size(); ++j) {
+                delete results[j];
+            }
+            results.clear();
+        }
+        return true;
+    });
+    recorder.report("load", result.ops, result.elapsed_ns);
+    return result.failed == false;
+}
+
+// Latencies are per scan, throughput per row.
+static bool benchScan(const BenchOptions &options, const BenchTable &table, Storage &storage) {
+    LatencyRecorder recorder;
+    RunResult result = runThreads(options, recorder,
+            [&](size_t thread, LatencyRecorder &thread_recorder, uint64_t &rows) {
+        std::unique_ptr< ::google::protobuf::Message> query(table.newMessage());
+
+        uint64_t begin = nowNs();
+        if (storage.load(*query, [&rows](const ::google::protobuf::Message &row) {
+                ++rows;
+                return true;
+            }) == false) {
+            printf("scan failed.\n");
+            return false;
+        }
+        thread_recorder.add(nowNs() - begin);
+        return true;
+    });
+    recorder.report("scan", result.ops, result.elapsed_ns);
+    return result.failed == false;
+}
+
+// One parallel load of the whole table on --threads connections.
+static bool benchWarmup(const BenchOptions &options, const BenchTable &table, Storage &storage) {
+    ParallelLoaderOptions loader_options;
+    loader_options.threads = options.threads;
+    ParallelLoader loader(storage, loader_options);
+
+    std::unique_ptr< ::google::protobuf::Message> filter(table.newMessage());
+    ParallelLoader::Stats stats;
+    LatencyRecorder recorder;
+    uint64_t begin = nowNs();
+    if (loader.load(*filter, [](const ::google::protobuf::Message &row) { return true; }, &stats) == false) {
+        printf("warmup failed.\n");
+        return false;
+    }
+    uint64_t elapsed = nowNs() - begin;
+    recorder.add(elapsed);
+    printf("warmup: %zu partitions\n", stats.partitions);
+    recorder.report("warmup", stats.rows, elapsed);
+    return true;
+}
+
+}  // namespace bench
+}  // namespace pmo
+
+int main(int argc, char **argv) {
+    pmo::bench::BenchOptions options;
+    if (pmo::bench::parseOptions(argc, argv, options) == false) {
+        pmo::bench::printUsage(argv[0]);
+        return 1;
+    }
+
+    pmo::bench::BenchTable table(options.width, options.string_length);
+    if (pmo::bench::prepareTable(options, table) == false) {
+        return 1;
+    }
+
+    pmo::ConnectionPoolOptions pool_options;
+    pool_options.host = options.host;
+    pool_options.database = options.database;
+    pool_options.user = options.user;
+    pool_options.passwd = options.passwd;
+    pool_options.port = options.port;
+    pool_options.min_size = options.threads;
+    pool_options.max_size = options.threads;
+
+    pmo::Storage storage(pool_options);
+    storage.setPreparedStatements(options.prepared);
+
+    printf("storage: width=%zu rows=%zu threads=%zu batch=%zu string_length=%zu prepared=%d\n",
+        options.width, options.rows, options.threads, options.batch, options.string_length,
+        options.prepared ? 1 : 0);
+
+    // A failed benchmark still reports what it completed, the others run.
+    bool ok = true;
+    if (pmo::bench::selected(options, "save")) {
+        ok = pmo::bench::benchSave(options, table, storage) && ok;
+    }
+    if (pmo::bench::selected(options, "batch_save")) {
+        ok = pmo::bench::benchBatchSave(options, table, storage) && ok;
+    }
+    if (pmo::bench::selected(options, "load")) {
+        ok = pmo::bench::benchLoad(options, table, storage) && ok;
+    }
+    if (pmo::bench::selected(options, "scan")) {
+        ok = pmo::bench::benchScan(options, table, storage) && ok;
+    }
+    if (pmo::bench::selected(options, "warmup")) {
+        ok = pmo::bench::benchWarmup(options, table, storage) && ok;
+    }
+
+    if (options.metrics) {
+        printf("%s", storage.dumpMetrics().c_str());
+    }
+    return ok ? 0 : 1;
+}
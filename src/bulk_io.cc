@@ -0,0 +1,280 @@
+#include "bulk_io.h"
+
+#include <istream>
+#include <ostream>
+
+#include <errmsg.h>
+#include <stdio.h>
+#include <string.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+
+#include "sql_builder.h"
+#include "table_schema.h"
+
+namespace pmo {
+
+// Appends |data| escaped for LOAD DATA's default ESCAPED BY '\\'.
+static void appendEscaped(std::string &out, const char *data, size_t size) {
+    size_t begin = 0;
+    for (size_t i = 0; i < size; ++i) {
+        char escape;
+        switch (data[i]) {
+            case '\\':
+                escape = '\\';
+                break;
+            case '\t':
+                escape = 't';
+                break;
+            case '\n':
+                escape = 'n';
+                break;
+            case '\r':
+                escape = 'r';
+                break;
+            case '\0':
+                escape = '0';
+                break;
+            default:
+                continue;
+        }
+        out.append(data + begin, i - begin);
+        out.push_back('\\');
+        out.push_back(escape);
+        begin = i + 1;
+    }
+    out.append(data + begin, size - begin);
+}
+
+InfileStream::InfileStream(const TableSchema *schema, const MessageSource &source, const Abort &abort) :
+        schema_(schema),
+        source_(source),
+        abort_(abort),
+        mysql_(NULL),
+        offset_(0),
+        finished_(false),
+        failed_(false),
+        rows_(0),
+        bytes_(0) {}
+
+void InfileStream::install(MYSQL *mysql) {
+    mysql_ = mysql;
+    ::mysql_set_local_infile_handler(mysql, &InfileStream::init, &InfileStream::read,
+        &InfileStream::end, &InfileStream::error, this);
+}
+
+void InfileStream::restore(MYSQL *mysql) {
+    ::mysql_set_local_infile_default(mysql);
+}
+
+void InfileStream::appendStatement(std::string &sql) const {
+    const TableSchema::FieldList &columns = schema_->columns();
+
+    // The file name is not opened, the callbacks serve the data. Binary
+    // keeps the column bytes as they are.
+    sql.append("LOAD DATA LOCAL INFILE 'pmo' REPLACE INTO TABLE ").append(schema_->quotedTable())
+        .append(" CHARACTER SET binary (");
+    for (size_t i = 0; i < columns.size(); ++i) {
+        if (i != 0) {
+            sql.append(",");
+        }
+        sql.append(schema_->quotedName(columns[i]));
+    }
+    if (schema_->blobStorage()) {
+        sql.append(columns.empty() ? "`" : ",`").append(TableSchema::blobColumn()).append("`");
+    }
+    sql.append(")");
+}
+
+void InfileStream::appendRow(std::string &out, const TableSchema *schema,
+        const ::google::protobuf::Message &message) {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    const TableSchema::FieldList &columns = schema->columns();
+
+    for (size_t i = 0; i < columns.size(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = columns[i];
+        if (i != 0) {
+            out.push_back('\t');
+        }
+        // Unset fields with a proto default are written as that default,
+        // their columns are NOT NULL DEFAULT in the generated schema.
+        if (reflection->HasField(message, field_descriptor) == false &&
+                field_descriptor->has_default_value() == false) {
+            out.append("\\N");
+            continue;
+        }
+
+        switch (field_descriptor->cpp_type()) {
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+                appendNumber(out, (int32_t)reflection->GetInt32(message, field_descriptor));
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+                appendNumber(out, (uint32_t)reflection->GetUInt32(message, field_descriptor));
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+                appendNumber(out, (int64_t)reflection->GetInt64(message, field_descriptor));
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+                appendNumber(out, (uint64_t)reflection->GetUInt64(message, field_descriptor));
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+                appendNumber(out, reflection->GetDouble(message, field_descriptor));
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+                appendNumber(out, reflection->GetFloat(message, field_descriptor));
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+                appendBool(out, reflection->GetBool(message, field_descriptor));
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+                appendNumber(out, (int32_t)reflection->GetEnum(message, field_descriptor)->number());
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+                std::string scratch;
+                const std::string &value = reflection->GetStringReference(message, field_descriptor, &scratch);
+                appendEscaped(out, value.data(), value.size());
+                break;
+            }
+            default:
+                out.append("\\N");
+                break;
+        }
+    }
+
+    if (schema->blobStorage()) {
+        if (columns.empty() == false) {
+            out.push_back('\t');
+        }
+        std::string data;
+        message.AppendToString(&data);
+        appendEscaped(out, data.data(), data.size());
+    }
+    out.push_back('\n');
+}
+
+int InfileStream::init(void **ptr, const char *filename, void *userdata) {
+    *ptr = userdata;
+    return 0;
+}
+
+int InfileStream::read(void *ptr, char *buffer, unsigned int length) {
+    InfileStream *stream = (InfileStream *)ptr;
+
+    // Encode rows until the request can be filled.
+    while (stream->finished_ == false && stream->buffer_.size() - stream->offset_ < length) {
+        if (stream->offset_ != 0) {
+            stream->buffer_.erase(0, stream->offset_);
+            stream->offset_ = 0;
+        }
+        const ::google::protobuf::Message *message = NULL;
+        if (stream->source_(message) == false) {
+            // Returning -1 alone still sends the end of data and the server
+            // would keep the rows read so far, a killed statement is rolled
+            // back.
+            stream->failed_ = true;
+            if (stream->abort_ && stream->abort_(stream->mysql_) == false) {
+                printf("Import could not be aborted, rows read so far may be kept.\n");
+            }
+            return -1;
+        }
+        if (message == NULL) {
+            stream->finished_ = true;
+            break;
+        }
+        appendRow(stream->buffer_, stream->schema_, *message);
+        ++stream->rows_;
+    }
+
+    size_t size = stream->buffer_.size() - stream->offset_;
+    if (size > length) {
+        size = length;
+    }
+    memcpy(buffer, stream->buffer_.data() + stream->offset_, size);
+    stream->offset_ += size;
+    stream->bytes_ += size;
+    return (int)size;
+}
+
+void InfileStream::end(void *ptr) {
+    InfileStream *stream = (InfileStream *)ptr;
+    stream->buffer_.clear();
+    stream->offset_ = 0;
+}
+
+int InfileStream::error(void *ptr, char *message, unsigned int length) {
+    InfileStream *stream = (InfileStream *)ptr;
+    snprintf(message, length, stream->failed_ ? "pmo import source failed" : "pmo import failed");
+    return CR_UNKNOWN_ERROR;
+}
+
+DelimitedWriter::DelimitedWriter(std::ostream &output) :
+        stream_(output),
+        output_(new ::google::protobuf::io::OstreamOutputStream(&output)) {}
+
+DelimitedWriter::~DelimitedWriter() {
+    output_.reset();
+    stream_.flush();
+}
+
+bool DelimitedWriter::write(const ::google::protobuf::Message &message) {
+    // The coded stream returns its unused buffer to output_ when it goes
+    // out of scope.
+    ::google::protobuf::io::CodedOutputStream coded(output_.get());
+    int size = message.ByteSize();
+    coded.WriteVarint32(size);
+    message.SerializeWithCachedSizes(&coded);
+    return coded.HadError() == false;
+}
+
+bool DelimitedWriter::flush() {
+    // The adaptor writes its buffer out when destroyed.
+    output_.reset(new ::google::protobuf::io::OstreamOutputStream(&stream_));
+    stream_.flush();
+    return stream_.good();
+}
+
+DelimitedReader::DelimitedReader(std::istream &input, const ::google::protobuf::Message &prototype) :
+        input_(new ::google::protobuf::io::IstreamInputStream(&input)),
+        message_(prototype.New()),
+        failed_(false) {}
+
+DelimitedReader::~DelimitedReader() {}
+
+const ::google::protobuf::Message *DelimitedReader::next() {
+    if (failed_) {
+        return NULL;
+    }
+
+    // Only the end of the stream before a record is a clean end, a size
+    // cut short is a truncated record.
+    const void *data = NULL;
+    int available = 0;
+    while (available == 0) {
+        if (input_->Next(&data, &available) == false) {
+            return NULL;
+        }
+    }
+    input_->BackUp(available);
+
+    ::google::protobuf::io::CodedInputStream coded(input_.get());
+    uint32_t size = 0;
+    if (coded.ReadVarint32(&size) == false) {
+        printf("DelimitedReader: truncated %s record.\n", message_->GetTypeName().c_str());
+        failed_ = true;
+        return NULL;
+    }
+
+    ::google::protobuf::io::CodedInputStream::Limit limit = coded.PushLimit(size);
+    message_->Clear();
+    if (message_->ParseFromCodedStream(&coded) == false || coded.ConsumedEntireMessage() == false) {
+        printf("DelimitedReader: malformed %s record.\n", message_->GetTypeName().c_str());
+        failed_ = true;
+        return NULL;
+    }
+    coded.PopLimit(limit);
+    return message_.get();
+}
+
+}  // namespace pmo
@@ -0,0 +1,140 @@
+#ifndef PMO_BULK_IO_H
+#define PMO_BULK_IO_H
+
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <string>
+
+#include <mysql.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class Message;
+
+namespace io {
+
+class IstreamInputStream;
+class OstreamOutputStream;
+
+}  // namespace io
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+class TableSchema;
+
+// Sets |message| to the next message to import, NULL at the end, and
+// returns false when the input is broken. The message only has to stay
+// valid until the following call.
+typedef std::function<bool (const google::protobuf::Message *&message)> MessageSource;
+
+// Feeds LOAD DATA LOCAL INFILE from a MessageSource through the client's
+// local infile callbacks. Rows are encoded as the server asks for data,
+// nothing is staged in memory or on disk beyond one read buffer.
+//
+// Rows are tab separated columns of TableSchema::columns(), followed by
+// the serialized message for blob storage tables, in the default LOAD
+// DATA format: \N for unset fields, backslash escapes for \, tab,
+// newline, carriage return and NUL.
+//
+// A failing source aborts the statement: it is killed through |abort|
+// before the end of data is sent, so the server rolls back the rows it
+// already read instead of committing a truncated load.
+class InfileStream {
+public:
+    // Interrupts the statement running on |mysql|, see
+    // ConnectionPool::killQuery().
+    typedef std::function<bool (MYSQL *mysql)> Abort;
+
+    InfileStream(const TableSchema *schema, const MessageSource &source, const Abort &abort = Abort());
+
+    // Installs the callbacks on |mysql| for the next LOAD DATA LOCAL
+    // statement, restore() puts the default file reader back.
+    void install(MYSQL *mysql);
+    static void restore(MYSQL *mysql);
+
+    // LOAD DATA LOCAL INFILE 'pmo' REPLACE INTO TABLE `table` ... (columns)
+    void appendStatement(std::string &sql) const;
+
+    uint64_t rows() const { return rows_; }
+    uint64_t bytes() const { return bytes_; }
+    // The source reported an error.
+    bool failed() const { return failed_; }
+
+    // Appends one encoded line.
+    static void appendRow(std::string &out, const TableSchema *schema, const google::protobuf::Message &message);
+
+private:
+    static int init(void **ptr, const char *filename, void *userdata);
+    static int read(void *ptr, char *buffer, unsigned int length);
+    static void end(void *ptr);
+    static int error(void *ptr, char *message, unsigned int length);
+
+    const TableSchema *schema_;
+    MessageSource source_;
+    Abort abort_;
+    MYSQL *mysql_;
+    std::string buffer_;
+    size_t offset_;
+    bool finished_;
+    bool failed_;
+    uint64_t rows_;
+    uint64_t bytes_;
+};
+
+// Length delimited protobuf stream, each message prefixed with its size
+// as a varint, the format of writeDelimitedTo() in the other protobuf
+// runtimes.
+class DelimitedWriter {
+public:
+    explicit DelimitedWriter(std::ostream &output);
+    // Flushes.
+    ~DelimitedWriter();
+
+    bool write(const google::protobuf::Message &message);
+    bool flush();
+
+private:
+    DelimitedWriter(const DelimitedWriter &);
+    DelimitedWriter &operator=(const DelimitedWriter &);
+
+    std::ostream &stream_;
+    std::unique_ptr<google::protobuf::io::OstreamOutputStream> output_;
+};
+
+class DelimitedReader {
+public:
+    // Messages are read into one instance of |prototype|'s type.
+    DelimitedReader(std::istream &input, const google::protobuf::Message &prototype);
+    ~DelimitedReader();
+
+    // The next message, valid until the following call, NULL at the end
+    // or on a malformed record, see failed().
+    const google::protobuf::Message *next();
+    bool failed() const { return failed_; }
+
+    // As a source for Storage::import().
+    MessageSource source() {
+        return [this](const google::protobuf::Message *&message) {
+            message = next();
+            return failed_ == false;
+        };
+    }
+
+private:
+    DelimitedReader(const DelimitedReader &);
+    DelimitedReader &operator=(const DelimitedReader &);
+
+    std::unique_ptr<google::protobuf::io::IstreamInputStream> input_;
+    std::unique_ptr<google::protobuf::Message> message_;
+    bool failed_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_BULK_IO_H
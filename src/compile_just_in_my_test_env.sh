@@ -1,3 +1,5 @@
+protoc --cpp_out=. pmo_options.proto
 protoc --cpp_out=. pb_orm_test.proto
 protoc --mysql_out=. pb_orm_test.proto
-g++ -g storage.cc main.cc pb_orm_test.pb.cc -lmysqlclient -lprotobuf -L/home/taohan/open_src/protobuf/protobuf-2.6.1/src/.libs -L/usr/local/mysql/lib
+g++ -g -std=c++11 storage.cc query.cc sharded_storage.cc parallel_loader.cc connection_pool.cc prepared_statement.cc row_decoder.cc message_orm.cc sql_builder.cc table_schema.cc load_cache.cc bulk_io.cc snapshot_tracker.cc metrics.cc write_behind.cc transaction.cc group_commit.cc main.cc pmo_options.pb.cc pb_orm_test.pb.cc pb_orm_test.pb.orm.cc -lmysqlclient -lprotobuf -lpthread -L/home/taohan/open_src/protobuf/protobuf-2.6.1/src/.libs -L/usr/local/mysql/lib
+# async_storage.cc uses the MariaDB non-blocking client API, build it in with -lmariadb instead of -lmysqlclient.
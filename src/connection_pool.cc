@@ -0,0 +1,331 @@
+#include "connection_pool.h"
+
+#include <stdio.h>
+
+#include <mutex>
+
+#include "prepared_statement.h"
+
+namespace pmo {
+
+// mysql_thread_init() on construction, mysql_thread_end() when the owning
+// thread exits so its client state is not leaked.
+class ThreadScope {
+public:
+    ThreadScope() { ::mysql_thread_init(); }
+    ~ThreadScope() { ::mysql_thread_end(); }
+};
+
+static std::once_flag library_once;
+
+ConnectionPool::Connection::~Connection() {
+    for (StatementMap::iterator iter = statements_.begin(); iter != statements_.end(); ++iter) {
+        delete iter->second;
+    }
+}
+
+PreparedStatement *ConnectionPool::Connection::statement(const std::string &key) const {
+    StatementMap::const_iterator iter = statements_.find(key);
+    if (iter == statements_.end()) {
+        return NULL;
+    }
+    return iter->second;
+}
+
+void ConnectionPool::Connection::setStatement(const std::string &key, PreparedStatement *statement) {
+    PreparedStatement *&slot = statements_[key];
+    if (slot != NULL && slot != statement) {
+        delete slot;
+    }
+    slot = statement;
+}
+
+ConnectionPool::Handle::Handle(Handle &&other) :
+        pool_(other.pool_),
+        connection_(other.connection_),
+        owner_(other.owner_),
+        broken_(other.broken_) {
+    other.pool_ = NULL;
+    other.connection_ = NULL;
+    other.owner_ = NULL;
+    other.broken_ = false;
+}
+
+ConnectionPool::Handle &ConnectionPool::Handle::operator=(Handle &&other) {
+    if (this != &other) {
+        release();
+        pool_ = other.pool_;
+        connection_ = other.connection_;
+        owner_ = other.owner_;
+        broken_ = other.broken_;
+        other.pool_ = NULL;
+        other.connection_ = NULL;
+        other.owner_ = NULL;
+        other.broken_ = false;
+    }
+    return *this;
+}
+
+void ConnectionPool::Handle::setBroken() {
+    broken_ = true;
+    if (owner_ != NULL) {
+        owner_->setBroken();
+    }
+}
+
+void ConnectionPool::Handle::release() {
+    if (pool_ != NULL && connection_ != NULL) {
+        pool_->checkin(connection_, broken_);
+    }
+    pool_ = NULL;
+    connection_ = NULL;
+    owner_ = NULL;
+    broken_ = false;
+}
+
+ConnectionPool::Handle ConnectionPool::Handle::borrow() {
+    Handle handle(NULL, connection_);
+    handle.owner_ = this;
+    return handle;
+}
+
+ConnectionPool::ConnectionPool(const ConnectionPoolOptions &options) :
+        options_(options),
+        open_(0),
+        pending_(0) {
+    initLibrary();
+
+    if (options_.max_size == 0) {
+        options_.max_size = 1;
+    }
+    if (options_.min_size > options_.max_size) {
+        options_.min_size = options_.max_size;
+    }
+
+    for (size_t i = 0; i < options_.min_size; ++i) {
+        Connection *connection = create();
+        if (connection == NULL) {
+            break;
+        }
+        connection->last_used_ = Clock::now();
+        idle_.push_back(connection);
+        ++open_;
+        ++stats_.created;
+    }
+}
+
+ConnectionPool::~ConnectionPool() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < idle_.size(); ++i) {
+        destroy(idle_[i]);
+    }
+    idle_.clear();
+}
+
+ConnectionPool::Handle ConnectionPool::checkout() {
+    initThread();
+
+    Clock::time_point deadline = Clock::now() +
+        std::chrono::milliseconds(options_.checkout_timeout_ms);
+    std::chrono::milliseconds ping_interval(options_.ping_interval_ms);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++stats_.checkouts;
+
+    // Connections left over from a burst expire on checkout as well as on
+    // checkin.
+    std::deque<Connection *> expired;
+    reapIdle(Clock::now(), expired);
+    if (expired.empty() == false) {
+        lock.unlock();
+        for (size_t i = 0; i < expired.size(); ++i) {
+            destroy(expired[i]);
+        }
+        lock.lock();
+        available_.notify_all();
+    }
+
+    for (;;) {
+        if (idle_.empty() == false) {
+            Connection *connection = idle_.back();
+            idle_.pop_back();
+            if (Clock::now() - connection->last_used_ < ping_interval) {
+                return Handle(this, connection);
+            }
+
+            lock.unlock();
+            bool alive = ::mysql_ping(connection->mysql()) == 0;
+            if (alive) {
+                return Handle(this, connection);
+            }
+            destroy(connection);
+            lock.lock();
+            --open_;
+            ++stats_.destroyed;
+            ++stats_.ping_failures;
+            // The freed slot may belong to a waiter, this thread retries
+            // from the top either way.
+            available_.notify_one();
+            continue;
+        }
+
+        if (open_ + pending_ < options_.max_size) {
+            ++pending_;
+            lock.unlock();
+            Connection *connection = create();
+            lock.lock();
+            --pending_;
+            if (connection == NULL) {
+                available_.notify_one();
+                return Handle();
+            }
+            ++open_;
+            ++stats_.created;
+            return Handle(this, connection);
+        }
+
+        ++stats_.waits;
+        if (available_.wait_until(lock, deadline) == std::cv_status::timeout &&
+                idle_.empty() && open_ + pending_ >= options_.max_size) {
+            ++stats_.timeouts;
+            printf("ConnectionPool checkout timeout(%ums).\n", options_.checkout_timeout_ms);
+            return Handle();
+        }
+    }
+}
+
+void ConnectionPool::initLibrary() {
+    std::call_once(library_once, []() {
+        if (::mysql_library_init(0, NULL, NULL) != 0) {
+            printf("mysql_library_init failed.\n");
+        }
+        if (::mysql_thread_safe() == 0) {
+            printf("mysql client library is not thread safe, share a Storage between threads at your own risk.\n");
+        }
+    });
+}
+
+void ConnectionPool::initThread() {
+    static thread_local ThreadScope scope;
+    (void)scope;
+}
+
+void ConnectionPool::shrink() {
+    std::deque<Connection *> expired;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        reapIdle(Clock::now(), expired);
+    }
+
+    for (size_t i = 0; i < expired.size(); ++i) {
+        destroy(expired[i]);
+    }
+}
+
+bool ConnectionPool::killQuery(MYSQL *mysql) {
+    initThread();
+
+    Connection *connection = NULL;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.empty() == false) {
+            connection = idle_.back();
+            idle_.pop_back();
+        }
+    }
+    bool pooled = connection != NULL;
+    if (pooled == false) {
+        connection = create();
+        if (connection == NULL) {
+            return false;
+        }
+    }
+
+    char sql[64];
+    int size = snprintf(sql, sizeof(sql), "KILL QUERY %lu", ::mysql_thread_id(mysql));
+    bool ok = ::mysql_real_query(connection->mysql(), sql, size) == 0;
+    if (ok == false) {
+        printf("%s failed: %s.\n", sql, ::mysql_error(connection->mysql()));
+    }
+
+    if (pooled) {
+        checkin(connection, ok == false);
+    } else {
+        destroy(connection);
+    }
+    return ok;
+}
+
+ConnectionPool::Stats ConnectionPool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    stats.open = open_;
+    stats.idle = idle_.size();
+    stats.busy = open_ - idle_.size();
+    return stats;
+}
+
+ConnectionPool::Connection *ConnectionPool::create() {
+    MYSQL *mysql = ::mysql_init(NULL);
+    if (mysql == NULL) {
+        return NULL;
+    }
+
+    if (options_.local_infile) {
+        unsigned int enable = 1;
+        ::mysql_options(mysql, MYSQL_OPT_LOCAL_INFILE, &enable);
+    }
+
+    if (::mysql_real_connect(mysql, options_.host.c_str(), options_.user.c_str(),
+            options_.passwd.c_str(), options_.database.c_str(), options_.port, NULL,
+            CLIENT_MULTI_RESULTS | CLIENT_FOUND_ROWS) == NULL) {
+        printf("mysql_real_connect(%s:%u/%s) failed: %s.\n", options_.host.c_str(),
+            options_.port, options_.database.c_str(), ::mysql_error(mysql));
+        ::mysql_close(mysql);
+        return NULL;
+    }
+
+    return new Connection(mysql);
+}
+
+void ConnectionPool::destroy(Connection *connection) {
+    MYSQL *mysql = connection->mysql_;
+    // Statements must be closed while the connection is still open.
+    delete connection;
+    ::mysql_close(mysql);
+}
+
+void ConnectionPool::checkin(Connection *connection, bool broken) {
+    std::deque<Connection *> expired;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (broken) {
+            --open_;
+            ++stats_.destroyed;
+            expired.push_back(connection);
+        } else {
+            Clock::time_point now = Clock::now();
+            connection->last_used_ = now;
+            idle_.push_back(connection);
+            reapIdle(now, expired);
+        }
+    }
+    available_.notify_one();
+
+    for (size_t i = 0; i < expired.size(); ++i) {
+        destroy(expired[i]);
+    }
+}
+
+void ConnectionPool::reapIdle(Clock::time_point now, std::deque<Connection *> &expired) {
+    std::chrono::milliseconds idle_timeout(options_.idle_timeout_ms);
+    while (open_ > options_.min_size && idle_.empty() == false &&
+            now - idle_.front()->last_used_ > idle_timeout) {
+        expired.push_back(idle_.front());
+        idle_.pop_front();
+        --open_;
+        ++stats_.destroyed;
+    }
+}
+
+}  // namespace pmo
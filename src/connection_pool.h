@@ -0,0 +1,185 @@
+#ifndef PMO_CONNECTION_POOL_H
+#define PMO_CONNECTION_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <mysql.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sql_builder.h"
+
+namespace pmo {
+
+class PreparedStatement;
+
+struct ConnectionPoolOptions {
+    ConnectionPoolOptions() :
+            port(3306),
+            min_size(1),
+            max_size(8),
+            idle_timeout_ms(60000),
+            ping_interval_ms(5000),
+            checkout_timeout_ms(3000),
+            local_infile(false) {}
+
+    std::string host;
+    std::string database;
+    std::string user;
+    std::string passwd;
+    uint32_t port;
+
+    // Connections kept open even when idle.
+    size_t min_size;
+    // Upper bound of open connections, checkout() waits when reached.
+    size_t max_size;
+    // Idle connections above min_size are closed after this long. Expiry
+    // is checked on checkout() and on checkin(), a pool that sees no
+    // traffic keeps them until shrink() (Storage::shrinkPool()) is called.
+    uint32_t idle_timeout_ms;
+    // Connections idle longer than this are checked with mysql_ping()
+    // before being handed out.
+    uint32_t ping_interval_ms;
+    // How long checkout() waits for a free connection.
+    uint32_t checkout_timeout_ms;
+    // Enables LOAD DATA LOCAL INFILE, needed by Storage::import(). The
+    // server must run with local_infile=ON too.
+    bool local_infile;
+};
+
+class ConnectionPool {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Stats {
+        Stats() : open(0), idle(0), busy(0), created(0), destroyed(0),
+                checkouts(0), waits(0), timeouts(0), ping_failures(0) {}
+
+        size_t open;
+        size_t idle;
+        size_t busy;
+        uint64_t created;
+        uint64_t destroyed;
+        uint64_t checkouts;
+        uint64_t waits;
+        uint64_t timeouts;
+        uint64_t ping_failures;
+    };
+
+    class Connection {
+    public:
+        MYSQL *mysql() const { return mysql_; }
+
+        // Prepared statements are bound to the connection that prepared
+        // them, they are cached here and closed along with it.
+        PreparedStatement *statement(const std::string &key) const;
+        void setStatement(const std::string &key, PreparedStatement *statement);
+
+        // Statement buffer reused by every query on this connection.
+        SqlBuilder &sql() { return sql_; }
+
+    private:
+        friend class ConnectionPool;
+
+        explicit Connection(MYSQL *mysql) : mysql_(mysql), sql_(mysql) {}
+        ~Connection();
+
+        typedef std::map<std::string, PreparedStatement *> StatementMap;
+
+        MYSQL *mysql_;
+        Clock::time_point last_used_;
+        StatementMap statements_;
+        SqlBuilder sql_;
+    };
+
+    // RAII checkout: returns the connection to the pool on destruction.
+    class Handle {
+    public:
+        Handle() : pool_(NULL), connection_(NULL), owner_(NULL), broken_(false) {}
+        Handle(Handle &&other);
+        Handle &operator=(Handle &&other);
+        ~Handle() { release(); }
+
+        MYSQL *get() const { return connection_ != NULL ? connection_->mysql() : NULL; }
+        Connection *connection() const { return connection_; }
+        explicit operator bool() const { return connection_ != NULL; }
+
+        // Marks the connection as unusable, it is closed instead of being
+        // returned to the idle list.
+        void setBroken();
+        void release();
+
+        // A handle on the same connection that does not return it, for use
+        // while this one stays alive. setBroken() is passed on to this one.
+        Handle borrow();
+
+    private:
+        friend class ConnectionPool;
+
+        Handle(ConnectionPool *pool, Connection *connection) :
+                pool_(pool), connection_(connection), owner_(NULL), broken_(false) {}
+        Handle(const Handle &);
+        Handle &operator=(const Handle &);
+
+        ConnectionPool *pool_;
+        Connection *connection_;
+        // Set on borrowed handles.
+        Handle *owner_;
+        bool broken_;
+    };
+
+    explicit ConnectionPool(const ConnectionPoolOptions &options);
+    ~ConnectionPool();
+
+    // Returns an empty handle when no connection could be obtained.
+    Handle checkout();
+
+    // Closes idle connections that exceeded idle_timeout_ms.
+    void shrink();
+
+    // Interrupts the statement running on |mysql| with KILL QUERY, sent
+    // over an idle connection or a short lived one when none is idle, so
+    // a caller holding the last connection does not wait. The server then
+    // stops sending a result or aborts a LOAD DATA.
+    bool killQuery(MYSQL *mysql);
+
+    // Initializes the client library once per process, it must not race
+    // with the first mysql_init(). Called by the constructor.
+    static void initLibrary();
+    // Sets up the client library state of the calling thread and releases
+    // it when the thread exits. checkout() calls it, threads that use a
+    // connection obtained some other way must call it first.
+    static void initThread();
+
+    Stats stats() const;
+    const ConnectionPoolOptions &options() const { return options_; }
+
+private:
+    ConnectionPool(const ConnectionPool &);
+    ConnectionPool &operator=(const ConnectionPool &);
+
+    Connection *create();
+    void destroy(Connection *connection);
+    void checkin(Connection *connection, bool broken);
+    void reapIdle(Clock::time_point now, std::deque<Connection *> &expired);
+
+    ConnectionPoolOptions options_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable available_;
+    // Most recently used at the back, so the front ages out first.
+    std::deque<Connection *> idle_;
+    size_t open_;
+    // Connections being established outside the lock.
+    size_t pending_;
+    Stats stats_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_CONNECTION_POOL_H
@@ -0,0 +1,186 @@
+#include "group_commit.h"
+
+#include <chrono>
+
+#include <stdio.h>
+#include <google/protobuf/message.h>
+
+#include "storage.h"
+#include "transaction.h"
+
+namespace pmo {
+
+GroupCommitter::GroupCommitter(Storage &storage, const GroupCommitOptions &options) :
+        storage_(storage),
+        options_(options),
+        committing_(0),
+        groups_(0),
+        flush_requests_(0),
+        stopping_(false) {
+    if (options_.max_rows == 0) {
+        options_.max_rows = 1;
+    }
+    if (options_.max_pending < options_.max_rows) {
+        options_.max_pending = options_.max_rows;
+    }
+
+    thread_ = std::thread(&GroupCommitter::run, this);
+}
+
+GroupCommitter::~GroupCommitter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+    space_.notify_all();
+    thread_.join();
+}
+
+bool GroupCommitter::save(const ::google::protobuf::Message &message, const Completion &completion) {
+    ::google::protobuf::Message *copy = message.New();
+    copy->CopyFrom(message);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (stopping_ == false && queue_.size() >= options_.max_pending) {
+        space_.wait(lock);
+    }
+    if (stopping_) {
+        lock.unlock();
+        delete copy;
+        return false;
+    }
+
+    queue_.push_back(Entry());
+    queue_.back().message = copy;
+    queue_.back().completion = completion;
+
+    if (queue_.size() >= options_.max_rows) {
+        wakeup_.notify_one();
+    }
+    return true;
+}
+
+bool GroupCommitter::saveAndWait(const ::google::protobuf::Message &message) {
+    std::mutex mutex;
+    std::condition_variable done;
+    bool finished = false;
+    bool result = false;
+
+    bool queued = save(message, [&](bool ok) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result = ok;
+        finished = true;
+        done.notify_one();
+    });
+    if (queued == false) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (finished == false) {
+        done.wait(lock);
+    }
+    return result;
+}
+
+void GroupCommitter::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++flush_requests_;
+    wakeup_.notify_all();
+    while (queue_.empty() == false || committing_ != 0) {
+        drained_.wait(lock);
+    }
+    --flush_requests_;
+}
+
+size_t GroupCommitter::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size() + committing_;
+}
+
+uint64_t GroupCommitter::groups() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return groups_;
+}
+
+void GroupCommitter::run() {
+    std::chrono::milliseconds interval(options_.interval_ms);
+    std::vector<Entry> entries;
+    std::vector<bool> results;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        if (stopping_ == false && flush_requests_ == 0 && queue_.size() < options_.max_rows) {
+            wakeup_.wait_for(lock, interval);
+        }
+
+        while (queue_.empty() == false && entries.size() < options_.max_rows) {
+            entries.push_back(queue_.front());
+            queue_.pop_front();
+        }
+
+        if (entries.empty()) {
+            if (stopping_) {
+                break;
+            }
+            continue;
+        }
+
+        committing_ = entries.size();
+        ++groups_;
+        space_.notify_all();
+        lock.unlock();
+
+        bool retry = false;
+        if (commit(entries, results, retry) == false) {
+            if (retry) {
+                printf("GroupCommitter group of %zu rows failed, saving them one by one.\n", entries.size());
+                for (size_t i = 0; i < entries.size(); ++i) {
+                    results[i] = storage_.save(*entries[i].message);
+                }
+            } else {
+                printf("GroupCommitter commit of %zu rows failed.\n", entries.size());
+            }
+        }
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].completion) {
+                entries[i].completion(results[i]);
+            }
+            delete entries[i].message;
+        }
+        entries.clear();
+
+        lock.lock();
+        committing_ = 0;
+        if (queue_.empty()) {
+            drained_.notify_all();
+        }
+    }
+}
+
+bool GroupCommitter::commit(const std::vector<Entry> &entries, std::vector<bool> &results, bool &retry) {
+    results.assign(entries.size(), false);
+    retry = true;
+
+    Transaction transaction(storage_);
+    if (transaction.active() == false) {
+        return false;
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (storage_.save(*entries[i].message) == false) {
+            return false;
+        }
+    }
+
+    retry = false;
+    if (transaction.commit() == false) {
+        return false;
+    }
+    results.assign(entries.size(), true);
+    return true;
+}
+
+}  // namespace pmo
@@ -0,0 +1,105 @@
+#ifndef PMO_GROUP_COMMIT_H
+#define PMO_GROUP_COMMIT_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+class Storage;
+
+struct GroupCommitOptions {
+    GroupCommitOptions() :
+            max_rows(200),
+            interval_ms(5),
+            max_pending(100000) {}
+
+    // Rows committed together, reaching it commits right away.
+    size_t max_rows;
+    // Queued rows are committed at least this often.
+    uint32_t interval_ms;
+    // save() blocks while this many rows are queued.
+    size_t max_pending;
+};
+
+// Group commit in front of Storage::save. Saves from any number of threads
+// are queued and a committer thread writes them in one transaction every
+// interval_ms or max_rows rows, so the server flushes its redo log once per
+// group instead of once per row. Unlike WriteBehind nothing is coalesced:
+// every save is executed, in enqueue order.
+//
+// When a statement of the group fails the transaction is rolled back and
+// its rows are saved again one by one in autocommit, so each completion
+// reports the outcome of its own row. A failed COMMIT may still have
+// reached the server, its rows are reported as failed and not written
+// again.
+class GroupCommitter {
+public:
+    // Called on the committer thread once the row is committed or failed.
+    typedef std::function<void (bool ok)> Completion;
+
+    GroupCommitter(Storage &storage, const GroupCommitOptions &options = GroupCommitOptions());
+    // Commits everything still queued before returning.
+    ~GroupCommitter();
+
+    // Returns false after the committer has been stopped.
+    bool save(const google::protobuf::Message &message, const Completion &completion = Completion());
+
+    // Blocks until the row is committed, returns whether it was.
+    bool saveAndWait(const google::protobuf::Message &message);
+
+    // Blocks until every save queued before the call has been committed.
+    void flush();
+
+    size_t pending() const;
+    uint64_t groups() const;
+
+private:
+    GroupCommitter(const GroupCommitter &);
+    GroupCommitter &operator=(const GroupCommitter &);
+
+    struct Entry {
+        Entry() : message(NULL) {}
+
+        google::protobuf::Message *message;
+        Completion completion;
+    };
+
+    void run();
+    // |retry| is set when the group was rolled back before COMMIT was sent.
+    bool commit(const std::vector<Entry> &entries, std::vector<bool> &results, bool &retry);
+
+    Storage &storage_;
+    GroupCommitOptions options_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::condition_variable space_;
+    std::condition_variable drained_;
+    std::deque<Entry> queue_;
+    // Rows taken by the committer and not yet completed.
+    size_t committing_;
+    uint64_t groups_;
+    size_t flush_requests_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_GROUP_COMMIT_H
@@ -0,0 +1,245 @@
+#include "load_cache.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "table_schema.h"
+
+namespace pmo {
+
+LoadCache::LoadCache(const LoadCacheOptions &options) :
+        options_(options),
+        clears_(0) {}
+
+LoadCache::~LoadCache() {
+    clear();
+}
+
+std::string LoadCache::cacheKey(const ::google::protobuf::Message &query) {
+    std::string key = query.GetTypeName();
+    key.push_back('\0');
+    query.AppendToString(&key);
+    return key;
+}
+
+bool LoadCache::rowKey(const ::google::protobuf::Message &message, std::string &key) {
+    const TableSchema *schema = TableSchema::get(message.GetDescriptor());
+    if (schema->hasPrimaryKey() == false) {
+        return false;
+    }
+
+    ::google::protobuf::Message *query = schema->newKeyMessage(message);
+    bool ok = schema->isKeyQuery(*query);
+    if (ok) {
+        key = cacheKey(*query);
+    }
+    delete query;
+    return ok;
+}
+
+bool LoadCache::get(const ::google::protobuf::Message &query, std::vector< ::google::protobuf::Message *> &results) {
+    std::string key = cacheKey(query);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    EntryMap::iterator iter = index_.find(key);
+    if (iter == index_.end()) {
+        ++stats_.misses;
+        return false;
+    }
+
+    EntryList::iterator entry = iter->second;
+    if (options_.ttl_ms != 0 && Clock::now() >= entry->expire) {
+        erase(entry);
+        ++stats_.expirations;
+        ++stats_.misses;
+        return false;
+    }
+
+    entries_.splice(entries_.begin(), entries_, entry);
+    for (size_t i = 0; i < entry->rows.size(); ++i) {
+        ::google::protobuf::Message *row = entry->rows[i]->New();
+        row->CopyFrom(*entry->rows[i]);
+        results.push_back(row);
+    }
+    ++stats_.hits;
+    return true;
+}
+
+uint64_t LoadCache::generation(const ::google::protobuf::Descriptor *descriptor) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Both parts only grow, so the sum changes whenever either does.
+    std::map<const ::google::protobuf::Descriptor *, uint64_t>::const_iterator iter = generations_.find(descriptor);
+    return clears_ + (iter != generations_.end() ? iter->second : 0);
+}
+
+void LoadCache::put(const ::google::protobuf::Message &query,
+        const std::vector< ::google::protobuf::Message *> &results, uint64_t generation) {
+    Entry entry;
+    entry.key = cacheKey(query);
+    entry.type = query.GetTypeName();
+    entry.key_query = TableSchema::get(query.GetDescriptor())->isKeyQuery(query);
+    entry.expire = Clock::now() + std::chrono::milliseconds(options_.ttl_ms);
+    entry.bytes = entry.key.size() + sizeof(Entry);
+    for (size_t i = 0; i < results.size(); ++i) {
+        ::google::protobuf::Message *row = results[i]->New();
+        row->CopyFrom(*results[i]);
+        entry.rows.push_back(row);
+        entry.bytes += row->SpaceUsed();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<const ::google::protobuf::Descriptor *, uint64_t>::const_iterator changes =
+        generations_.find(query.GetDescriptor());
+    if (clears_ + (changes != generations_.end() ? changes->second : 0) != generation) {
+        for (size_t i = 0; i < entry.rows.size(); ++i) {
+            delete entry.rows[i];
+        }
+        ++stats_.invalidations;
+        return;
+    }
+
+    EntryMap::iterator iter = index_.find(entry.key);
+    if (iter != index_.end()) {
+        erase(iter->second);
+    }
+
+    entries_.push_front(entry);
+    index_[entry.key] = entries_.begin();
+    if (entry.key_query == false) {
+        queries_[entry.type].insert(entry.key);
+    }
+    stats_.bytes += entry.bytes;
+    evict();
+}
+
+void LoadCache::update(const ::google::protobuf::Message &message) {
+    changed(message, true);
+}
+
+void LoadCache::invalidate(const ::google::protobuf::Message &message) {
+    changed(message, false);
+}
+
+void LoadCache::invalidate(const ::google::protobuf::Descriptor *descriptor) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++generations_[descriptor];
+    for (EntryList::iterator iter = entries_.begin(); iter != entries_.end();) {
+        EntryList::iterator entry = iter++;
+        if (entry->type == descriptor->full_name()) {
+            erase(entry);
+            ++stats_.invalidations;
+        }
+    }
+}
+
+void LoadCache::changed(const ::google::protobuf::Message &message, bool written) {
+    std::string row_key;
+    bool keyed = rowKey(message, row_key);
+
+    // A written message can replace the cached row only if it carries every
+    // column, a partial upsert leaves the other columns unknown here.
+    ::google::protobuf::Message *row = NULL;
+    if (keyed && written) {
+        const TableSchema *schema = TableSchema::get(message.GetDescriptor());
+        const ::google::protobuf::Reflection *reflection = message.GetReflection();
+        bool full = true;
+        for (size_t i = 0; i < schema->columns().size(); ++i) {
+            if (reflection->HasField(message, schema->columns()[i]) == false) {
+                full = false;
+                break;
+            }
+        }
+        if (full) {
+            row = message.New();
+            row->CopyFrom(message);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++generations_[message.GetDescriptor()];
+    std::map<std::string, std::set<std::string> >::iterator queries = queries_.find(message.GetTypeName());
+    if (queries != queries_.end()) {
+        std::set<std::string> keys;
+        keys.swap(queries->second);
+        for (std::set<std::string>::iterator key = keys.begin(); key != keys.end(); ++key) {
+            EntryMap::iterator iter = index_.find(*key);
+            if (iter != index_.end()) {
+                erase(iter->second);
+                ++stats_.invalidations;
+            }
+        }
+    }
+
+    if (keyed == false) {
+        delete row;
+        return;
+    }
+
+    EntryMap::iterator iter = index_.find(row_key);
+    if (iter == index_.end()) {
+        delete row;
+        return;
+    }
+
+    EntryList::iterator entry = iter->second;
+    if (row == NULL) {
+        erase(entry);
+        ++stats_.invalidations;
+        return;
+    }
+
+    for (size_t i = 0; i < entry->rows.size(); ++i) {
+        stats_.bytes -= entry->rows[i]->SpaceUsed();
+        delete entry->rows[i];
+    }
+    entry->rows.assign(1, row);
+    stats_.bytes += row->SpaceUsed();
+    entry->expire = Clock::now() + std::chrono::milliseconds(options_.ttl_ms);
+    ++stats_.updates;
+    evict();
+}
+
+void LoadCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (entries_.empty() == false) {
+        erase(entries_.begin());
+    }
+    queries_.clear();
+    ++clears_;
+}
+
+LoadCache::Stats LoadCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    stats.entries = entries_.size();
+    return stats;
+}
+
+void LoadCache::erase(EntryList::iterator entry) {
+    size_t bytes = entry->key.size() + sizeof(Entry);
+    for (size_t i = 0; i < entry->rows.size(); ++i) {
+        bytes += entry->rows[i]->SpaceUsed();
+        delete entry->rows[i];
+    }
+    stats_.bytes -= bytes < stats_.bytes ? bytes : stats_.bytes;
+
+    if (entry->key_query == false) {
+        std::map<std::string, std::set<std::string> >::iterator queries = queries_.find(entry->type);
+        if (queries != queries_.end()) {
+            queries->second.erase(entry->key);
+        }
+    }
+    index_.erase(entry->key);
+    entries_.erase(entry);
+}
+
+void LoadCache::evict() {
+    while (stats_.bytes > options_.memory_budget && entries_.empty() == false) {
+        EntryList::iterator last = entries_.end();
+        --last;
+        erase(last);
+        ++stats_.evictions;
+    }
+}
+
+}  // namespace pmo
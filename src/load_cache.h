@@ -0,0 +1,124 @@
+#ifndef PMO_LOAD_CACHE_H
+#define PMO_LOAD_CACHE_H
+
+#include <chrono>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class Descriptor;
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+struct LoadCacheOptions {
+    LoadCacheOptions() :
+            memory_budget(64 * 1024 * 1024),
+            ttl_ms(60000) {}
+
+    // Approximate bytes of cached messages, least recently used results
+    // are evicted beyond it.
+    size_t memory_budget;
+    // 0 keeps results until evicted or invalidated.
+    uint32_t ttl_ms;
+};
+
+// In-process read-through cache of Storage::load results keyed by
+// (type, serialized query). Storage keeps it coherent on save: the entry
+// of the saved row's primary key query is updated (or dropped when the
+// saved message is partial) and other cached queries of the type are
+// invalidated.
+class LoadCache {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Stats {
+        Stats() : hits(0), misses(0), evictions(0), expirations(0),
+                invalidations(0), updates(0), entries(0), bytes(0) {}
+
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t expirations;
+        uint64_t invalidations;
+        uint64_t updates;
+        size_t entries;
+        size_t bytes;
+    };
+
+    explicit LoadCache(const LoadCacheOptions &options = LoadCacheOptions());
+    ~LoadCache();
+
+    // Appends copies of the cached rows to |results| on a hit.
+    bool get(const google::protobuf::Message &query, std::vector<google::protobuf::Message *> &results);
+
+    // Changes with every update() or invalidate() of the type. Taken before
+    // the query that fills the cache and passed to put(), which drops the
+    // rows when a save raced with the query, they may predate it.
+    uint64_t generation(const google::protobuf::Descriptor *descriptor) const;
+    void put(const google::protobuf::Message &query, const std::vector<google::protobuf::Message *> &results,
+            uint64_t generation);
+
+    // |message| was written to the table.
+    void update(const google::protobuf::Message &message);
+    // The row of |message| may have changed in an unknown way.
+    void invalidate(const google::protobuf::Message &message);
+    // Every row of the type may have changed, e.g. after an import.
+    void invalidate(const google::protobuf::Descriptor *descriptor);
+    void clear();
+
+    Stats stats() const;
+
+private:
+    LoadCache(const LoadCache &);
+    LoadCache &operator=(const LoadCache &);
+
+    struct Entry {
+        std::string key;
+        std::string type;
+        bool key_query;
+        Clock::time_point expire;
+        size_t bytes;
+        std::vector<google::protobuf::Message *> rows;
+    };
+
+    typedef std::list<Entry> EntryList;
+    typedef std::map<std::string, EntryList::iterator> EntryMap;
+
+    static std::string cacheKey(const google::protobuf::Message &query);
+    // Cache key of the primary key query for the row of |message|.
+    static bool rowKey(const google::protobuf::Message &message, std::string &key);
+
+    void changed(const google::protobuf::Message &message, bool written);
+    void erase(EntryList::iterator iter);
+    void evict();
+
+    LoadCacheOptions options_;
+
+    mutable std::mutex mutex_;
+    // Most recently used at the front.
+    EntryList entries_;
+    EntryMap index_;
+    // Non primary key queries per type, dropped on any save of the type.
+    std::map<std::string, std::set<std::string> > queries_;
+    // Changes per type, and of clear(), see generation().
+    std::map<const google::protobuf::Descriptor *, uint64_t> generations_;
+    uint64_t clears_;
+    Stats stats_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_LOAD_CACHE_H
@@ -1,10 +1,17 @@
 #include <iostream>
+#include <sstream>
 
+#include "group_commit.h"
+#include "load_cache.h"
+#include "query.h"
 #include "storage.h"
+#include "table_schema.h"
+#include "transaction.h"
 #include "pb_orm_test.pb.h"
 
 int main() {
     pmo::Storage storage("192.168.30.51", "orm_test", "mttd", "mttd2014");
+    storage.metrics().setSlowQueryLog(100);
 
     pmo::tutorial::PbOrmTest pot;
     pot.set_id(1);
@@ -21,6 +28,20 @@ int main() {
     pot.set_value2("port_v2");
     storage.save(pot.GetTypeName(), pot.SerializeAsString());
 
+    pmo::tutorial::PbOrmTest pot_changed(pot);
+    pot_changed.set_value1(1000);
+    storage.update(pot_changed, pot);
+
+    std::vector<pmo::tutorial::PbOrmTest> pot_batch(3);
+    std::vector<const ::google::protobuf::Message *> pot_batch_ptrs;
+    for (size_t i = 0; i < pot_batch.size(); ++i) {
+        pot_batch[i].set_id(100 + i);
+        pot_batch[i].set_name("pot_batch");
+        pot_batch[i].set_value1(i);
+        pot_batch_ptrs.push_back(&pot_batch[i]);
+    }
+    storage.save(pot_batch_ptrs);
+
     std::vector< ::google::protobuf::Message *> pot_results;
     pmo::tutorial::PbOrmTest pot_query;
     pot_query.set_id(1);
@@ -40,5 +61,116 @@ int main() {
         pot_result.PrintDebugString();
     }
 
+    std::vector<pmo::tutorial::PbOrmTest> pot_keys(4);
+    std::vector<const ::google::protobuf::Message *> pot_key_ptrs;
+    for (size_t i = 0; i < pot_keys.size(); ++i) {
+        pot_keys[i].set_id(100 + i);
+        pot_key_ptrs.push_back(&pot_keys[i]);
+    }
+    pmo::Storage::KeyedRows pot_rows;
+    std::vector<size_t> pot_missing;
+    storage.loadMany(pot_key_ptrs, pot_rows, pot_missing);
+    std::cout << "loadMany found " << pot_rows.size() << " missing " << pot_missing.size() << std::endl;
+    for (pmo::Storage::KeyedRows::iterator iter = pot_rows.begin(); iter != pot_rows.end(); ++iter) {
+        delete iter->second;
+    }
+
+    pmo::Storage::FieldList pot_fields;
+    std::vector< ::google::protobuf::Message *> pot_projected;
+    const pmo::TableSchema *pot_schema = pmo::TableSchema::get(pmo::tutorial::PbOrmTest::descriptor());
+    if (pot_schema->projection("id, name", pot_fields)) {
+        pot_query.set_id(1);
+        storage.load(pot_query, pot_fields, pot_projected);
+        for (size_t i = 0; i < pot_projected.size(); ++i) {
+            pot_projected[i]->PrintDebugString();
+            delete pot_projected[i];
+        }
+    }
+
+    pmo::LoadCache cache;
+    storage.setCache(&cache);
+    for (int i = 0; i < 2; ++i) {
+        std::vector< ::google::protobuf::Message *> cached_results;
+        pot_query.set_id(1);
+        storage.load(pot_query, cached_results);
+        for (size_t j = 0; j < cached_results.size(); ++j) {
+            delete cached_results[j];
+        }
+    }
+    pmo::LoadCache::Stats cache_stats = cache.stats();
+    std::cout << "cache hits " << cache_stats.hits << " misses " << cache_stats.misses << std::endl;
+    storage.setCache(NULL);
+
+    pmo::tutorial::PbOrmBlobTest blob;
+    blob.set_id(1);
+    blob.set_type(2);
+    pmo::tutorial::PbOrmBlobTest::Item *item = blob.add_items();
+    item->set_id(10);
+    item->set_count(3);
+    blob.mutable_detail()->CopyFrom(pot);
+    storage.save(blob);
+
+    std::vector< ::google::protobuf::Message *> blob_results;
+    pmo::tutorial::PbOrmBlobTest blob_query;
+    blob_query.set_id(1);
+    storage.load(blob_query, blob_results);
+    for (size_t i = 0; i < blob_results.size(); ++i) {
+        blob_results[i]->PrintDebugString();
+        delete blob_results[i];
+    }
+
+    pmo::tutorial::PbOrmTest pot_scan;
+    size_t scanned = 0;
+    storage.load(pot_scan, [&scanned](const ::google::protobuf::Message &row) {
+        ++scanned;
+        return true;
+    });
+    std::cout << "scanned " << scanned << " rows" << std::endl;
+
+    pmo::tutorial::PbOrmTest pot_low;
+    pot_low.set_id(100);
+    pmo::Cursor pot_cursor(storage, pmo::Query(pot_scan).lowerBound(pot_low), 2);
+    while (pot_cursor.done() == false) {
+        std::vector< ::google::protobuf::Message *> pot_page;
+        if (pot_cursor.next(pot_page) == false) {
+            break;
+        }
+        std::cout << "page of " << pot_page.size() << " rows" << std::endl;
+        for (size_t i = 0; i < pot_page.size(); ++i) {
+            delete pot_page[i];
+        }
+    }
+
+    std::stringstream pot_dump;
+    uint64_t pot_exported = 0;
+    storage.exportTo(pot_scan, pot_dump, &pot_exported);
+    pmo::DelimitedReader pot_reader(pot_dump, pot_scan);
+    uint64_t pot_imported = 0;
+    if (storage.import(pot_scan.GetDescriptor(), pot_reader.source(), &pot_imported) == false) {
+        std::cout << "import failed" << std::endl;
+    }
+    std::cout << "exported " << pot_exported << " imported " << pot_imported << " rows" << std::endl;
+
+    {
+        pmo::Transaction transaction(storage);
+        pot.set_id(200);
+        storage.save(pot);
+        pot.set_id(201);
+        storage.save(pot);
+        transaction.commit();
+    }
+
+    {
+        pmo::GroupCommitter committer(storage);
+        for (int i = 0; i < 10; ++i) {
+            pot.set_id(300 + i);
+            committer.save(pot);
+        }
+        pot.set_id(310);
+        std::cout << "group commit " << committer.saveAndWait(pot) << std::endl;
+    }
+
+    std::cout << storage.dumpMetrics();
+
     return 0;
 }
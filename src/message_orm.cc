@@ -0,0 +1,22 @@
+#include "message_orm.h"
+
+namespace pmo {
+
+OrmRegistry &OrmRegistry::instance() {
+    static OrmRegistry registry;
+    return registry;
+}
+
+void OrmRegistry::add(const std::string &type, const MessageOrm *orm) {
+    orms_[type] = orm;
+}
+
+const MessageOrm *OrmRegistry::find(const std::string &type) const {
+    OrmMap::const_iterator iter = orms_.find(type);
+    if (iter == orms_.end()) {
+        return NULL;
+    }
+    return iter->second;
+}
+
+}  // namespace pmo
@@ -0,0 +1,81 @@
+#ifndef PMO_MESSAGE_ORM_H
+#define PMO_MESSAGE_ORM_H
+
+#include <map>
+#include <string>
+
+#include <mysql.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "sql_builder.h"
+
+namespace google {
+namespace protobuf {
+
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+// Type specialized save/load for one message, implemented by the code that
+// protoc --mysql_out generates into <file>.pb.orm.h/.cc. Storage dispatches
+// to it instead of walking the message through Reflection.
+class MessageOrm {
+public:
+    virtual ~MessageOrm() {}
+
+    // INSERT INTO ... SET ... ON DUPLICATE KEY UPDATE with the present
+    // fields for tables with a primary key, REPLACE INTO ... SET otherwise.
+    // Returns false when there is nothing to save.
+    virtual bool buildSave(const google::protobuf::Message &message, MYSQL *mysql, std::string &sql) const = 0;
+
+    // SELECT <all columns> ... WHERE with the present fields. Rows of the
+    // result are laid out the way decodeRow() expects.
+    virtual bool buildSelect(const google::protobuf::Message &query, MYSQL *mysql, std::string &sql) const = 0;
+
+    virtual void decodeRow(const MYSQL_ROW row, const unsigned long *lengths,
+            google::protobuf::Message *message) const = 0;
+};
+
+class OrmRegistry {
+public:
+    static OrmRegistry &instance();
+
+    // Called from static initializers of generated code.
+    void add(const std::string &type, const MessageOrm *orm);
+    // Returns NULL for types without generated code.
+    const MessageOrm *find(const std::string &type) const;
+
+private:
+    OrmRegistry() {}
+    OrmRegistry(const OrmRegistry &);
+    OrmRegistry &operator=(const OrmRegistry &);
+
+    typedef std::map<std::string, const MessageOrm *> OrmMap;
+    OrmMap orms_;
+};
+
+template <typename T>
+class OrmRegistrar {
+public:
+    explicit OrmRegistrar(const char *type) {
+        static T orm;
+        OrmRegistry::instance().add(type, &orm);
+    }
+};
+
+inline int32_t parseInt32(const char *data) { return (int32_t)strtol(data, NULL, 10); }
+inline uint32_t parseUInt32(const char *data) { return (uint32_t)strtoul(data, NULL, 10); }
+inline int64_t parseInt64(const char *data) { return (int64_t)strtoll(data, NULL, 10); }
+inline uint64_t parseUInt64(const char *data) { return (uint64_t)strtoull(data, NULL, 10); }
+inline double parseDouble(const char *data) { return strtod(data, NULL); }
+inline float parseFloat(const char *data) { return strtof(data, NULL); }
+inline bool parseBool(const char *data) { return strtol(data, NULL, 10) != 0 || data[0] == 't' || data[0] == 'T'; }
+
+}   // namespace pmo
+
+#endif  // PMO_MESSAGE_ORM_H
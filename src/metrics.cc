@@ -0,0 +1,285 @@
+#include "metrics.h"
+
+#include <sstream>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <google/protobuf/descriptor.h>
+
+namespace pmo {
+
+// Slow statements are printed up to this many bytes.
+static const size_t kSlowQueryPrintLength = 1024;
+
+// Stripe of the calling thread, assigned round robin on first use.
+static size_t threadStripe(size_t stripes) {
+    static std::atomic<size_t> next(0);
+    static thread_local size_t stripe = next++;
+    return stripe % stripes;
+}
+
+static void mergeCounters(Metrics::Counters &to, const Metrics::Counters &from) {
+    to.calls += from.calls;
+    to.errors += from.errors;
+    to.rows_in += from.rows_in;
+    to.rows_out += from.rows_out;
+    to.bytes_in += from.bytes_in;
+    to.bytes_out += from.bytes_out;
+    to.total.merge(from.total);
+    for (int i = 0; i < Metrics::PHASE_COUNT; ++i) {
+        to.phases[i].merge(from.phases[i]);
+    }
+}
+
+const char *Metrics::operationName(Operation operation) {
+    switch (operation) {
+        case LOAD:
+            return "load";
+        case LOAD_MANY:
+            return "load_many";
+        case STREAM:
+            return "stream";
+        case SAVE:
+            return "save";
+        case BATCH_SAVE:
+            return "batch_save";
+        case UPDATE:
+            return "update";
+        default:
+            return "unknown";
+    }
+}
+
+const char *Metrics::phaseName(Phase phase) {
+    switch (phase) {
+        case BUILD:
+            return "build";
+        case ROUND_TRIP:
+            return "round_trip";
+        case DECODE:
+            return "decode";
+        default:
+            return "unknown";
+    }
+}
+
+Metrics::Histogram::Histogram() :
+        count_(0),
+        sum_(0),
+        max_(0) {
+    memset(buckets_, 0, sizeof(buckets_));
+}
+
+void Metrics::Histogram::add(uint64_t us) {
+    int bucket = 0;
+    while (bucket < kBuckets - 1 && (us >> bucket) != 0) {
+        ++bucket;
+    }
+    ++buckets_[bucket];
+    ++count_;
+    sum_ += us;
+    if (us > max_) {
+        max_ = us;
+    }
+}
+
+void Metrics::Histogram::merge(const Histogram &other) {
+    for (int i = 0; i < kBuckets; ++i) {
+        buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    if (other.max_ > max_) {
+        max_ = other.max_;
+    }
+}
+
+uint64_t Metrics::Histogram::percentile(double p) const {
+    if (count_ == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(p * count_);
+    if (rank >= count_) {
+        rank = count_ - 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+        seen += buckets_[i];
+        if (seen > rank) {
+            uint64_t upper = i == 0 ? 0 : ((uint64_t)1 << i) - 1;
+            return upper < max_ ? upper : max_;
+        }
+    }
+    return max_;
+}
+
+Metrics::Sample::Sample(Metrics &metrics, const ::google::protobuf::Descriptor *descriptor, Operation operation) :
+        metrics_(metrics),
+        descriptor_(descriptor),
+        operation_(operation),
+        active_(metrics.enabled()),
+        failed_(false),
+        rows_in_(0),
+        rows_out_(0),
+        bytes_in_(0),
+        bytes_out_(0) {
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        phases_[i] = Clock::duration::zero();
+    }
+    if (active_) {
+        start_ = last_ = Clock::now();
+    }
+}
+
+Metrics::Sample::~Sample() {
+    if (active_) {
+        metrics_.record(*this);
+    }
+}
+
+Metrics::Clock::duration Metrics::Sample::mark(Phase phase) {
+    if (active_ == false) {
+        return Clock::duration::zero();
+    }
+
+    Clock::time_point now = Clock::now();
+    Clock::duration elapsed = now - last_;
+    phases_[phase] += elapsed;
+    last_ = now;
+    return elapsed;
+}
+
+void Metrics::Sample::skip() {
+    if (active_) {
+        last_ = Clock::now();
+    }
+}
+
+Metrics::Metrics() :
+        enabled_(true),
+        slow_query_us_(0),
+        slow_query_sample_(1),
+        slow_queries_(0) {}
+
+void Metrics::setSlowQueryLog(uint32_t threshold_ms, uint32_t sample) {
+    slow_query_us_ = (uint64_t)threshold_ms * 1000;
+    slow_query_sample_ = sample != 0 ? sample : 1;
+}
+
+void Metrics::slowQuery(Clock::duration elapsed, const std::string &statement) {
+    uint64_t threshold = slow_query_us_;
+    if (threshold == 0) {
+        return;
+    }
+
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    if (us < threshold) {
+        return;
+    }
+
+    uint64_t count = slow_queries_++;
+    if (count % slow_query_sample_ != 0) {
+        return;
+    }
+
+    if (statement.size() > kSlowQueryPrintLength) {
+        printf("Slow query(%" PRIu64 "us): %.*s ...(%zu bytes)\n", us,
+            (int)kSlowQueryPrintLength, statement.c_str(), statement.size());
+    } else {
+        printf("Slow query(%" PRIu64 "us): %s\n", us, statement.c_str());
+    }
+}
+
+void Metrics::record(const Sample &sample) {
+    Clock::duration total = Clock::now() - sample.start_;
+
+    Stripe &stripe = stripes_[threadStripe(kStripes)];
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    Counters &counters = stripe.counters[Key(sample.descriptor_, sample.operation_)];
+    ++counters.calls;
+    if (sample.failed_) {
+        ++counters.errors;
+    }
+    counters.rows_in += sample.rows_in_;
+    counters.rows_out += sample.rows_out_;
+    counters.bytes_in += sample.bytes_in_;
+    counters.bytes_out += sample.bytes_out_;
+    counters.total.add(std::chrono::duration_cast<std::chrono::microseconds>(total).count());
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        if (sample.phases_[i] != Clock::duration::zero()) {
+            counters.phases[i].add(std::chrono::duration_cast<std::chrono::microseconds>(sample.phases_[i]).count());
+        }
+    }
+}
+
+Metrics::Snapshot Metrics::snapshot() const {
+    Snapshot snapshot;
+    snapshot.slow_queries = slow_queries_;
+
+    std::map<Key, Counters> merged;
+    for (size_t i = 0; i < kStripes; ++i) {
+        std::lock_guard<std::mutex> lock(stripes_[i].mutex);
+        for (std::map<Key, Counters>::const_iterator iter = stripes_[i].counters.begin();
+                iter != stripes_[i].counters.end(); ++iter) {
+            mergeCounters(merged[iter->first], iter->second);
+        }
+    }
+
+    for (std::map<Key, Counters>::const_iterator iter = merged.begin(); iter != merged.end(); ++iter) {
+        Entry entry;
+        entry.type = iter->first.first != NULL ? iter->first.first->full_name() : "";
+        entry.operation = (Operation)iter->first.second;
+        entry.counters = iter->second;
+        snapshot.entries.push_back(entry);
+    }
+    return snapshot;
+}
+
+std::string Metrics::dump() const {
+    Snapshot snapshot = this->snapshot();
+
+    std::ostringstream oss;
+    for (size_t i = 0; i < snapshot.entries.size(); ++i) {
+        const Entry &entry = snapshot.entries[i];
+        const Counters &counters = entry.counters;
+        oss << entry.type << " " << operationName(entry.operation)
+            << " calls=" << counters.calls
+            << " errors=" << counters.errors
+            << " rows_in=" << counters.rows_in
+            << " rows_out=" << counters.rows_out
+            << " bytes_in=" << counters.bytes_in
+            << " bytes_out=" << counters.bytes_out << "\n";
+
+        const Histogram *histograms[PHASE_COUNT + 1] = { &counters.total };
+        const char *names[PHASE_COUNT + 1] = { "total" };
+        for (int j = 0; j < PHASE_COUNT; ++j) {
+            histograms[j + 1] = &counters.phases[j];
+            names[j + 1] = phaseName((Phase)j);
+        }
+        for (int j = 0; j < PHASE_COUNT + 1; ++j) {
+            if (histograms[j]->count() == 0) {
+                continue;
+            }
+            oss << "    " << names[j]
+                << " avg=" << histograms[j]->average() << "us"
+                << " p50=" << histograms[j]->percentile(0.5) << "us"
+                << " p99=" << histograms[j]->percentile(0.99) << "us"
+                << " max=" << histograms[j]->max() << "us\n";
+        }
+    }
+    oss << "slow_queries=" << snapshot.slow_queries << "\n";
+    return oss.str();
+}
+
+void Metrics::reset() {
+    for (size_t i = 0; i < kStripes; ++i) {
+        std::lock_guard<std::mutex> lock(stripes_[i].mutex);
+        stripes_[i].counters.clear();
+    }
+    slow_queries_ = 0;
+}
+
+}  // namespace pmo
@@ -0,0 +1,185 @@
+#ifndef PMO_METRICS_H
+#define PMO_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class Descriptor;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+// Counters and latency histograms of Storage calls per (message type,
+// operation), each call split into SQL build, server round trip and row
+// decode time. Also owns the slow query log.
+class Metrics {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    enum Operation {
+        LOAD,
+        LOAD_MANY,
+        STREAM,
+        SAVE,
+        BATCH_SAVE,
+        UPDATE,
+        OPERATION_COUNT
+    };
+
+    enum Phase {
+        BUILD,
+        ROUND_TRIP,
+        DECODE,
+        PHASE_COUNT
+    };
+
+    static const char *operationName(Operation operation);
+    static const char *phaseName(Phase phase);
+
+    // Power of two microsecond buckets, bucket i holds [2^(i-1), 2^i).
+    class Histogram {
+    public:
+        static const int kBuckets = 32;
+
+        Histogram();
+
+        void add(uint64_t us);
+        void merge(const Histogram &other);
+
+        uint64_t count() const { return count_; }
+        uint64_t sum() const { return sum_; }
+        uint64_t max() const { return max_; }
+        uint64_t average() const { return count_ != 0 ? sum_ / count_ : 0; }
+        // Upper bound of the bucket holding the |p| (0..1) quantile.
+        uint64_t percentile(double p) const;
+
+    private:
+        uint64_t buckets_[kBuckets];
+        uint64_t count_;
+        uint64_t sum_;
+        uint64_t max_;
+    };
+
+    struct Counters {
+        Counters() : calls(0), errors(0), rows_in(0), rows_out(0), bytes_in(0), bytes_out(0) {}
+
+        uint64_t calls;
+        uint64_t errors;
+        uint64_t rows_in;
+        uint64_t rows_out;
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+        Histogram total;
+        Histogram phases[PHASE_COUNT];
+    };
+
+    struct Entry {
+        std::string type;
+        Operation operation;
+        Counters counters;
+    };
+
+    struct Snapshot {
+        Snapshot() : slow_queries(0) {}
+
+        std::vector<Entry> entries;
+        uint64_t slow_queries;
+    };
+
+    // Timing of one call, recorded when it goes out of scope. mark() charges
+    // the time since the previous mark to a phase. Does nothing, not even
+    // reading the clock, while the metrics are disabled.
+    class Sample {
+    public:
+        Sample(Metrics &metrics, const google::protobuf::Descriptor *descriptor, Operation operation);
+        ~Sample();
+
+        Clock::duration mark(Phase phase);
+        // Moves the mark without charging any phase.
+        void skip();
+
+        void addRowsIn(size_t rows) { rows_in_ += rows; }
+        void addRowsOut(size_t rows) { rows_out_ += rows; }
+        void addBytesIn(size_t bytes) { bytes_in_ += bytes; }
+        void addBytesOut(size_t bytes) { bytes_out_ += bytes; }
+        void setFailed(bool failed) { failed_ = failed; }
+
+    private:
+        friend class Metrics;
+
+        Sample(const Sample &);
+        Sample &operator=(const Sample &);
+
+        Metrics &metrics_;
+        const google::protobuf::Descriptor *descriptor_;
+        Operation operation_;
+        bool active_;
+        bool failed_;
+        Clock::time_point start_;
+        Clock::time_point last_;
+        Clock::duration phases_[PHASE_COUNT];
+        uint64_t rows_in_;
+        uint64_t rows_out_;
+        uint64_t bytes_in_;
+        uint64_t bytes_out_;
+    };
+
+    Metrics();
+
+    void setEnabled(bool enable) { enabled_ = enable; }
+    bool enabled() const { return enabled_; }
+
+    // Statements whose round trip exceeds |threshold_ms| are printed, one in
+    // every |sample| of them. 0 turns the log off.
+    void setSlowQueryLog(uint32_t threshold_ms, uint32_t sample = 1);
+    // Round trip of a statement described by |statement|, long statements
+    // are cut when printed.
+    void slowQuery(Clock::duration elapsed, const std::string &statement);
+
+    Snapshot snapshot() const;
+    // One block per (type, operation): counters, then average, p50, p99 and
+    // max microseconds of the whole call and of each phase.
+    std::string dump() const;
+    void reset();
+
+private:
+    typedef std::pair<const google::protobuf::Descriptor *, int> Key;
+
+    Metrics(const Metrics &);
+    Metrics &operator=(const Metrics &);
+
+    // Threads record into one of kStripes counter maps picked per thread,
+    // so concurrent calls rarely share a lock. snapshot() merges them.
+    static const size_t kStripes = 16;
+
+    struct Stripe {
+        mutable std::mutex mutex;
+        std::map<Key, Counters> counters;
+    };
+
+    void record(const Sample &sample);
+
+    std::atomic<bool> enabled_;
+    std::atomic<uint64_t> slow_query_us_;
+    std::atomic<uint32_t> slow_query_sample_;
+    std::atomic<uint64_t> slow_queries_;
+
+    Stripe stripes_[kStripes];
+};
+
+}   // namespace pmo
+
+#endif  // PMO_METRICS_H
@@ -0,0 +1,125 @@
+#include "parallel_loader.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "query.h"
+#include "storage.h"
+#include "table_schema.h"
+
+namespace pmo {
+
+ParallelLoader::ParallelLoader(Storage &storage, const ParallelLoaderOptions &options) :
+        storage_(storage),
+        options_(options) {
+    if (options_.threads == 0) {
+        options_.threads = 1;
+    }
+    if (options_.partitions_per_thread == 0) {
+        options_.partitions_per_thread = 1;
+    }
+}
+
+bool ParallelLoader::load(const ::google::protobuf::Message &filter, const Sink &sink, Stats *stats) {
+    const TableSchema *schema = TableSchema::get(filter.GetDescriptor());
+    const TableSchema::FieldList &primary_key = schema->primaryKey();
+
+    // Split points of the first key column, partition i reads
+    // [bounds[i - 1], bounds[i]). The first and last partitions are open
+    // so rows inserted outside MIN..MAX meanwhile are not missed.
+    std::vector<std::shared_ptr< ::google::protobuf::Message> > bounds;
+    if (primary_key.empty() == false) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = primary_key[0];
+        TableSchema::FieldList fields(1, field_descriptor);
+
+        // MIN and MAX as the first row in each key order, two index dives.
+        std::vector< ::google::protobuf::Message *> first;
+        std::vector< ::google::protobuf::Message *> last;
+        bool ok = storage_.load(Query(filter).select(fields).orderByKey(false).limit(1), first) &&
+            storage_.load(Query(filter).select(fields).orderByKey(true).limit(1), last);
+
+        uint64_t min = 0;
+        uint64_t max = 0;
+        if (ok && first.empty() == false && last.empty() == false &&
+                TableSchema::ordinalOf(*first[0], field_descriptor, min) &&
+                TableSchema::ordinalOf(*last[0], field_descriptor, max) &&
+                max > min) {
+            uint64_t partitions = options_.threads * options_.partitions_per_thread;
+            uint64_t step = (max - min) / partitions + 1;
+            for (uint64_t bound = min + step; bound <= max && bound > min; bound += step) {
+                std::shared_ptr< ::google::protobuf::Message> message(filter.New());
+                TableSchema::setOrdinal(message.get(), field_descriptor, bound);
+                bounds.push_back(message);
+            }
+        }
+
+        for (size_t i = 0; i < first.size(); ++i) {
+            delete first[i];
+        }
+        for (size_t i = 0; i < last.size(); ++i) {
+            delete last[i];
+        }
+        if (ok == false) {
+            return false;
+        }
+    }
+
+    size_t partitions = bounds.size() + 1;
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> failed(0);
+    std::atomic<uint64_t> rows(0);
+    std::atomic<bool> stopped(false);
+
+    auto run = [&]() {
+        size_t partition;
+        while (stopped == false && (partition = next++) < partitions) {
+            Query query(filter);
+            if (partition > 0) {
+                query.lowerBound(*bounds[partition - 1], true);
+            }
+            if (partition < bounds.size()) {
+                query.upperBound(*bounds[partition], false);
+            }
+
+            uint64_t count = 0;
+            bool ok = storage_.load(query, [&](const ::google::protobuf::Message &row) {
+                ++count;
+                if (stopped || sink(row) == false) {
+                    stopped = true;
+                    return false;
+                }
+                return true;
+            });
+            rows += count;
+            if (ok == false && stopped == false) {
+                printf("ParallelLoader: partition %zu of %s failed.\n", partition, filter.GetTypeName().c_str());
+                ++failed;
+            }
+        }
+    };
+
+    size_t threads = options_.threads < partitions ? options_.threads : partitions;
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        workers.push_back(std::thread(run));
+    }
+    run();
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i].join();
+    }
+
+    if (stats != NULL) {
+        stats->partitions = partitions;
+        stats->failed = failed;
+        stats->rows = rows;
+    }
+    return failed == 0 && stopped == false;
+}
+
+}  // namespace pmo
@@ -0,0 +1,69 @@
+#ifndef PMO_PARALLEL_LOADER_H
+#define PMO_PARALLEL_LOADER_H
+
+#include <functional>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+class Storage;
+
+struct ParallelLoaderOptions {
+    ParallelLoaderOptions() :
+            threads(4),
+            partitions_per_thread(4) {}
+
+    // Worker threads, each streams on its own pooled connection so the
+    // pool's max_size should be at least this.
+    size_t threads;
+    // Key ranges are split evenly, more partitions than threads evens out
+    // ranges that turn out denser than others.
+    size_t partitions_per_thread;
+};
+
+// Whole table load for warm-up. The table is split into ranges of the
+// first primary key column between its MIN and MAX, the ranges are
+// streamed concurrently and rows are decoded on the worker threads.
+// Tables whose first key column is not an integer are read as a single
+// range.
+class ParallelLoader {
+public:
+    // Called concurrently from the worker threads with a message that is
+    // reused for the next row. Returning false stops the load.
+    typedef std::function<bool (const google::protobuf::Message &row)> Sink;
+
+    struct Stats {
+        Stats() : partitions(0), failed(0), rows(0) {}
+
+        size_t partitions;
+        size_t failed;
+        uint64_t rows;
+    };
+
+    ParallelLoader(Storage &storage, const ParallelLoaderOptions &options = ParallelLoaderOptions());
+
+    // Every row matching the set fields of |filter|. Returns false if a
+    // partition failed or the sink stopped the load.
+    bool load(const google::protobuf::Message &filter, const Sink &sink, Stats *stats = NULL);
+
+private:
+    ParallelLoader(const ParallelLoader &);
+    ParallelLoader &operator=(const ParallelLoader &);
+
+    Storage &storage_;
+    ParallelLoaderOptions options_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_PARALLEL_LOADER_H
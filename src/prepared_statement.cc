@@ -0,0 +1,351 @@
+#include "prepared_statement.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <google/protobuf/message.h>
+
+#include "table_schema.h"
+
+namespace pmo {
+
+// Initial buffer size for string/bytes result columns, grown on demand.
+static const size_t kInitialStringBufferSize = 256;
+
+PreparedStatement *PreparedStatement::create(MYSQL *mysql, const std::string &sql,
+        const FieldList &params, const FieldList &columns) {
+    MYSQL_STMT *stmt = ::mysql_stmt_init(mysql);
+    if (stmt == NULL) {
+        printf("mysql_stmt_init failed.\n");
+        return NULL;
+    }
+
+    if (::mysql_stmt_prepare(stmt, sql.c_str(), sql.length()) != 0) {
+        printf("mysql_stmt_prepare failed: %s, sql: %s\n", ::mysql_stmt_error(stmt), sql.c_str());
+        ::mysql_stmt_close(stmt);
+        return NULL;
+    }
+
+    if (::mysql_stmt_param_count(stmt) != params.size()) {
+        printf("mysql_stmt_param_count mismatch, sql: %s\n", sql.c_str());
+        ::mysql_stmt_close(stmt);
+        return NULL;
+    }
+
+    PreparedStatement *statement = new PreparedStatement(mysql, stmt, params, columns);
+    if (statement->bindColumns() == false) {
+        delete statement;
+        return NULL;
+    }
+
+    return statement;
+}
+
+PreparedStatement::PreparedStatement(MYSQL *mysql, MYSQL_STMT *stmt,
+        const FieldList &params, const FieldList &columns) :
+        mysql_(mysql),
+        stmt_(stmt),
+        params_(params),
+        columns_(columns),
+        param_binds_(params.size()),
+        param_buffers_(params.size()),
+        column_binds_(columns.size()),
+        column_buffers_(columns.size()),
+        fetch_failed_(false) {
+    for (size_t i = 0; i < params_.size(); ++i) {
+        memset(&param_binds_[i], 0, sizeof(MYSQL_BIND));
+        setBindType(params_[i], param_binds_[i]);
+    }
+
+    for (size_t i = 0; i < columns_.size(); ++i) {
+        memset(&column_binds_[i], 0, sizeof(MYSQL_BIND));
+        setBindType(columns_[i], column_binds_[i]);
+        if (columns_[i]->cpp_type() == ::google::protobuf::FieldDescriptor::CPPTYPE_STRING) {
+            column_buffers_[i].string_value.resize(kInitialStringBufferSize);
+        }
+    }
+}
+
+PreparedStatement::~PreparedStatement() {
+    if (stmt_ != NULL) {
+        ::mysql_stmt_close(stmt_);
+        stmt_ = NULL;
+    }
+}
+
+bool PreparedStatement::isBindable(const ::google::protobuf::FieldDescriptor *field_descriptor) {
+    return TableSchema::isColumn(field_descriptor);
+}
+
+void PreparedStatement::setBindType(const ::google::protobuf::FieldDescriptor *field_descriptor, MYSQL_BIND &bind) {
+    if (field_descriptor == NULL) {
+        bind.buffer_type = MYSQL_TYPE_BLOB;
+        return;
+    }
+
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            bind.buffer_type = MYSQL_TYPE_LONG;
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            bind.buffer_type = MYSQL_TYPE_LONG;
+            bind.is_unsigned = 1;
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            bind.buffer_type = MYSQL_TYPE_LONGLONG;
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            bind.buffer_type = MYSQL_TYPE_LONGLONG;
+            bind.is_unsigned = 1;
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+            bind.buffer_type = MYSQL_TYPE_DOUBLE;
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+            bind.buffer_type = MYSQL_TYPE_FLOAT;
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+            bind.buffer_type = MYSQL_TYPE_TINY;
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+            bind.buffer_type = MYSQL_TYPE_LONG;
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+            if (field_descriptor->type() == ::google::protobuf::FieldDescriptor::TYPE_BYTES) {
+                bind.buffer_type = MYSQL_TYPE_BLOB;
+            } else {
+                bind.buffer_type = MYSQL_TYPE_STRING;
+            }
+            break;
+        default:
+            bind.buffer_type = MYSQL_TYPE_NULL;
+            break;
+    }
+}
+
+bool PreparedStatement::bindColumns() {
+    if (columns_.empty()) {
+        return true;
+    }
+
+    for (size_t i = 0; i < columns_.size(); ++i) {
+        MYSQL_BIND &bind = column_binds_[i];
+        Buffer &buffer = column_buffers_[i];
+        bind.length = &buffer.length;
+        bind.is_null = &buffer.is_null;
+        bind.error = &buffer.error;
+        if (columns_[i]->cpp_type() == ::google::protobuf::FieldDescriptor::CPPTYPE_STRING) {
+            bind.buffer = &buffer.string_value[0];
+            bind.buffer_length = buffer.string_value.size();
+        } else {
+            bind.buffer = &buffer.int64_value;
+            bind.buffer_length = sizeof(buffer.int64_value);
+        }
+    }
+
+    if (::mysql_stmt_bind_result(stmt_, &column_binds_[0]) != 0) {
+        printf("mysql_stmt_bind_result failed: %s\n", ::mysql_stmt_error(stmt_));
+        return false;
+    }
+
+    return true;
+}
+
+bool PreparedStatement::execute(const ::google::protobuf::Message &message) {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+
+    for (size_t i = 0; i < params_.size(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = params_[i];
+        MYSQL_BIND &bind = param_binds_[i];
+        Buffer &buffer = param_buffers_[i];
+
+        if (field_descriptor == NULL) {
+            // The buffer keeps its capacity between executions.
+            buffer.string_value.clear();
+            if (message.AppendToString(&buffer.string_value) == false) {
+                printf("Serialize %s failed.\n", message.GetTypeName().c_str());
+                return false;
+            }
+            bind.buffer = const_cast<char *>(buffer.string_value.data());
+            bind.buffer_length = buffer.string_value.size();
+            buffer.length = buffer.string_value.size();
+            bind.length = &buffer.length;
+            continue;
+        }
+
+        switch (field_descriptor->cpp_type()) {
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+                buffer.int32_value = reflection->GetInt32(message, field_descriptor);
+                bind.buffer = &buffer.int32_value;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+                buffer.uint32_value = reflection->GetUInt32(message, field_descriptor);
+                bind.buffer = &buffer.uint32_value;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+                buffer.int64_value = reflection->GetInt64(message, field_descriptor);
+                bind.buffer = &buffer.int64_value;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+                buffer.uint64_value = reflection->GetUInt64(message, field_descriptor);
+                bind.buffer = &buffer.uint64_value;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+                buffer.double_value = reflection->GetDouble(message, field_descriptor);
+                bind.buffer = &buffer.double_value;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+                buffer.float_value = reflection->GetFloat(message, field_descriptor);
+                bind.buffer = &buffer.float_value;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+                buffer.bool_value = reflection->GetBool(message, field_descriptor) ? 1 : 0;
+                bind.buffer = &buffer.bool_value;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+                buffer.int32_value = reflection->GetEnum(message, field_descriptor)->number();
+                bind.buffer = &buffer.int32_value;
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+                // Points straight into the message when it stores a string.
+                const std::string &value =
+                    reflection->GetStringReference(message, field_descriptor, &buffer.string_value);
+                bind.buffer = const_cast<char *>(value.data());
+                bind.buffer_length = value.size();
+                buffer.length = value.size();
+                bind.length = &buffer.length;
+                break;
+            }
+            default:
+                printf("Not support name(%s).\n", field_descriptor->name().c_str());
+                return false;
+        }
+    }
+
+    if (params_.empty() == false && ::mysql_stmt_bind_param(stmt_, &param_binds_[0]) != 0) {
+        printf("mysql_stmt_bind_param failed: %s\n", ::mysql_stmt_error(stmt_));
+        return false;
+    }
+
+    fetch_failed_ = false;
+    if (::mysql_stmt_execute(stmt_) != 0) {
+        printf("mysql_stmt_execute failed: %s\n", ::mysql_stmt_error(stmt_));
+        return false;
+    }
+
+    if (columns_.empty() == false && ::mysql_stmt_store_result(stmt_) != 0) {
+        printf("mysql_stmt_store_result failed: %s\n", ::mysql_stmt_error(stmt_));
+        return false;
+    }
+
+    return true;
+}
+
+bool PreparedStatement::fetch(::google::protobuf::Message *message) {
+    int ret = ::mysql_stmt_fetch(stmt_);
+    if (ret == MYSQL_NO_DATA) {
+        return false;
+    }
+    if (ret != 0 && ret != MYSQL_DATA_TRUNCATED) {
+        printf("mysql_stmt_fetch failed: %s\n", ::mysql_stmt_error(stmt_));
+        fetch_failed_ = true;
+        return false;
+    }
+
+    bool rebind = false;
+    if (ret == MYSQL_DATA_TRUNCATED) {
+        // A numeric value that does not fit its field would be stored
+        // wrapped or clamped, the row is refused instead.
+        for (size_t i = 0; i < columns_.size(); ++i) {
+            if (column_buffers_[i].error &&
+                    columns_[i]->cpp_type() != ::google::protobuf::FieldDescriptor::CPPTYPE_STRING) {
+                printf("%s: column value out of range of %s.\n", columns_[i]->full_name().c_str(),
+                    columns_[i]->cpp_type_name());
+                fetch_failed_ = true;
+                return false;
+            }
+        }
+
+        for (size_t i = 0; i < columns_.size(); ++i) {
+            Buffer &buffer = column_buffers_[i];
+            if (columns_[i]->cpp_type() != ::google::protobuf::FieldDescriptor::CPPTYPE_STRING ||
+                    buffer.length <= buffer.string_value.size()) {
+                continue;
+            }
+
+            buffer.string_value.resize(buffer.length);
+            MYSQL_BIND bind = column_binds_[i];
+            bind.buffer = &buffer.string_value[0];
+            bind.buffer_length = buffer.string_value.size();
+            if (::mysql_stmt_fetch_column(stmt_, &bind, i, 0) != 0) {
+                printf("mysql_stmt_fetch_column failed: %s\n", ::mysql_stmt_error(stmt_));
+                fetch_failed_ = true;
+                bindColumns();
+                return false;
+            }
+            rebind = true;
+        }
+    }
+
+    const ::google::protobuf::Reflection *reflection = message->GetReflection();
+    for (size_t i = 0; i < columns_.size(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = columns_[i];
+        const Buffer &buffer = column_buffers_[i];
+        if (buffer.is_null) {
+            continue;
+        }
+
+        switch (field_descriptor->cpp_type()) {
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+                reflection->SetInt32(message, field_descriptor, buffer.int32_value);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+                reflection->SetUInt32(message, field_descriptor, buffer.uint32_value);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+                reflection->SetInt64(message, field_descriptor, buffer.int64_value);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+                reflection->SetUInt64(message, field_descriptor, buffer.uint64_value);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+                reflection->SetDouble(message, field_descriptor, buffer.double_value);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+                reflection->SetFloat(message, field_descriptor, buffer.float_value);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+                reflection->SetBool(message, field_descriptor, buffer.bool_value != 0);
+                break;
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM: {
+                const ::google::protobuf::EnumValueDescriptor *value =
+                    field_descriptor->enum_type()->FindValueByNumber(buffer.int32_value);
+                if (value != NULL) {
+                    reflection->SetEnum(message, field_descriptor, value);
+                }
+                break;
+            }
+            case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+                reflection->SetString(message, field_descriptor,
+                    std::string(buffer.string_value.data(), buffer.length));
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (rebind) {
+        return bindColumns();
+    }
+
+    return true;
+}
+
+void PreparedStatement::freeResult() {
+    ::mysql_stmt_free_result(stmt_);
+}
+
+unsigned int PreparedStatement::errorCode() const {
+    return ::mysql_stmt_errno(stmt_);
+}
+
+}  // namespace pmo
@@ -0,0 +1,92 @@
+#ifndef PMO_PREPARED_STATEMENT_H
+#define PMO_PREPARED_STATEMENT_H
+
+#include <string>
+#include <vector>
+
+#include <mysql.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class FieldDescriptor;
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+// Server side prepared statement whose parameters and result columns map
+// one to one onto message fields. Values travel in the binary protocol,
+// no text formatting, escaping or parsing is involved.
+class PreparedStatement {
+public:
+    typedef std::vector<const google::protobuf::FieldDescriptor *> FieldList;
+
+    // A NULL entry of |params| binds the whole message serialized as a
+    // BLOB. Returns NULL when the statement can not be prepared.
+    static PreparedStatement *create(MYSQL *mysql, const std::string &sql,
+            const FieldList &params, const FieldList &columns);
+    ~PreparedStatement();
+
+    // Whether the field can be bound as a parameter or result column.
+    static bool isBindable(const google::protobuf::FieldDescriptor *field_descriptor);
+
+    // Binds the param fields of message and executes the statement, the
+    // result set (if any) is buffered on the client.
+    bool execute(const google::protobuf::Message &message);
+
+    // Fills the column fields of message from the next row, returns false
+    // when there are no more rows or on error.
+    bool fetch(google::protobuf::Message *message);
+    // Whether the last false from fetch() was an error rather than the end
+    // of the rows, e.g. a numeric column out of range of its field.
+    bool fetchFailed() const { return fetch_failed_; }
+    void freeResult();
+
+    const char *error() const { return ::mysql_stmt_error(stmt_); }
+    unsigned int errorCode() const;
+
+private:
+    struct Buffer {
+        Buffer() : length(0), is_null(0), error(0) {}
+
+        union {
+            int64_t int64_value;
+            uint64_t uint64_value;
+            int32_t int32_value;
+            uint32_t uint32_value;
+            double double_value;
+            float float_value;
+            signed char bool_value;
+        };
+        std::string string_value;
+        unsigned long length;
+        my_bool is_null;
+        my_bool error;
+    };
+
+    PreparedStatement(MYSQL *mysql, MYSQL_STMT *stmt, const FieldList &params, const FieldList &columns);
+    PreparedStatement(const PreparedStatement &);
+    PreparedStatement &operator=(const PreparedStatement &);
+
+    static void setBindType(const google::protobuf::FieldDescriptor *field_descriptor, MYSQL_BIND &bind);
+    bool bindColumns();
+
+    MYSQL *mysql_;
+    MYSQL_STMT *stmt_;
+    FieldList params_;
+    FieldList columns_;
+    std::vector<MYSQL_BIND> param_binds_;
+    std::vector<Buffer> param_buffers_;
+    std::vector<MYSQL_BIND> column_binds_;
+    std::vector<Buffer> column_buffers_;
+    bool fetch_failed_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_PREPARED_STATEMENT_H
@@ -0,0 +1,104 @@
+#include "query.h"
+
+#include <stdio.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "storage.h"
+#include "table_schema.h"
+
+namespace pmo {
+
+Query::Query(const ::google::protobuf::Message &filter) :
+        filter_(&filter),
+        fields_(NULL),
+        lower_(NULL),
+        lower_inclusive_(true),
+        upper_(NULL),
+        upper_inclusive_(false),
+        ordered_(false),
+        descending_(false),
+        limit_(0) {}
+
+Query &Query::select(const FieldList &fields) {
+    fields_ = &fields;
+    return *this;
+}
+
+Query &Query::lowerBound(const ::google::protobuf::Message &bound, bool inclusive) {
+    lower_ = &bound;
+    lower_inclusive_ = inclusive;
+    return *this;
+}
+
+Query &Query::upperBound(const ::google::protobuf::Message &bound, bool inclusive) {
+    upper_ = &bound;
+    upper_inclusive_ = inclusive;
+    return *this;
+}
+
+Query &Query::between(const ::google::protobuf::Message &low, const ::google::protobuf::Message &high) {
+    lowerBound(low, true);
+    return upperBound(high, true);
+}
+
+Query &Query::orderByKey(bool descending) {
+    ordered_ = true;
+    descending_ = descending;
+    return *this;
+}
+
+Query &Query::limit(size_t count) {
+    limit_ = count;
+    return *this;
+}
+
+Query &Query::after(const ::google::protobuf::Message &row) {
+    // Only the key is kept, rows of a page may be large.
+    after_.reset(TableSchema::get(row.GetDescriptor())->newKeyMessage(row));
+    ordered_ = true;
+    return *this;
+}
+
+bool Query::isPlain() const {
+    return lower_ == NULL && upper_ == NULL && after_ == NULL && ordered_ == false && limit_ == 0;
+}
+
+Cursor::Cursor(Storage &storage, const Query &query, size_t page_size) :
+        storage_(storage),
+        query_(query),
+        done_(false) {
+    query_.orderByKey(query.descending());
+    query_.limit(page_size > 0 ? page_size : 1);
+}
+
+bool Cursor::next(std::vector< ::google::protobuf::Message *> &rows) {
+    if (done_) {
+        return true;
+    }
+
+    size_t first = rows.size();
+    if (storage_.load(query_, rows) == false) {
+        return false;
+    }
+
+    size_t count = rows.size() - first;
+    if (count < query_.limitCount()) {
+        done_ = true;
+    }
+    if (count == 0) {
+        return true;
+    }
+
+    std::string key;
+    const ::google::protobuf::Message &last = *rows.back();
+    if (TableSchema::get(last.GetDescriptor())->keyOf(last, key) == false) {
+        printf("Cursor: %s rows have no complete primary key.\n", last.GetTypeName().c_str());
+        done_ = true;
+        return false;
+    }
+    query_.after(last);
+    return true;
+}
+
+}  // namespace pmo
@@ -0,0 +1,108 @@
+#ifndef PMO_QUERY_H
+#define PMO_QUERY_H
+
+#include <memory>
+#include <vector>
+
+#include <stddef.h>
+
+namespace google {
+namespace protobuf {
+
+class FieldDescriptor;
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+class Storage;
+
+// A load beyond equality on the set fields of a message: range bounds,
+// ORDER BY the primary key, LIMIT and a keyset position. The messages
+// given to the setters are not copied and must outlive the query, the
+// after() position is.
+//
+// SELECT ... WHERE <filter> AND <bounds> AND (key) > (after)
+// ORDER BY key LIMIT n
+class Query {
+public:
+    typedef std::vector<const google::protobuf::FieldDescriptor *> FieldList;
+
+    // Equality on every set column of |filter|, which also gives the
+    // type of the rows.
+    explicit Query(const google::protobuf::Message &filter);
+
+    // Only |fields| are selected, see Storage::load() projections.
+    Query &select(const FieldList &fields);
+
+    // Every set column of |bound| becomes column >= value (> when not
+    // |inclusive|), and column <= value (<) for the upper bound. A column
+    // bounded inclusively on both sides becomes BETWEEN.
+    Query &lowerBound(const google::protobuf::Message &bound, bool inclusive = true);
+    Query &upperBound(const google::protobuf::Message &bound, bool inclusive = false);
+    Query &between(const google::protobuf::Message &low, const google::protobuf::Message &high);
+
+    Query &orderByKey(bool descending = false);
+    // 0 means no limit.
+    Query &limit(size_t count);
+    // Resumes after the row with the primary key of |row| in key order,
+    // implies orderByKey().
+    Query &after(const google::protobuf::Message &row);
+
+    const google::protobuf::Message &filter() const { return *filter_; }
+    const FieldList *fields() const { return fields_; }
+    const google::protobuf::Message *lower() const { return lower_; }
+    bool lowerInclusive() const { return lower_inclusive_; }
+    const google::protobuf::Message *upper() const { return upper_; }
+    bool upperInclusive() const { return upper_inclusive_; }
+    const google::protobuf::Message *position() const { return after_.get(); }
+    bool ordered() const { return ordered_; }
+    bool descending() const { return descending_; }
+    size_t limitCount() const { return limit_; }
+
+    // Nothing but the filter and projection, the form plain load() takes.
+    bool isPlain() const;
+
+private:
+    const google::protobuf::Message *filter_;
+    const FieldList *fields_;
+    const google::protobuf::Message *lower_;
+    bool lower_inclusive_;
+    const google::protobuf::Message *upper_;
+    bool upper_inclusive_;
+    // Shared by copies, it is never modified once set.
+    std::shared_ptr<const google::protobuf::Message> after_;
+    bool ordered_;
+    bool descending_;
+    size_t limit_;
+};
+
+// Keyset pagination over a Query. Each page resumes after the last key
+// of the previous one instead of using an OFFSET, so a page costs the
+// same however deep into the table the scan is and only one page is held
+// in memory. The table needs a primary key and projections must include
+// it.
+class Cursor {
+public:
+    Cursor(Storage &storage, const Query &query, size_t page_size);
+
+    // Appends the next page to |rows|, owned by the caller. Returns false
+    // on error, a failed load is retried by the next call.
+    bool next(std::vector<google::protobuf::Message *> &rows);
+    bool done() const { return done_; }
+
+    // Key of the last row returned so far, NULL before the first page.
+    // Query::after() with it resumes the scan elsewhere.
+    const google::protobuf::Message *position() const { return query_.position(); }
+
+private:
+    Storage &storage_;
+    Query query_;
+    bool done_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_QUERY_H
@@ -0,0 +1,192 @@
+#include "row_decoder.h"
+
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "table_schema.h"
+
+namespace pmo {
+
+// Cells of a text protocol row are NUL terminated, so the strto* family
+// can parse them in place.
+static void setInt32(::google::protobuf::Message *message, const ::google::protobuf::Reflection *reflection,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, const char *data, unsigned long length) {
+    reflection->SetInt32(message, field_descriptor, (int32_t)strtol(data, NULL, 10));
+}
+
+static void setUInt32(::google::protobuf::Message *message, const ::google::protobuf::Reflection *reflection,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, const char *data, unsigned long length) {
+    reflection->SetUInt32(message, field_descriptor, (uint32_t)strtoul(data, NULL, 10));
+}
+
+static void setInt64(::google::protobuf::Message *message, const ::google::protobuf::Reflection *reflection,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, const char *data, unsigned long length) {
+    reflection->SetInt64(message, field_descriptor, (int64_t)strtoll(data, NULL, 10));
+}
+
+static void setUInt64(::google::protobuf::Message *message, const ::google::protobuf::Reflection *reflection,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, const char *data, unsigned long length) {
+    reflection->SetUInt64(message, field_descriptor, (uint64_t)strtoull(data, NULL, 10));
+}
+
+static void setDouble(::google::protobuf::Message *message, const ::google::protobuf::Reflection *reflection,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, const char *data, unsigned long length) {
+    reflection->SetDouble(message, field_descriptor, strtod(data, NULL));
+}
+
+static void setFloat(::google::protobuf::Message *message, const ::google::protobuf::Reflection *reflection,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, const char *data, unsigned long length) {
+    reflection->SetFloat(message, field_descriptor, strtof(data, NULL));
+}
+
+static void setBool(::google::protobuf::Message *message, const ::google::protobuf::Reflection *reflection,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, const char *data, unsigned long length) {
+    // tinyint columns come back as "0"/"1".
+    bool value = strtol(data, NULL, 10) != 0 || data[0] == 't' || data[0] == 'T';
+    reflection->SetBool(message, field_descriptor, value);
+}
+
+static void setEnum(::google::protobuf::Message *message, const ::google::protobuf::Reflection *reflection,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, const char *data, unsigned long length) {
+    // Numbers the message does not know are dropped.
+    const ::google::protobuf::EnumValueDescriptor *value =
+        field_descriptor->enum_type()->FindValueByNumber((int)strtol(data, NULL, 10));
+    if (value != NULL) {
+        reflection->SetEnum(message, field_descriptor, value);
+    }
+}
+
+static void setString(::google::protobuf::Message *message, const ::google::protobuf::Reflection *reflection,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, const char *data, unsigned long length) {
+    reflection->SetString(message, field_descriptor, std::string(data, length));
+}
+
+const RowDecoder *RowDecoder::get(const ::google::protobuf::Descriptor *descriptor,
+        const MYSQL_FIELD *fields, unsigned int field_count) {
+    // Plans never change once built, each thread keeps the ones it has
+    // used and matches them against the result's columns without building
+    // a key. The shared map is only locked for a layout new to the thread.
+    typedef std::multimap<const ::google::protobuf::Descriptor *, const RowDecoder *> LocalPlans;
+    static thread_local LocalPlans seen;
+    std::pair<LocalPlans::iterator, LocalPlans::iterator> range = seen.equal_range(descriptor);
+    for (LocalPlans::iterator iter = range.first; iter != range.second; ++iter) {
+        if (iter->second->matches(fields, field_count)) {
+            return iter->second;
+        }
+    }
+
+    typedef std::pair<const ::google::protobuf::Descriptor *, std::string> PlanKey;
+    static std::mutex mutex;
+    static std::map<PlanKey, RowDecoder *> plans;
+
+    std::vector<std::string> column_names(field_count);
+    std::string layout;
+    for (unsigned int i = 0; i < field_count; ++i) {
+        column_names[i] = fields[i].name;
+        layout.append(fields[i].name);
+        layout.push_back(',');
+    }
+
+    PlanKey key(descriptor, layout);
+    std::lock_guard<std::mutex> lock(mutex);
+    RowDecoder *&decoder = plans[key];
+    if (decoder == NULL) {
+        decoder = new RowDecoder(descriptor, column_names);
+    }
+    seen.insert(std::make_pair(descriptor, decoder));
+    return decoder;
+}
+
+RowDecoder::RowDecoder(const ::google::protobuf::Descriptor *descriptor,
+        const std::vector<std::string> &column_names) :
+        column_names_(column_names),
+        columns_(column_names.size()),
+        blob_column_(-1) {
+    for (size_t i = 0; i < column_names.size(); ++i) {
+        if (column_names[i] == TableSchema::blobColumn()) {
+            blob_column_ = i;
+            continue;
+        }
+
+        const ::google::protobuf::FieldDescriptor *field_descriptor =
+            descriptor->FindFieldByName(column_names[i]);
+        if (field_descriptor == NULL ||
+                field_descriptor->label() == ::google::protobuf::FieldDescriptor::LABEL_REPEATED) {
+            continue;
+        }
+
+        Setter setter = setterFor(field_descriptor);
+        if (setter == NULL) {
+            continue;
+        }
+
+        columns_[i].field_descriptor = field_descriptor;
+        columns_[i].setter = setter;
+    }
+}
+
+bool RowDecoder::matches(const MYSQL_FIELD *fields, unsigned int field_count) const {
+    if (field_count != column_names_.size()) {
+        return false;
+    }
+    for (unsigned int i = 0; i < field_count; ++i) {
+        if (column_names_[i] != fields[i].name) {
+            return false;
+        }
+    }
+    return true;
+}
+
+RowDecoder::Setter RowDecoder::setterFor(const ::google::protobuf::FieldDescriptor *field_descriptor) {
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            return setInt32;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            return setUInt32;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            return setInt64;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            return setUInt64;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+            return setDouble;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+            return setFloat;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+            return setBool;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+            return setEnum;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+            return setString;
+        default:
+            return NULL;
+    }
+}
+
+bool RowDecoder::decode(const MYSQL_ROW row, const unsigned long *lengths,
+        ::google::protobuf::Message *message) const {
+    if (blob_column_ >= 0 && row[blob_column_] != NULL) {
+        if (message->ParseFromArray(row[blob_column_], lengths[blob_column_]) == false) {
+            printf("%s: bad %s.\n", message->GetTypeName().c_str(), TableSchema::blobColumn());
+            return false;
+        }
+        return true;
+    }
+
+    const ::google::protobuf::Reflection *reflection = message->GetReflection();
+    for (size_t i = 0; i < columns_.size(); ++i) {
+        const Column &column = columns_[i];
+        if (column.setter == NULL || row[i] == NULL) {
+            continue;
+        }
+        column.setter(message, reflection, column.field_descriptor, row[i], lengths[i]);
+    }
+    return true;
+}
+
+}  // namespace pmo
@@ -0,0 +1,68 @@
+#ifndef PMO_ROW_DECODER_H
+#define PMO_ROW_DECODER_H
+
+#include <string>
+#include <vector>
+
+#include <mysql.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class Descriptor;
+class FieldDescriptor;
+class Message;
+class Reflection;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+// Decoding plan for one (message type, result set column layout) pair.
+// Column i of a row maps directly onto a field and a typed setter, so a
+// row is decoded by a flat loop over its cells.
+class RowDecoder {
+public:
+    // Returns the cached plan, building it on first use. Plans are shared
+    // and live until exit.
+    static const RowDecoder *get(const google::protobuf::Descriptor *descriptor,
+            const MYSQL_FIELD *fields, unsigned int field_count);
+
+    // Builds a plan from column names without caching it.
+    RowDecoder(const google::protobuf::Descriptor *descriptor, const std::vector<std::string> &column_names);
+
+    // |lengths| comes from mysql_fetch_lengths() so bytes columns holding
+    // NUL are kept intact. A TableSchema::blobColumn() cell is parsed into
+    // the whole message, the other cells are copies of its fields. Returns
+    // false when the blob does not parse, |message| is then unusable.
+    bool decode(const MYSQL_ROW row, const unsigned long *lengths, google::protobuf::Message *message) const;
+
+    size_t columnCount() const { return columns_.size(); }
+    // Whether the plan was built for a result with these columns.
+    bool matches(const MYSQL_FIELD *fields, unsigned int field_count) const;
+
+private:
+    typedef void (*Setter)(google::protobuf::Message *message, const google::protobuf::Reflection *reflection,
+            const google::protobuf::FieldDescriptor *field_descriptor, const char *data, unsigned long length);
+
+    struct Column {
+        Column() : field_descriptor(NULL), setter(NULL) {}
+
+        const google::protobuf::FieldDescriptor *field_descriptor;
+        Setter setter;
+    };
+
+    static Setter setterFor(const google::protobuf::FieldDescriptor *field_descriptor);
+
+    std::vector<std::string> column_names_;
+    std::vector<Column> columns_;
+    // Index of the blob column, -1 when absent.
+    int blob_column_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_ROW_DECODER_H
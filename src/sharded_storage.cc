@@ -0,0 +1,412 @@
+#include "sharded_storage.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "table_schema.h"
+
+namespace pmo {
+
+// splitmix64 finalizer, spreads sequential ids over every shard.
+static uint64_t mixHash(uint64_t value) {
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    return value;
+}
+
+// FNV-1a, fixed so rows hash the same in every process and build.
+static uint64_t stringHash(const std::string &value) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < value.size(); ++i) {
+        hash ^= (unsigned char)value[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool isSignedKey(const ::google::protobuf::FieldDescriptor *field_descriptor) {
+    return field_descriptor->cpp_type() == ::google::protobuf::FieldDescriptor::CPPTYPE_INT32 ||
+        field_descriptor->cpp_type() == ::google::protobuf::FieldDescriptor::CPPTYPE_INT64;
+}
+
+ShardedStorage::ShardedStorage(const std::vector<ConnectionPoolOptions> &shards) :
+        stopping_(false) {
+    for (size_t i = 0; i < shards.size(); ++i) {
+        shards_.push_back(new Storage(shards[i]));
+    }
+    for (size_t i = 1; i < shards_.size(); ++i) {
+        workers_.push_back(std::thread(&ShardedStorage::runWorker, this));
+    }
+}
+
+ShardedStorage::~ShardedStorage() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i].join();
+    }
+
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        delete shards_[i];
+    }
+}
+
+bool ShardedStorage::setShardKey(const ::google::protobuf::Descriptor *descriptor, const std::string &field) {
+    const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->FindFieldByName(field);
+    if (field_descriptor == NULL || TableSchema::isColumn(field_descriptor) == false) {
+        printf("%s: shard key(%s) is no column.\n", descriptor->full_name().c_str(), field.c_str());
+        return false;
+    }
+
+    Route &route = routes_[descriptor];
+    route.field_descriptor = field_descriptor;
+    route.bounds.clear();
+    return true;
+}
+
+bool ShardedStorage::setShardRanges(const ::google::protobuf::Descriptor *descriptor, const std::string &field,
+        const std::vector<int64_t> &bounds) {
+    const ::google::protobuf::FieldDescriptor *field_descriptor = rangeKey(descriptor, field, bounds.size());
+    if (field_descriptor == NULL) {
+        return false;
+    }
+
+    std::vector<uint64_t> ordinals;
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        if (isSignedKey(field_descriptor)) {
+            ordinals.push_back((uint64_t)bounds[i] ^ (1ULL << 63));
+        } else if (bounds[i] >= 0) {
+            ordinals.push_back((uint64_t)bounds[i]);
+        } else {
+            printf("%s: bound %zu is out of range of shard key(%s).\n", descriptor->full_name().c_str(),
+                i, field.c_str());
+            return false;
+        }
+    }
+    return setRanges(descriptor, field_descriptor, ordinals);
+}
+
+bool ShardedStorage::setShardRanges(const ::google::protobuf::Descriptor *descriptor, const std::string &field,
+        const std::vector<uint64_t> &bounds) {
+    const ::google::protobuf::FieldDescriptor *field_descriptor = rangeKey(descriptor, field, bounds.size());
+    if (field_descriptor == NULL) {
+        return false;
+    }
+
+    std::vector<uint64_t> ordinals;
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        if (isSignedKey(field_descriptor) == false) {
+            ordinals.push_back(bounds[i]);
+        } else if (bounds[i] < (1ULL << 63)) {
+            ordinals.push_back(bounds[i] ^ (1ULL << 63));
+        } else {
+            printf("%s: bound %zu is out of range of shard key(%s).\n", descriptor->full_name().c_str(),
+                i, field.c_str());
+            return false;
+        }
+    }
+    return setRanges(descriptor, field_descriptor, ordinals);
+}
+
+const ::google::protobuf::FieldDescriptor *ShardedStorage::rangeKey(const ::google::protobuf::Descriptor *descriptor,
+        const std::string &field, size_t bounds) const {
+    if (bounds + 1 != shards_.size()) {
+        printf("%s: %zu shards need %zu ascending bounds.\n", descriptor->full_name().c_str(),
+            shards_.size(), shards_.size() - 1);
+        return NULL;
+    }
+
+    const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->FindFieldByName(field);
+    if (field_descriptor == NULL || TableSchema::isColumn(field_descriptor) == false) {
+        printf("%s: shard key(%s) is no column.\n", descriptor->full_name().c_str(), field.c_str());
+        return NULL;
+    }
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            return field_descriptor;
+        default:
+            printf("%s: range shard key(%s) is not an integer.\n", descriptor->full_name().c_str(), field.c_str());
+            return NULL;
+    }
+}
+
+bool ShardedStorage::setRanges(const ::google::protobuf::Descriptor *descriptor,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, const std::vector<uint64_t> &ordinals) {
+    if (std::is_sorted(ordinals.begin(), ordinals.end()) == false) {
+        printf("%s: %zu shards need %zu ascending bounds.\n", descriptor->full_name().c_str(),
+            shards_.size(), shards_.size() - 1);
+        return false;
+    }
+
+    Route &route = routes_[descriptor];
+    route.field_descriptor = field_descriptor;
+    route.bounds = ordinals;
+    return true;
+}
+
+const ShardedStorage::Route *ShardedStorage::route(const ::google::protobuf::Descriptor *descriptor) const {
+    std::map<const ::google::protobuf::Descriptor *, Route>::const_iterator iter = routes_.find(descriptor);
+    if (iter != routes_.end()) {
+        return &iter->second;
+    }
+
+    // Hash on the first primary key field unless configured.
+    static Route none;
+    return &none;
+}
+
+bool ShardedStorage::shardOf(const ::google::protobuf::Message &message, size_t &shard) const {
+    if (shards_.empty()) {
+        return false;
+    }
+
+    const Route *route = this->route(message.GetDescriptor());
+    const ::google::protobuf::FieldDescriptor *field_descriptor = route->field_descriptor;
+    if (field_descriptor == NULL) {
+        const TableSchema::FieldList &primary_key = TableSchema::get(message.GetDescriptor())->primaryKey();
+        if (primary_key.empty()) {
+            return false;
+        }
+        field_descriptor = primary_key[0];
+    }
+
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    if (reflection->HasField(message, field_descriptor) == false) {
+        return false;
+    }
+
+    if (route->bounds.empty() == false) {
+        uint64_t ordinal = 0;
+        TableSchema::ordinalOf(message, field_descriptor, ordinal);
+        shard = std::upper_bound(route->bounds.begin(), route->bounds.end(), ordinal) - route->bounds.begin();
+        return true;
+    }
+
+    uint64_t hash = 0;
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            hash = mixHash((uint64_t)(int64_t)reflection->GetInt32(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            hash = mixHash(reflection->GetUInt32(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            hash = mixHash((uint64_t)reflection->GetInt64(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            hash = mixHash(reflection->GetUInt64(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+            hash = mixHash(reflection->GetBool(message, field_descriptor) ? 1 : 0);
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+            hash = mixHash((uint64_t)(int64_t)reflection->GetEnum(message, field_descriptor)->number());
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+            std::string scratch;
+            hash = stringHash(reflection->GetStringReference(message, field_descriptor, &scratch));
+            break;
+        }
+        default:
+            printf("%s: shard key(%s) can not be hashed.\n", message.GetTypeName().c_str(),
+                field_descriptor->name().c_str());
+            return false;
+    }
+
+    shard = (size_t)(hash % shards_.size());
+    return true;
+}
+
+void ShardedStorage::forEachShard(const std::vector<size_t> &shards, const std::function<void (size_t)> &call) {
+    if (shards.empty()) {
+        return;
+    }
+    if (shards.size() == 1 || workers_.empty()) {
+        for (size_t i = 0; i < shards.size(); ++i) {
+            call(shards[i]);
+        }
+        return;
+    }
+
+    // Tasks touch |remaining| last and under the lock, it outlives them.
+    size_t remaining = shards.size() - 1;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i + 1 < shards.size(); ++i) {
+            size_t shard = shards[i];
+            tasks_.push_back([this, &call, &remaining, shard]() {
+                call(shard);
+                std::lock_guard<std::mutex> lock(mutex_);
+                --remaining;
+            });
+        }
+    }
+    wakeup_.notify_all();
+    call(shards.back());
+
+    // Concurrent calls may outnumber the workers, queued tasks are run here
+    // too rather than waited for.
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (remaining != 0) {
+        if (tasks_.empty()) {
+            done_.wait(lock);
+            continue;
+        }
+        std::function<void ()> task;
+        task.swap(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        task();
+        done_.notify_all();
+        lock.lock();
+    }
+}
+
+void ShardedStorage::runWorker() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        while (stopping_ == false && tasks_.empty()) {
+            wakeup_.wait(lock);
+        }
+        if (tasks_.empty()) {
+            break;
+        }
+
+        std::function<void ()> task;
+        task.swap(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        task();
+        done_.notify_all();
+        lock.lock();
+    }
+}
+
+bool ShardedStorage::load(const ::google::protobuf::Message &query,
+        std::vector< ::google::protobuf::Message *> &results) {
+    size_t shard = 0;
+    if (shardOf(query, shard)) {
+        return shards_[shard]->load(query, results);
+    }
+
+    std::vector<size_t> shards;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        shards.push_back(i);
+    }
+
+    std::vector<std::vector< ::google::protobuf::Message *> > shard_results(shards_.size());
+    std::vector<char> oks(shards_.size(), 0);
+    forEachShard(shards, [&](size_t index) {
+        oks[index] = shards_[index]->load(query, shard_results[index]);
+    });
+
+    bool ret = true;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        results.insert(results.end(), shard_results[i].begin(), shard_results[i].end());
+        ret = ret && oks[i];
+    }
+    return ret;
+}
+
+bool ShardedStorage::loadMany(const std::vector<const ::google::protobuf::Message *> &keys,
+        Storage::KeyedRows &results, std::vector<size_t> &missing) {
+    std::vector<std::vector<const ::google::protobuf::Message *> > shard_keys(shards_.size());
+    // Index into |keys| of each entry of shard_keys.
+    std::vector<std::vector<size_t> > shard_indexes(shards_.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        size_t shard = 0;
+        if (shardOf(*keys[i], shard) == false) {
+            printf("loadMany: key %zu of %s has no shard key.\n", i, keys[i]->GetTypeName().c_str());
+            return false;
+        }
+        shard_keys[shard].push_back(keys[i]);
+        shard_indexes[shard].push_back(i);
+    }
+
+    std::vector<size_t> shards;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        if (shard_keys[i].empty() == false) {
+            shards.push_back(i);
+        }
+    }
+
+    std::vector<Storage::KeyedRows> shard_results(shards_.size());
+    std::vector<std::vector<size_t> > shard_missing(shards_.size());
+    std::vector<char> oks(shards_.size(), 1);
+    forEachShard(shards, [&](size_t index) {
+        oks[index] = shards_[index]->loadMany(shard_keys[index], shard_results[index], shard_missing[index]);
+    });
+
+    bool ret = true;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        for (Storage::KeyedRows::iterator iter = shard_results[i].begin(); iter != shard_results[i].end(); ++iter) {
+            ::google::protobuf::Message *&slot = results[iter->first];
+            delete slot;
+            slot = iter->second;
+        }
+        for (size_t j = 0; j < shard_missing[i].size(); ++j) {
+            missing.push_back(shard_indexes[i][shard_missing[i][j]]);
+        }
+        ret = ret && oks[i];
+    }
+    std::sort(missing.begin(), missing.end());
+    return ret;
+}
+
+bool ShardedStorage::save(const ::google::protobuf::Message &message) {
+    size_t shard = 0;
+    if (shardOf(message, shard) == false) {
+        printf("save: %s has no shard key.\n", message.GetTypeName().c_str());
+        return false;
+    }
+    return shards_[shard]->save(message);
+}
+
+bool ShardedStorage::update(const ::google::protobuf::Message &message, const ::google::protobuf::Message &baseline) {
+    size_t shard = 0;
+    if (shardOf(message, shard) == false) {
+        printf("update: %s has no shard key.\n", message.GetTypeName().c_str());
+        return false;
+    }
+    return shards_[shard]->update(message, baseline);
+}
+
+bool ShardedStorage::save(const std::vector<const ::google::protobuf::Message *> &messages) {
+    std::vector<std::vector<const ::google::protobuf::Message *> > shard_messages(shards_.size());
+    for (size_t i = 0; i < messages.size(); ++i) {
+        size_t shard = 0;
+        if (shardOf(*messages[i], shard) == false) {
+            printf("save: %s has no shard key.\n", messages[i]->GetTypeName().c_str());
+            return false;
+        }
+        shard_messages[shard].push_back(messages[i]);
+    }
+
+    std::vector<size_t> shards;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        if (shard_messages[i].empty() == false) {
+            shards.push_back(i);
+        }
+    }
+
+    std::vector<char> oks(shards_.size(), 1);
+    forEachShard(shards, [&](size_t index) {
+        oks[index] = shards_[index]->save(shard_messages[index]);
+    });
+
+    return std::find(oks.begin(), oks.end(), 0) == oks.end();
+}
+
+}  // namespace pmo
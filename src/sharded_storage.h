@@ -0,0 +1,117 @@
+#ifndef PMO_SHARDED_STORAGE_H
+#define PMO_SHARDED_STORAGE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "storage.h"
+
+namespace google {
+namespace protobuf {
+
+class Descriptor;
+class FieldDescriptor;
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+// Storage over several databases, each row lives on the shard chosen by
+// one field of its message, the shard key. Calls that carry the shard key
+// go to that shard only, loads without it run on every shard in parallel
+// and their rows are concatenated in shard order.
+//
+// The shard key defaults to the first primary key field and is placed by
+// hash: a stable 64 bit hash of the value modulo the number of shards, so
+// the layout only depends on the shard count. setShardRanges() places
+// integer keys by value range instead.
+//
+// Per shard work of one call runs on a pool of shardCount() - 1 threads
+// kept for the lifetime of the object, plus the calling thread.
+class ShardedStorage {
+public:
+    // One Storage, and so one connection pool, per entry.
+    explicit ShardedStorage(const std::vector<ConnectionPoolOptions> &shards);
+    ~ShardedStorage();
+
+    size_t shardCount() const { return shards_.size(); }
+    // For per shard settings (cache, prepared statements, metrics) and
+    // queries that have to run on one shard, e.g. ordered pages.
+    Storage &shard(size_t index) { return *shards_[index]; }
+
+    // Routing is configured once before use, it is not synchronized with
+    // concurrent calls.
+    bool setShardKey(const google::protobuf::Descriptor *descriptor, const std::string &field);
+    // Rows with key < bounds[0] go to shard 0, < bounds[1] to shard 1 and
+    // so on, the rest to the last shard. Needs shardCount() - 1 ascending
+    // bounds and an integer key, keys compare in their own signedness;
+    // bounds outside the range of the key type are refused.
+    bool setShardRanges(const google::protobuf::Descriptor *descriptor, const std::string &field,
+            const std::vector<int64_t> &bounds);
+    bool setShardRanges(const google::protobuf::Descriptor *descriptor, const std::string &field,
+            const std::vector<uint64_t> &bounds);
+
+    // Returns false when the shard key of |message| is not set.
+    bool shardOf(const google::protobuf::Message &message, size_t &shard) const;
+
+    bool load(const google::protobuf::Message &query, std::vector<google::protobuf::Message *> &results);
+    // Keys are grouped per shard, each group is one Storage::loadMany() and
+    // the groups run in parallel.
+    bool loadMany(const std::vector<const google::protobuf::Message *> &keys, Storage::KeyedRows &results,
+            std::vector<size_t> &missing);
+
+    bool save(const google::protobuf::Message &message);
+    bool update(const google::protobuf::Message &message, const google::protobuf::Message &baseline);
+    // Grouped per shard and written in parallel, nothing is written when
+    // a message has no shard key.
+    bool save(const std::vector<const google::protobuf::Message *> &messages);
+
+private:
+    ShardedStorage(const ShardedStorage &);
+    ShardedStorage &operator=(const ShardedStorage &);
+
+    struct Route {
+        Route() : field_descriptor(NULL) {}
+
+        const google::protobuf::FieldDescriptor *field_descriptor;
+        // As TableSchema::ordinalOf() of the key, empty for hash placement.
+        std::vector<uint64_t> bounds;
+    };
+
+    const Route *route(const google::protobuf::Descriptor *descriptor) const;
+    // The integer key of a range route with |bounds| bounds, NULL when
+    // either does not fit.
+    const google::protobuf::FieldDescriptor *rangeKey(const google::protobuf::Descriptor *descriptor,
+            const std::string &field, size_t bounds) const;
+    bool setRanges(const google::protobuf::Descriptor *descriptor,
+            const google::protobuf::FieldDescriptor *field_descriptor, const std::vector<uint64_t> &ordinals);
+    // Runs |call| for each shard index of |shards| in parallel on the
+    // workers and the calling thread, returns when all are done.
+    void forEachShard(const std::vector<size_t> &shards, const std::function<void (size_t)> &call);
+    void runWorker();
+
+    std::vector<Storage *> shards_;
+    std::map<const google::protobuf::Descriptor *, Route> routes_;
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::condition_variable done_;
+    std::deque<std::function<void ()> > tasks_;
+    bool stopping_;
+    std::vector<std::thread> workers_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_SHARDED_STORAGE_H
@@ -0,0 +1,116 @@
+#include "snapshot_tracker.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "table_schema.h"
+
+namespace pmo {
+
+SnapshotTracker::SnapshotTracker() {}
+
+SnapshotTracker::~SnapshotTracker() {
+    clear();
+}
+
+bool SnapshotTracker::rowKey(const ::google::protobuf::Message &message, std::string &key) {
+    std::string row;
+    if (TableSchema::get(message.GetDescriptor())->keyOf(message, row) == false) {
+        return false;
+    }
+
+    key = message.GetTypeName();
+    key.push_back('\0');
+    key.append(row);
+    return true;
+}
+
+bool SnapshotTracker::baseline(const ::google::protobuf::Message &message,
+        ::google::protobuf::Message *baseline) const {
+    std::string key;
+    if (rowKey(message, key) == false) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, ::google::protobuf::Message *>::const_iterator iter = snapshots_.find(key);
+    if (iter == snapshots_.end()) {
+        return false;
+    }
+    baseline->CopyFrom(*iter->second);
+    return true;
+}
+
+void SnapshotTracker::record(const ::google::protobuf::Message &message) {
+    std::string key;
+    if (rowKey(message, key) == false) {
+        return;
+    }
+
+    const TableSchema *schema = TableSchema::get(message.GetDescriptor());
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ::google::protobuf::Message *&snapshot = snapshots_[key];
+    if (snapshot == NULL) {
+        snapshot = message.New();
+    }
+
+    // Blob storage rows are always written whole.
+    if (schema->blobStorage()) {
+        snapshot->CopyFrom(message);
+        return;
+    }
+
+    // Only the columns that were written, absent ones keep their last known
+    // value. Repeated and nested fields are not stored in the table.
+    for (size_t i = 0; i < schema->columns().size(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = schema->columns()[i];
+        if (reflection->HasField(message, field_descriptor)) {
+            TableSchema::copyValue(message, snapshot, field_descriptor);
+        }
+    }
+}
+
+void SnapshotTracker::forget(const ::google::protobuf::Message &message) {
+    std::string key;
+    if (rowKey(message, key) == false) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, ::google::protobuf::Message *>::iterator iter = snapshots_.find(key);
+    if (iter != snapshots_.end()) {
+        delete iter->second;
+        snapshots_.erase(iter);
+    }
+}
+
+void SnapshotTracker::forget(const ::google::protobuf::Descriptor *descriptor) {
+    // Keys of the type share the "type\0" prefix and are adjacent.
+    std::string prefix = descriptor->full_name();
+    prefix.push_back('\0');
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, ::google::protobuf::Message *>::iterator iter = snapshots_.lower_bound(prefix);
+    while (iter != snapshots_.end() && iter->first.compare(0, prefix.size(), prefix) == 0) {
+        delete iter->second;
+        snapshots_.erase(iter++);
+    }
+}
+
+void SnapshotTracker::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::map<std::string, ::google::protobuf::Message *>::iterator iter = snapshots_.begin();
+            iter != snapshots_.end(); ++iter) {
+        delete iter->second;
+    }
+    snapshots_.clear();
+}
+
+size_t SnapshotTracker::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return snapshots_.size();
+}
+
+}  // namespace pmo
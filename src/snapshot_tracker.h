@@ -0,0 +1,56 @@
+#ifndef PMO_SNAPSHOT_TRACKER_H
+#define PMO_SNAPSHOT_TRACKER_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <stddef.h>
+
+namespace google {
+namespace protobuf {
+
+class Descriptor;
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+// Last persisted column values of each row, keyed by type and primary key.
+// Storage records rows it loads or saves here and, when one is known,
+// writes only the columns that differ from it. Snapshots are kept until
+// forgotten, callers drop rows they no longer work on.
+class SnapshotTracker {
+public:
+    SnapshotTracker();
+    ~SnapshotTracker();
+
+    // Copies the snapshot of |message|'s row into |baseline|, returns false
+    // when the row is unknown or the table has no primary key.
+    bool baseline(const google::protobuf::Message &message, google::protobuf::Message *baseline) const;
+
+    // The columns set in |message| are now persisted.
+    void record(const google::protobuf::Message &message);
+    // The persisted row of |message| is unknown again.
+    void forget(const google::protobuf::Message &message);
+    // Forgets every row of the type.
+    void forget(const google::protobuf::Descriptor *descriptor);
+    void clear();
+
+    size_t size() const;
+
+private:
+    SnapshotTracker(const SnapshotTracker &);
+    SnapshotTracker &operator=(const SnapshotTracker &);
+
+    static bool rowKey(const google::protobuf::Message &message, std::string &key);
+
+    mutable std::mutex mutex_;
+    std::map<std::string, google::protobuf::Message *> snapshots_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_SNAPSHOT_TRACKER_H
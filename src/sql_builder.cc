@@ -0,0 +1,314 @@
+#include "sql_builder.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace pmo {
+
+// Buffers grown past this by a large batch are released on reset().
+static const size_t kMaxRetainedCapacity = 1024 * 1024;
+
+static const char kDigitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Writes the digits of |value| backwards ending at |end|, returns the
+// first digit.
+static char *formatUInt64(char *end, uint64_t value) {
+    while (value >= 100) {
+        const char *pair = &kDigitPairs[(value % 100) * 2];
+        value /= 100;
+        *--end = pair[1];
+        *--end = pair[0];
+    }
+    if (value >= 10) {
+        const char *pair = &kDigitPairs[value * 2];
+        *--end = pair[1];
+        *--end = pair[0];
+    } else {
+        *--end = (char)('0' + value);
+    }
+    return end;
+}
+
+static void appendUInt64(std::string &sql, uint64_t value) {
+    char buffer[24];
+    char *end = buffer + sizeof(buffer);
+    char *begin = formatUInt64(end, value);
+    sql.append(begin, end - begin);
+}
+
+static void appendInt64(std::string &sql, int64_t value) {
+    char buffer[24];
+    char *end = buffer + sizeof(buffer);
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    char *begin = formatUInt64(end, magnitude);
+    if (value < 0) {
+        *--begin = '-';
+    }
+    sql.append(begin, end - begin);
+}
+
+static void appendDouble(std::string &sql, double value, const char *format) {
+    // Integral values, the common case for counters kept in doubles, take
+    // the integer path. 2^53 bounds exactly representable integers.
+    if (value >= -9007199254740992.0 && value <= 9007199254740992.0 && value == (double)(int64_t)value &&
+            (value != 0 || 1 / value > 0)) {
+        appendInt64(sql, (int64_t)value);
+        return;
+    }
+
+    char buffer[32];
+    int length = snprintf(buffer, sizeof(buffer), format, value);
+    sql.append(buffer, length);
+}
+
+// Escape sequence letter of each byte mysql_real_escape_string() escapes,
+// 0 for bytes copied as they are.
+static char escapeLetter(unsigned char c) {
+    switch (c) {
+        case 0:
+            return '0';
+        case '\n':
+            return 'n';
+        case '\r':
+            return 'r';
+        case '\\':
+            return '\\';
+        case '\'':
+            return '\'';
+        case '"':
+            return '"';
+        case '\032':
+            return 'Z';
+        default:
+            return 0;
+    }
+}
+
+// Length of the prefix of |data| without bytes that need escaping.
+static size_t cleanPrefix(const char *data, size_t size) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i nul = _mm_setzero_si128();
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i carriage = _mm_set1_epi8('\r');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i quote = _mm_set1_epi8('\'');
+    const __m128i double_quote = _mm_set1_epi8('"');
+    const __m128i eof = _mm_set1_epi8('\032');
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, nul), _mm_cmpeq_epi8(chunk, newline)),
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, carriage), _mm_cmpeq_epi8(chunk, backslash))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, double_quote)),
+                _mm_cmpeq_epi8(chunk, eof)));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        if (escapeLetter((unsigned char)data[i]) != 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+static void appendEscaped(std::string &sql, MYSQL *mysql, SqlBuilder::Escaping escaping,
+        const char *data, size_t size) {
+    if (escaping == SqlBuilder::ESCAPE_CONNECTION) {
+        size_t offset = sql.size();
+        sql.resize(offset + size * 2 + 2);
+        sql[offset] = '\'';
+        unsigned long length = ::mysql_real_escape_string(mysql, &sql[offset + 1], data, size);
+        sql[offset + 1 + length] = '\'';
+        sql.resize(offset + length + 2);
+        return;
+    }
+
+    sql.reserve(sql.size() + size + size / 8 + 2);
+    sql.push_back('\'');
+
+    if (escaping == SqlBuilder::ESCAPE_QUOTES) {
+        const char *end = data + size;
+        while (data < end) {
+            const char *quote = (const char *)memchr(data, '\'', end - data);
+            if (quote == NULL) {
+                sql.append(data, end - data);
+                break;
+            }
+            sql.append(data, quote - data + 1);
+            sql.push_back('\'');
+            data = quote + 1;
+        }
+    } else {
+        while (size != 0) {
+            size_t clean = cleanPrefix(data, size);
+            sql.append(data, clean);
+            if (clean == size) {
+                break;
+            }
+            sql.push_back('\\');
+            sql.push_back(escapeLetter((unsigned char)data[clean]));
+            data += clean + 1;
+            size -= clean + 1;
+        }
+    }
+
+    sql.push_back('\'');
+}
+
+SqlBuilder::Escaping SqlBuilder::escapingOf(MYSQL *mysql) {
+    if (mysql == NULL) {
+        return ESCAPE_BACKSLASH;
+    }
+
+    const char *charset = ::mysql_character_set_name(mysql);
+    if (charset == NULL || (strcmp(charset, "utf8") != 0 && strcmp(charset, "utf8mb4") != 0 &&
+            strcmp(charset, "utf8mb3") != 0 && strcmp(charset, "latin1") != 0 &&
+            strcmp(charset, "ascii") != 0 && strcmp(charset, "binary") != 0)) {
+        return ESCAPE_CONNECTION;
+    }
+
+    if ((mysql->server_status & SERVER_STATUS_NO_BACKSLASH_ESCAPES) != 0) {
+        return ESCAPE_QUOTES;
+    }
+    return ESCAPE_BACKSLASH;
+}
+
+SqlBuilder::SqlBuilder(MYSQL *mysql) :
+        mysql_(mysql),
+        escaping_(escapingOf(mysql)) {}
+
+void SqlBuilder::reset(MYSQL *mysql) {
+    if (sql_.capacity() > kMaxRetainedCapacity) {
+        std::string().swap(sql_);
+    } else {
+        sql_.clear();
+    }
+    mysql_ = mysql;
+    escaping_ = escapingOf(mysql);
+}
+
+void SqlBuilder::appendNumber(int32_t value) {
+    appendInt64(sql_, value);
+}
+
+void SqlBuilder::appendNumber(uint32_t value) {
+    appendUInt64(sql_, value);
+}
+
+void SqlBuilder::appendNumber(int64_t value) {
+    appendInt64(sql_, value);
+}
+
+void SqlBuilder::appendNumber(uint64_t value) {
+    appendUInt64(sql_, value);
+}
+
+void SqlBuilder::appendNumber(double value) {
+    appendDouble(sql_, value, "%.17g");
+}
+
+void SqlBuilder::appendNumber(float value) {
+    appendDouble(sql_, value, "%.9g");
+}
+
+void SqlBuilder::appendQuoted(const char *data, size_t size) {
+    appendEscaped(sql_, mysql_, escaping_, data, size);
+}
+
+bool SqlBuilder::appendValue(const ::google::protobuf::Message &message,
+        const ::google::protobuf::FieldDescriptor *field_descriptor) {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            appendNumber((int32_t)reflection->GetInt32(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            appendNumber((uint32_t)reflection->GetUInt32(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            appendNumber((int64_t)reflection->GetInt64(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            appendNumber((uint64_t)reflection->GetUInt64(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+            appendNumber(reflection->GetDouble(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+            appendNumber(reflection->GetFloat(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+            appendBool(reflection->GetBool(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+            appendNumber((int32_t)reflection->GetEnum(message, field_descriptor)->number());
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+            std::string scratch;
+            const std::string &value = reflection->GetStringReference(message, field_descriptor, &scratch);
+            appendQuoted(value.data(), value.size());
+            break;
+        }
+        default:
+            printf("Not support name(%s).\n", field_descriptor->name().c_str());
+            return false;
+    }
+
+    return true;
+}
+
+void appendNumber(std::string &sql, int32_t value) {
+    appendInt64(sql, value);
+}
+
+void appendNumber(std::string &sql, uint32_t value) {
+    appendUInt64(sql, value);
+}
+
+void appendNumber(std::string &sql, int64_t value) {
+    appendInt64(sql, value);
+}
+
+void appendNumber(std::string &sql, uint64_t value) {
+    appendUInt64(sql, value);
+}
+
+void appendNumber(std::string &sql, double value) {
+    appendDouble(sql, value, "%.17g");
+}
+
+void appendNumber(std::string &sql, float value) {
+    appendDouble(sql, value, "%.9g");
+}
+
+void appendBool(std::string &sql, bool value) {
+    sql.push_back(value ? '1' : '0');
+}
+
+void appendQuoted(std::string &sql, MYSQL *mysql, const std::string &value) {
+    appendEscaped(sql, mysql, SqlBuilder::escapingOf(mysql), value.data(), value.size());
+}
+
+}  // namespace pmo
@@ -0,0 +1,96 @@
+#ifndef PMO_SQL_BUILDER_H
+#define PMO_SQL_BUILDER_H
+
+#include <string>
+
+#include <mysql.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class FieldDescriptor;
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+// Reusable statement buffer. Numbers are formatted without stdio and
+// string literals are escaped locally, a SIMD scan copies runs without
+// special characters in bulk. Only charsets where a multi-byte character
+// may contain a quote or backslash byte (gbk, big5, sjis, ...) go through
+// mysql_real_escape_string().
+class SqlBuilder {
+public:
+    enum Escaping {
+        // Backslash escapes, as mysql_real_escape_string() for ASCII
+        // compatible charsets: utf8, utf8mb4, latin1, ascii, binary.
+        ESCAPE_BACKSLASH,
+        // sql_mode NO_BACKSLASH_ESCAPES: single quotes are doubled.
+        ESCAPE_QUOTES,
+        ESCAPE_CONNECTION
+    };
+
+    // Reads the charset and sql_mode the client library tracks for |mysql|,
+    // no round trip. NULL is taken as utf8 with backslash escapes.
+    static Escaping escapingOf(MYSQL *mysql);
+
+    explicit SqlBuilder(MYSQL *mysql = NULL);
+
+    // Empties the buffer for a statement on |mysql|, the capacity is kept
+    // unless it grew beyond a large batch.
+    void reset(MYSQL *mysql);
+
+    MYSQL *mysql() const { return mysql_; }
+    Escaping escaping() const { return escaping_; }
+
+    const std::string &str() const { return sql_; }
+    // For code that builds into a std::string, e.g. generated ORM classes.
+    std::string &buffer() { return sql_; }
+    size_t size() const { return sql_.size(); }
+    void resize(size_t size) { sql_.resize(size); }
+
+    SqlBuilder &append(const char *data, size_t size) { sql_.append(data, size); return *this; }
+    SqlBuilder &append(const std::string &str) { sql_.append(str); return *this; }
+    SqlBuilder &append(const char *str) { sql_.append(str); return *this; }
+    SqlBuilder &append(char c) { sql_.push_back(c); return *this; }
+
+    void appendNumber(int32_t value);
+    void appendNumber(uint32_t value);
+    void appendNumber(int64_t value);
+    void appendNumber(uint64_t value);
+    void appendNumber(double value);
+    void appendNumber(float value);
+    void appendBool(bool value) { sql_.push_back(value ? '1' : '0'); }
+    // Appends 'value' quoted and escaped.
+    void appendQuoted(const char *data, size_t size);
+    void appendQuoted(const std::string &value) { appendQuoted(value.data(), value.size()); }
+
+    // The literal of a column field of |message|, false for types that
+    // have no column.
+    bool appendValue(const google::protobuf::Message &message,
+            const google::protobuf::FieldDescriptor *field_descriptor);
+
+private:
+    std::string sql_;
+    MYSQL *mysql_;
+    Escaping escaping_;
+};
+
+// Helpers used by generated code, same formatting as SqlBuilder.
+void appendNumber(std::string &sql, int32_t value);
+void appendNumber(std::string &sql, uint32_t value);
+void appendNumber(std::string &sql, int64_t value);
+void appendNumber(std::string &sql, uint64_t value);
+void appendNumber(std::string &sql, double value);
+void appendNumber(std::string &sql, float value);
+void appendBool(std::string &sql, bool value);
+// Appends 'value' quoted and escaped for the connection charset.
+void appendQuoted(std::string &sql, MYSQL *mysql, const std::string &value);
+
+}   // namespace pmo
+
+#endif  // PMO_SQL_BUILDER_H
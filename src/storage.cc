@@ -1,12 +1,23 @@
 #include "storage.h"
 
-#include <iostream>
+#include <algorithm>
 #include <memory>
+#include <set>
 #include <sstream>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <google/protobuf/message.h>
 
+#include "load_cache.h"
+#include "message_orm.h"
+#include "prepared_statement.h"
+#include "query.h"
+#include "row_decoder.h"
+#include "snapshot_tracker.h"
+#include "table_schema.h"
+#include "transaction.h"
+
 namespace pmo {
 
 static ::google::protobuf::Message *createMessage(const std::string &type) {
@@ -25,83 +36,61 @@ static ::google::protobuf::Message *createMessage(const std::string &type) {
     return prototype->New();
 }
 
-static void reflectionFill(google::protobuf::Message &message, const google::protobuf::FieldDescriptor *descriptor,
-        const google::protobuf::Reflection *reflection, const std::map<std::string, std::string> &values) {
-    if(descriptor == NULL) {
-        return;
-    }
-
-    if(descriptor->label() == google::protobuf::FieldDescriptor::LABEL_REPEATED) {
+// Takes ownership of |row|.
+static void addKeyedRow(const TableSchema *schema, ::google::protobuf::Message *row,
+        Storage::KeyedRows &results) {
+    std::string key;
+    if (schema->keyOf(*row, key) == false) {
+        delete row;
         return;
     }
-
-    switch (descriptor->type()) {
-        case google::protobuf::FieldDescriptor::TYPE_FIXED64:
-        case google::protobuf::FieldDescriptor::TYPE_INT64:
-            reflection->SetInt64(&message, descriptor, (int64_t)atol(values.at(descriptor->name()).c_str()));
-            break;
-        case google::protobuf::FieldDescriptor::TYPE_UINT64:
-            reflection->SetUInt64(&message, descriptor, (uint64_t)atol(values.at(descriptor->name()).c_str()));
-            break;
-        case google::protobuf::FieldDescriptor::TYPE_FIXED32:
-        case google::protobuf::FieldDescriptor::TYPE_INT32:
-            reflection->SetInt32(&message, descriptor, (int32_t)atoi(values.at(descriptor->name()).c_str()));
-            break;
-        case google::protobuf::FieldDescriptor::TYPE_UINT32:
-            reflection->SetUInt32(&message, descriptor, (uint32_t)atoi(values.at(descriptor->name()).c_str()));
-            break;
-        case google::protobuf::FieldDescriptor::TYPE_STRING:
-        case google::protobuf::FieldDescriptor::TYPE_BYTES:
-            reflection->SetString(&message, descriptor, values.at(descriptor->name()));
-            break;
-        case google::protobuf::FieldDescriptor::TYPE_DOUBLE:
-            reflection->SetDouble(&message, descriptor, atof(values.at(descriptor->name()).c_str()));
-            break;
-        case google::protobuf::FieldDescriptor::TYPE_FLOAT:
-            reflection->SetFloat(&message, descriptor, atof(values.at(descriptor->name()).c_str()));
-            break;
-        case google::protobuf::FieldDescriptor::TYPE_BOOL:
-            if (values.at(descriptor->name()) == "true") {
-                reflection->SetBool(&message, descriptor, true);
-            } else {
-                reflection->SetBool(&message, descriptor, false);
-            }
-            break;
-        default:
-            printf("no support type = %d.\n", descriptor->type());
-            break;
-
-    }
+    ::google::protobuf::Message *&slot = results[key];
+    delete slot;
+    slot = row;
 }
 
 Storage::Storage(const std::string &host, const std::string &database,
                  const std::string &user, const std::string &passwd,
                  uint32_t port) :
-        mysql_(NULL),
-        host_(host),
-        database_(database),
-        port_(port),
-        user_(user),
-        passwd_(passwd) {}
+        pool_(poolOptions(host, database, user, passwd, port)),
+        max_statement_size_(0),
+        prepared_statements_(false),
+        stored_procedures_(false),
+        cache_(NULL),
+        tracker_(NULL) {}
 
-Storage::~Storage() {
-    if (mysql_ != NULL) {
-        mysql_close(mysql_);
-        mysql_ = NULL;
-    }
+Storage::Storage(const ConnectionPoolOptions &options) :
+        pool_(options),
+        max_statement_size_(0),
+        prepared_statements_(false),
+        stored_procedures_(false),
+        cache_(NULL),
+        tracker_(NULL) {}
+
+Storage::~Storage() {}
+
+ConnectionPoolOptions Storage::poolOptions(const std::string &host, const std::string &database,
+        const std::string &user, const std::string &passwd, uint32_t port) {
+    ConnectionPoolOptions options;
+    options.host = host;
+    options.database = database;
+    options.user = user;
+    options.passwd = passwd;
+    options.port = port;
+    return options;
 }
 
-void Storage::load(const std::string &type, const std::string &query, std::vector<std::string> &results) {
+bool Storage::load(const std::string &type, const std::string &query, std::vector<std::string> &results) {
     ::google::protobuf::Message *message = createMessage(type);
     if(message == NULL) {
         printf("createMessage(%s) failed.\n", type.c_str());
-        return;
+        return false;
     }
 
     message->ParseFromString(query);
 
     std::vector< ::google::protobuf::Message *> message_results;
-    load(*message, message_results);
+    bool ret = load(*message, message_results);
 
     for (size_t i = 0; i < message_results.size(); ++i) {
         results.push_back(message_results[i]->SerializeAsString());
@@ -109,230 +98,1477 @@ void Storage::load(const std::string &type, const std::string &query, std::vecto
     }
 
     delete message;
+    return ret;
 }
 
-void Storage::load(const ::google::protobuf::Message &query, std::vector< ::google::protobuf::Message *> &results) {
-    connect();
+bool Storage::load(const ::google::protobuf::Message &query, std::vector< ::google::protobuf::Message *> &results) {
+    size_t first = results.size();
+    bool transaction = inTransaction();
+    LoadCache *cache = transaction ? NULL : cache_;
 
-    const ::google::protobuf::Reflection *reflection = query.GetReflection();
-    const ::google::protobuf::Descriptor *descriptor = query.GetDescriptor();
+    if (cache == NULL || cache->get(query, results) == false) {
+        uint64_t generation = cache != NULL ? cache->generation(query.GetDescriptor()) : 0;
+        Metrics::Sample sample(metrics_, query.GetDescriptor(), Metrics::LOAD);
+        if (loadRows(Query(query), results, sample) == false) {
+            sample.setFailed(true);
+            return false;
+        }
+        if (cache != NULL) {
+            cache->put(query, std::vector< ::google::protobuf::Message *>(results.begin() + first, results.end()),
+                generation);
+        }
+    }
 
-    bool first_field = true;
-    std::ostringstream oss;
-    oss << "SELECT * FROM `" << query.GetTypeName() << "` WHERE";
+    if (tracker_ != NULL && transaction == false) {
+        for (size_t i = first; i < results.size(); ++i) {
+            tracker_->record(*results[i]);
+        }
+    }
+    return true;
+}
 
-    for (size_t i = 0; i < descriptor->field_count(); ++i) {
-        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->field(i);
-        if (reflection->HasField(query, field_descriptor) == false) {
-            continue;
+bool Storage::load(const ::google::protobuf::Message &query, const FieldList &fields,
+        std::vector< ::google::protobuf::Message *> &results) {
+    return load(Query(query).select(fields), results);
+}
+
+bool Storage::load(const Query &query, std::vector< ::google::protobuf::Message *> &results) {
+    size_t first = results.size();
+    const ::google::protobuf::Descriptor *descriptor = query.filter().GetDescriptor();
+
+    Metrics::Sample sample(metrics_, descriptor, Metrics::LOAD);
+    if (loadRows(query, results, sample) == false) {
+        sample.setFailed(true);
+        return false;
+    }
+
+    // Blob storage snapshots are whole messages, partial rows would
+    // replace them.
+    if (tracker_ != NULL && inTransaction() == false &&
+            (query.fields() == NULL || TableSchema::get(descriptor)->blobStorage() == false)) {
+        for (size_t i = first; i < results.size(); ++i) {
+            tracker_->record(*results[i]);
         }
+    }
+    return true;
+}
 
-        if (first_field == false) {
-            oss << " AND ";
-        } else {
-            first_field = false;
-        }
-
-        switch(field_descriptor->type()) {
-            case ::google::protobuf::FieldDescriptor::TYPE_FIXED64:
-            case ::google::protobuf::FieldDescriptor::TYPE_INT64:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetInt64(query, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_UINT64:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetUInt64(query, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_FIXED32:
-            case ::google::protobuf::FieldDescriptor::TYPE_INT32:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetInt32(query, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_UINT32:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetUInt32(query, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_STRING:
-                oss << " `" << field_descriptor->name() << "`=\"" <<
-                    mysqlEscape(reflection->GetString(query, field_descriptor)) << "\"";
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_DOUBLE:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetDouble(query, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_FLOAT:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetFloat(query, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_BOOL:
-                oss << " `" << field_descriptor->name() << "`=" <<
-                    reflection->GetBool(query, field_descriptor) ? "true" : "false";
-                break;
-            default:
-                printf("Not support name(%s).\n", field_descriptor->name().c_str());
-                return;
-        }
-    }
-
-    execute(oss.str());
-    ::MYSQL_RES *res = ::mysql_store_result(mysql_);
+bool Storage::loadRows(const Query &query, std::vector< ::google::protobuf::Message *> &results,
+        Metrics::Sample &sample) {
+    ConnectionPool::Handle handle = checkout();
+    if (!handle) {
+        printf("ConnectionPool checkout failed.\n");
+        return false;
+    }
+
+    const ::google::protobuf::Message &filter = query.filter();
+    const TableSchema *schema = TableSchema::get(filter.GetDescriptor());
+    // Blob storage rows are always read as the blob column over the text
+    // protocol, the cell is the raw serialized message.
+    bool blob = schema->blobStorage();
+    bool plain = query.isPlain();
+
+    if (prepared_statements_ && blob == false && plain) {
+        return loadPrepared(handle, filter, query.fields(), results, sample);
+    }
+
+    // Generated code selects and decodes every column for equality only.
+    const MessageOrm *orm = blob || query.fields() != NULL || plain == false ?
+        NULL : OrmRegistry::instance().find(filter.GetTypeName());
+
+    // Lookups by exactly the primary key can go through the generated
+    // pmo_load_* procedure, it returns the same columns as buildSelect().
+    bool call = stored_procedures_ && blob == false && plain && query.fields() == NULL &&
+        schema->isKeyQuery(filter);
+
+    SqlBuilder &sql = handle.connection()->sql();
+    sql.reset(handle.get());
+    if (call) {
+        if (buildLoadCall(sql, filter) == false) {
+            return false;
+        }
+    } else if (buildSelect(sql, orm, query) == false) {
+        return false;
+    }
+
+    if (execute(handle, sql.str(), sample) == false) {
+        return false;
+    }
+
+    if (storeRows(handle, filter, orm, results, sample) == false) {
+        return false;
+    }
+    if (call) {
+        drainResults(handle);
+    }
+    return true;
+}
+
+bool Storage::storeRows(ConnectionPool::Handle &handle, const ::google::protobuf::Message &prototype,
+        const MessageOrm *orm, std::vector< ::google::protobuf::Message *> &results, Metrics::Sample &sample) {
+    ::MYSQL_RES *res = ::mysql_store_result(handle.get());
     if (res == NULL) {
         printf("mysql_store_result failed.\n");
-        return;
+        return false;
     }
+    sample.mark(Metrics::ROUND_TRIP);
 
-    ::MYSQL_FIELD *fields = ::mysql_fetch_fields(res);
-    uint32_t field_num = ::mysql_num_fields(res);
+    bool ret = decodeRows(res, prototype, orm, results, sample);
+    ::mysql_free_result(res);
+    return ret;
+}
+
+bool Storage::decodeRows(::MYSQL_RES *res, const ::google::protobuf::Message &prototype,
+        const MessageOrm *orm, std::vector< ::google::protobuf::Message *> &results, Metrics::Sample &sample) {
+    const RowDecoder *decoder = NULL;
+    if (orm == NULL) {
+        decoder = RowDecoder::get(prototype.GetDescriptor(), ::mysql_fetch_fields(res), ::mysql_num_fields(res));
+    }
 
+    size_t first = results.size();
+    unsigned int field_count = ::mysql_num_fields(res);
+    size_t bytes = 0;
     ::MYSQL_ROW row;
-    while (row = ::mysql_fetch_row(res)) {
-        std::map<std::string, std::string> values;
-        for (int i = 0; i < field_num; ++i) {
-            values[fields[i].name] = row[i];
+    while ((row = ::mysql_fetch_row(res)) != NULL) {
+        const unsigned long *lengths = ::mysql_fetch_lengths(res);
+        ::google::protobuf::Message *message = prototype.New();
+        results.push_back(message);
+        if (orm != NULL) {
+            orm->decodeRow(row, lengths, message);
+        } else if (decoder->decode(row, lengths, message) == false) {
+            for (size_t i = first; i < results.size(); ++i) {
+                delete results[i];
+            }
+            results.resize(first);
+            return false;
         }
+        for (unsigned int i = 0; i < field_count; ++i) {
+            bytes += lengths[i];
+        }
+    }
+    sample.addRowsIn(::mysql_num_rows(res));
+    sample.addBytesIn(bytes);
+    sample.mark(Metrics::DECODE);
+    return true;
+}
 
-        ::google::protobuf::Message *message = createMessage(query.GetTypeName());
-        if (message == NULL) {
-            printf("createMessage(%s) failed.\n", query.GetTypeName().c_str());
-            return;
+bool Storage::loadMany(const std::string &type, const std::vector<std::string> &keys,
+        std::vector<std::string> &results, std::vector<size_t> &missing) {
+    ::google::protobuf::Message *prototype = createMessage(type);
+    if (prototype == NULL) {
+        printf("createMessage(%s) failed.\n", type.c_str());
+        return false;
+    }
+
+    std::vector< ::google::protobuf::Message *> messages;
+    std::vector<const ::google::protobuf::Message *> key_messages;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        messages.push_back(prototype->New());
+        messages.back()->ParseFromString(keys[i]);
+        key_messages.push_back(messages.back());
+    }
+
+    KeyedRows rows;
+    bool ret = loadMany(key_messages, rows, missing);
+
+    results.clear();
+    results.resize(keys.size());
+    const TableSchema *schema = TableSchema::get(prototype->GetDescriptor());
+    std::string key;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        if (schema->keyOf(*messages[i], key)) {
+            KeyedRows::const_iterator iter = rows.find(key);
+            if (iter != rows.end()) {
+                iter->second->SerializeToString(&results[i]);
+            }
+        }
+        delete messages[i];
+    }
+    for (KeyedRows::iterator iter = rows.begin(); iter != rows.end(); ++iter) {
+        delete iter->second;
+    }
+
+    delete prototype;
+    return ret;
+}
+
+bool Storage::loadMany(const std::vector<const ::google::protobuf::Message *> &keys, KeyedRows &results,
+        std::vector<size_t> &missing) {
+    if (keys.empty()) {
+        return true;
+    }
+
+    const ::google::protobuf::Descriptor *descriptor = keys[0]->GetDescriptor();
+    const TableSchema *schema = TableSchema::get(descriptor);
+    if (schema->hasPrimaryKey() == false) {
+        printf("loadMany: %s has no primary key.\n", descriptor->full_name().c_str());
+        return false;
+    }
+
+    bool transaction = inTransaction();
+    LoadCache *cache = transaction ? NULL : cache_;
+
+    // Distinct keys that were not served by the cache.
+    std::vector<size_t> pending;
+    std::set<std::string> requested;
+    std::string key;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (keys[i]->GetDescriptor() != descriptor || schema->keyOf(*keys[i], key) == false) {
+            printf("loadMany: key %zu is not a complete %s primary key.\n", i, descriptor->full_name().c_str());
+            return false;
         }
-        const google::protobuf::Reflection *reflection = message->GetReflection();
-        const google::protobuf::Descriptor *descriptor = message->GetDescriptor();
-        for(size_t i = 0; i < descriptor->field_count(); ++i) {
-            reflectionFill(*message, descriptor->field(i), reflection, values);
+        if (requested.insert(key).second == false) {
+            continue;
         }
 
-        results.push_back(message);
+        if (cache != NULL) {
+            std::unique_ptr< ::google::protobuf::Message> query(schema->newKeyMessage(*keys[i]));
+            std::vector< ::google::protobuf::Message *> cached;
+            if (cache->get(*query, cached)) {
+                for (size_t j = 0; j < cached.size(); ++j) {
+                    addKeyedRow(schema, cached[j], results);
+                }
+                continue;
+            }
+        }
+        pending.push_back(i);
+    }
+
+    uint64_t generation = cache != NULL ? cache->generation(descriptor) : 0;
+    bool ret = pending.empty() || loadKeys(keys, pending, results);
+
+    if (ret && cache != NULL) {
+        for (size_t i = 0; i < pending.size(); ++i) {
+            std::unique_ptr< ::google::protobuf::Message> query(schema->newKeyMessage(*keys[pending[i]]));
+            std::vector< ::google::protobuf::Message *> rows;
+            schema->keyOf(*keys[pending[i]], key);
+            KeyedRows::const_iterator iter = results.find(key);
+            if (iter != results.end()) {
+                rows.push_back(iter->second);
+            }
+            cache->put(*query, rows, generation);
+        }
+    }
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        schema->keyOf(*keys[i], key);
+        if (results.find(key) == results.end()) {
+            missing.push_back(i);
+        }
+    }
+
+    if (tracker_ != NULL && transaction == false) {
+        for (KeyedRows::const_iterator iter = results.begin(); iter != results.end(); ++iter) {
+            tracker_->record(*iter->second);
+        }
+    }
+    return ret;
+}
+
+bool Storage::loadKeys(const std::vector<const ::google::protobuf::Message *> &keys,
+        const std::vector<size_t> &pending, KeyedRows &results) {
+    const ::google::protobuf::Message &prototype = *keys[pending[0]];
+    const TableSchema *schema = TableSchema::get(prototype.GetDescriptor());
+    const MessageOrm *orm = schema->blobStorage() ? NULL : OrmRegistry::instance().find(prototype.GetTypeName());
+
+    Metrics::Sample sample(metrics_, prototype.GetDescriptor(), Metrics::LOAD_MANY);
+    sample.setFailed(true);
+
+    ConnectionPool::Handle handle = checkout();
+    if (!handle) {
+        printf("ConnectionPool checkout failed.\n");
+        return false;
+    }
+
+    size_t max_statement_size = maxStatementSize(handle.get());
+    SqlBuilder &sql = handle.connection()->sql();
+    std::vector< ::google::protobuf::Message *> rows;
+
+    size_t begin = 0;
+    while (begin < pending.size()) {
+        sql.reset(handle.get());
+        size_t end = begin;
+        if (buildKeySelect(sql, keys, pending, begin, max_statement_size, end) == false) {
+            return false;
+        }
+
+        if (execute(handle, sql.str(), sample) == false ||
+                storeRows(handle, prototype, orm, rows, sample) == false) {
+            return false;
+        }
+        for (size_t i = 0; i < rows.size(); ++i) {
+            addKeyedRow(schema, rows[i], results);
+        }
+        rows.clear();
+
+        begin = end;
+    }
+
+    sample.setFailed(false);
+    return true;
+}
+
+bool Storage::buildKeySelect(SqlBuilder &sql, const std::vector<const ::google::protobuf::Message *> &keys,
+        const std::vector<size_t> &pending, size_t begin, size_t max_statement_size, size_t &end) {
+    const TableSchema *schema = TableSchema::get(keys[pending[begin]]->GetDescriptor());
+    const TableSchema::FieldList &primary_key = schema->primaryKey();
+    bool composite = primary_key.size() > 1;
+
+    // SELECT * FROM `table` WHERE `id` IN (1,2,...);
+    // SELECT * FROM `table` WHERE (`a`,`b`) IN ((1,'x'),(2,'y'),...);
+    if (schema->blobStorage()) {
+        sql.append("SELECT `").append(TableSchema::blobColumn()).append("` FROM ").append(schema->quotedTable());
+    } else {
+        sql.append("SELECT * FROM ").append(schema->quotedTable());
+    }
+    sql.append(composite ? " WHERE (" : " WHERE ");
+    for (size_t i = 0; i < primary_key.size(); ++i) {
+        if (i != 0) {
+            sql.append(',');
+        }
+        sql.append(schema->quotedName(primary_key[i]));
+    }
+    sql.append(composite ? ") IN (" : " IN (");
+
+    end = begin;
+    while (end < pending.size() && end - begin < kLoadManyChunkSize) {
+        const ::google::protobuf::Message &key = *keys[pending[end]];
+        size_t key_begin = sql.size();
+        if (end != begin) {
+            sql.append(',');
+        }
+        if (composite) {
+            sql.append('(');
+        }
+        for (size_t i = 0; i < primary_key.size(); ++i) {
+            if (i != 0) {
+                sql.append(',');
+            }
+            if (sql.appendValue(key, primary_key[i]) == false) {
+                return false;
+            }
+        }
+        if (composite) {
+            sql.append(')');
+        }
+        if (end != begin && sql.size() + 1 > max_statement_size) {
+            sql.resize(key_begin);
+            break;
+        }
+        ++end;
+    }
+    sql.append(')');
+    return true;
+}
+
+bool Storage::load(const ::google::protobuf::Message &query, const RowVisitor &visitor) {
+    return stream(Query(query), visitor);
+}
+
+bool Storage::load(const ::google::protobuf::Message &query, const FieldList &fields, const RowVisitor &visitor) {
+    return stream(Query(query).select(fields), visitor);
+}
+
+bool Storage::load(const Query &query, const RowVisitor &visitor) {
+    return stream(query, visitor);
+}
+
+bool Storage::stream(const Query &query, const RowVisitor &visitor) {
+    const ::google::protobuf::Message &filter = query.filter();
+
+    // Failed until the scan completes. Time spent in the visitor is part
+    // of the total but of no phase.
+    Metrics::Sample sample(metrics_, filter.GetDescriptor(), Metrics::STREAM);
+    sample.setFailed(true);
+
+    ConnectionPool::Handle handle = checkout();
+    if (!handle) {
+        printf("ConnectionPool checkout failed.\n");
+        return false;
+    }
+
+    const MessageOrm *orm = TableSchema::get(filter.GetDescriptor())->blobStorage() || query.fields() != NULL ||
+        query.isPlain() == false ? NULL : OrmRegistry::instance().find(filter.GetTypeName());
+
+    SqlBuilder &sql = handle.connection()->sql();
+    sql.reset(handle.get());
+    if (buildSelect(sql, orm, query) == false || execute(handle, sql.str(), sample) == false) {
+        return false;
+    }
+
+    // Rows are pulled from the socket one at a time instead of being
+    // buffered on the client.
+    ::MYSQL_RES *res = ::mysql_use_result(handle.get());
+    if (res == NULL) {
+        printf("mysql_use_result failed.\n");
+        return false;
+    }
+
+    const RowDecoder *decoder = NULL;
+    if (orm == NULL) {
+        decoder = RowDecoder::get(filter.GetDescriptor(), ::mysql_fetch_fields(res), ::mysql_num_fields(res));
+    }
+    std::unique_ptr< ::google::protobuf::Message> message(filter.New());
+
+    unsigned int field_count = ::mysql_num_fields(res);
+    bool stopped = false;
+    bool bad = false;
+    ::MYSQL_ROW row;
+    while ((row = ::mysql_fetch_row(res)) != NULL) {
+        sample.mark(Metrics::ROUND_TRIP);
+        const unsigned long *lengths = ::mysql_fetch_lengths(res);
+        message->Clear();
+        if (orm != NULL) {
+            orm->decodeRow(row, lengths, message.get());
+        } else if (decoder->decode(row, lengths, message.get()) == false) {
+            // The visitor never sees a row that did not decode.
+            stopped = true;
+            bad = true;
+            break;
+        }
+        sample.addRowsIn(1);
+        for (unsigned int i = 0; i < field_count; ++i) {
+            sample.addBytesIn(lengths[i]);
+        }
+        sample.mark(Metrics::DECODE);
+        if (visitor(*message) == false) {
+            stopped = true;
+            break;
+        }
+        sample.skip();
+    }
+
+    bool ret = bad == false;
+    if (stopped) {
+        // mysql_free_result() reads and discards the rest of the result
+        // set. Killing the query first leaves only the rows already in
+        // flight to read. The connection is not reused, in case the kill
+        // arrived after the last row. Inside a transaction the connection
+        // is kept and drained.
+        if (inTransaction() == false && pool_.killQuery(handle.get())) {
+            handle.setBroken();
+        }
+    } else if (::mysql_errno(handle.get()) != 0) {
+        printf("mysql_fetch_row failed: %s.\n", ::mysql_error(handle.get()));
+        handle.setBroken();
+        ret = false;
     }
 
     ::mysql_free_result(res);
-    disconnect();
+    sample.setFailed(ret == false);
+    return ret;
 }
 
-void Storage::save(const std::string &type, const std::string &data) {
+bool Storage::save(const std::string &type, const std::string &data) {
     ::google::protobuf::Message *message = createMessage(type);
     if(message == NULL) {
         printf("createMessage(%s) failed.\n", type.c_str());
-        return;
+        return false;
     }
 
     message->ParseFromString(data);
-    save(*message);
+    bool ret = save(*message);
 
     delete message;
+    return ret;
 }
 
-void Storage::save(const google::protobuf::Message &message) {
-    connect();
+bool Storage::save(const google::protobuf::Message &message) {
+    if (tracker_ != NULL && inTransaction() == false) {
+        std::unique_ptr< ::google::protobuf::Message> baseline(message.New());
+        if (tracker_->baseline(message, baseline.get())) {
+            return update(message, *baseline);
+        }
+    }
 
-    const ::google::protobuf::Reflection *reflection = message.GetReflection();
-    const ::google::protobuf::Descriptor *descriptor = message.GetDescriptor();
+    Metrics::Sample sample(metrics_, message.GetDescriptor(), Metrics::SAVE);
+    bool ret = saveRow(message, sample);
+    sample.setFailed(ret == false);
+    saved(message, ret);
+    return ret;
+}
 
-    bool first_field = true;
-    std::ostringstream oss;
-    // UPDATE `table` SET `field1`="value1", `field2`=value2;
-    oss << "REPLACE INTO `" << message.GetTypeName() << "` SET";
+bool Storage::update(const ::google::protobuf::Message &message, const ::google::protobuf::Message &baseline) {
+    Metrics::Sample sample(metrics_, message.GetDescriptor(), Metrics::UPDATE);
+    const TableSchema *schema = TableSchema::get(message.GetDescriptor());
 
-    for (size_t i = 0; i < descriptor->field_count(); ++i) {
-        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->field(i);
-        if (reflection->HasField(message, field_descriptor) == false) {
-            continue;
+    std::string key;
+    if (schema->keyOf(message, key) == false) {
+        bool ret = saveRow(message, sample);
+        sample.setFailed(ret == false);
+        saved(message, ret);
+        return ret;
+    }
+
+    // The blob is rewritten as a whole whenever anything differs.
+    if (schema->blobStorage()) {
+        if (message.SerializeAsString() == baseline.SerializeAsString()) {
+            return true;
         }
+        bool ret = saveRow(message, sample);
+        sample.setFailed(ret == false);
+        saved(message, ret);
+        return ret;
+    }
 
-        if (first_field == false) {
-            oss << ",";
-        } else {
-            first_field = false;
-        }
-
-        switch(field_descriptor->type()) {
-            case ::google::protobuf::FieldDescriptor::TYPE_FIXED64:
-            case ::google::protobuf::FieldDescriptor::TYPE_INT64:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetInt64(message, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_UINT64:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetUInt64(message, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_FIXED32:
-            case ::google::protobuf::FieldDescriptor::TYPE_INT32:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetInt32(message, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_UINT32:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetUInt32(message, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_STRING:
-                oss << " `" << field_descriptor->name() << "`=\"" <<
-                    mysqlEscape(reflection->GetString(message, field_descriptor)) << "\"";
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_DOUBLE:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetDouble(message, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_FLOAT:
-                oss << " `" << field_descriptor->name() << "`=" << reflection->GetFloat(message, field_descriptor);
-                break;
-            case ::google::protobuf::FieldDescriptor::TYPE_BOOL:
-                oss << " `" << field_descriptor->name() << "`=" <<
-                    reflection->GetBool(message, field_descriptor) ? "true" : "false";
-                break;
-            default:
-                printf("Not support name(%s).\n", field_descriptor->name().c_str());
-                return;
-        }
-    }
-
-    execute(oss.str());
-    disconnect();
-}
-
-std::string Storage::mysqlEscape(const std::string &str) {
-    connect();
-
-    std::string temp_str;
-    temp_str.resize(str.size() * 2 + 1);
-    ::mysql_real_escape_string(mysql_, &temp_str[0], str.data(), str.size());
-    temp_str.resize(strlen(temp_str.c_str()));
-
-    return temp_str;
-}
-
-bool Storage::connect() {
-    if (mysql_ != NULL) {
+    TableSchema::FieldList columns;
+    schema->changedColumns(message, baseline, columns);
+    if (columns.empty()) {
         return true;
     }
 
-    mysql_ = mysql_init(NULL);
-    if (mysql_ == NULL) {
+    bool matched = false;
+    bool ret = updateRow(message, columns, sample, matched);
+    if (ret && matched == false) {
+        // The baseline came from a row that is gone, or never was there.
+        ret = saveRow(message, sample);
+    }
+    sample.setFailed(ret == false);
+    saved(message, ret);
+    return ret;
+}
+
+bool Storage::saveRow(const google::protobuf::Message &message, Metrics::Sample &sample) {
+    sample.addRowsOut(1);
+
+    ConnectionPool::Handle handle = checkout();
+    if (!handle) {
+        printf("ConnectionPool checkout failed.\n");
         return false;
     }
 
-    if (mysql_real_connect(mysql_, host_.c_str(), user_.c_str(),
-            passwd_.c_str(), database_.c_str(), port_, NULL, 0) == NULL) {
-        mysql_ = NULL;
-        std::cout << host_ << user_ << passwd_ << database_ << port_ << std::endl;
+    if (TableSchema::get(message.GetDescriptor())->blobStorage()) {
+        return saveBlob(handle, message, sample);
+    }
+
+    if (prepared_statements_) {
+        return savePrepared(handle, message, sample);
+    }
+
+    SqlBuilder &sql = handle.connection()->sql();
+    sql.reset(handle.get());
+
+    if (stored_procedures_) {
+        if (buildSaveCall(sql, message) == false || execute(handle, sql.str(), sample) == false) {
+            return false;
+        }
+        drainResults(handle);
+        return true;
+    }
+
+    if (buildSave(sql, message) == false) {
         return false;
     }
+    return execute(handle, sql.str(), sample);
+}
+
+bool Storage::buildSave(SqlBuilder &sql, const ::google::protobuf::Message &message) {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    const TableSchema *schema = TableSchema::get(message.GetDescriptor());
+    const TableSchema::FieldList &all_columns = schema->columns();
+
+    if (schema->blobStorage()) {
+        // The text form of saveBlob():
+        // INSERT INTO `table` SET `key1`=value1, `_pmo_data`='...' ON DUPLICATE KEY UPDATE ...;
+        sql.append(schema->hasPrimaryKey() ? "INSERT INTO " : "REPLACE INTO ").append(schema->quotedTable()).append(" SET");
+        TableSchema::FieldList columns(all_columns);
+        for (size_t i = 0; i < columns.size(); ++i) {
+            sql.append(i == 0 ? " " : ", ").append(schema->quotedName(columns[i])).append('=');
+            if (sql.appendValue(message, columns[i]) == false) {
+                return false;
+            }
+        }
+        sql.append(columns.empty() ? " `" : ", `").append(TableSchema::blobColumn()).append("`=");
+        sql.appendQuoted(message.SerializeAsString());
+        columns.push_back(NULL);
+        if (schema->hasPrimaryKey()) {
+            schema->appendUpsertClause(sql.buffer(), columns);
+        }
+        return true;
+    }
+
+    const MessageOrm *orm = OrmRegistry::instance().find(message.GetTypeName());
+    if (orm != NULL) {
+        if (orm->buildSave(message, sql.mysql(), sql.buffer()) == false) {
+            printf("Nothing to save for %s.\n", message.GetTypeName().c_str());
+            return false;
+        }
+        return true;
+    }
+
+    TableSchema::FieldList columns;
+    // Tables with a primary key are upserted so only the given columns are
+    // touched, otherwise the whole row is replaced:
+    // INSERT INTO `table` SET `field1`='value1', `field2`=value2 ON DUPLICATE KEY UPDATE ...;
+    // REPLACE INTO `table` SET `field1`='value1', `field2`=value2;
+    sql.append(schema->hasPrimaryKey() ? "INSERT INTO " : "REPLACE INTO ").append(schema->quotedTable()).append(" SET");
+
+    for (size_t i = 0; i < all_columns.size(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = all_columns[i];
+        if (reflection->HasField(message, field_descriptor) == false) {
+            continue;
+        }
+
+        sql.append(columns.empty() ? " " : ", ").append(schema->quotedName(field_descriptor)).append('=');
+        columns.push_back(field_descriptor);
+        if (sql.appendValue(message, field_descriptor) == false) {
+            return false;
+        }
+    }
 
+    if (schema->hasPrimaryKey()) {
+        schema->appendUpsertClause(sql.buffer(), columns);
+    }
     return true;
 }
 
-void Storage::disconnect() {
-    if (mysql_ == NULL) {
-        return;
+bool Storage::save(const std::string &type, const std::vector<std::string> &datas) {
+    std::vector< ::google::protobuf::Message *> messages;
+    std::vector<const ::google::protobuf::Message *> const_messages;
+    bool ret = true;
+
+    for (size_t i = 0; i < datas.size(); ++i) {
+        ::google::protobuf::Message *message = createMessage(type);
+        if (message == NULL) {
+            printf("createMessage(%s) failed.\n", type.c_str());
+            ret = false;
+            break;
+        }
+        message->ParseFromString(datas[i]);
+        messages.push_back(message);
+        const_messages.push_back(message);
+    }
+
+    if (ret) {
+        ret = save(const_messages);
     }
 
-    ::mysql_close(mysql_);
-    mysql_ = NULL;
-    mysql_ = NULL;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        delete messages[i];
+    }
+    return ret;
 }
 
-bool Storage::execute(const std::string &sql) {
-    if (connect() == false || mysql_ == NULL) {
-        std::cout << "mysql connect failed." << std::endl;
-        return false;
+bool Storage::save(const std::vector<const ::google::protobuf::Message *> &messages) {
+    if (tracker_ == NULL || inTransaction()) {
+        bool ret = saveRows(messages);
+        for (size_t i = 0; i < messages.size(); ++i) {
+            saved(*messages[i], ret);
+        }
+        return ret;
     }
 
-    int ret = ::mysql_real_query(mysql_, sql.c_str(), sql.length());
-    if (ret != 0) {
-        std::cout << "mysql query error: " << ::mysql_error(mysql_) << ", sql: " << sql << std::endl;
-        disconnect();
-        return false;
+    // Rows with a snapshot are reduced to their key and changed columns,
+    // unchanged rows are dropped. Rows with the same changes still share a
+    // statement.
+    std::vector<const ::google::protobuf::Message *> writes;
+    std::vector<std::unique_ptr< ::google::protobuf::Message> > trimmed;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        const ::google::protobuf::Message &message = *messages[i];
+        std::unique_ptr< ::google::protobuf::Message> baseline(message.New());
+        if (tracker_->baseline(message, baseline.get()) == false) {
+            writes.push_back(&message);
+            continue;
+        }
+
+        const TableSchema *schema = TableSchema::get(message.GetDescriptor());
+        if (schema->blobStorage()) {
+            if (message.SerializeAsString() != baseline->SerializeAsString()) {
+                writes.push_back(&message);
+            }
+            continue;
+        }
+
+        TableSchema::FieldList columns;
+        schema->changedColumns(message, *baseline, columns);
+        if (columns.empty()) {
+            continue;
+        }
+
+        const ::google::protobuf::Descriptor *descriptor = message.GetDescriptor();
+        const ::google::protobuf::Reflection *reflection = message.GetReflection();
+        baseline->CopyFrom(message);
+        for (int j = 0; j < descriptor->field_count(); ++j) {
+            const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->field(j);
+            if (schema->isPrimaryKey(field_descriptor) == false &&
+                    std::find(columns.begin(), columns.end(), field_descriptor) == columns.end()) {
+                reflection->ClearField(baseline.get(), field_descriptor);
+            }
+        }
+        writes.push_back(baseline.get());
+        trimmed.push_back(std::move(baseline));
     }
 
-    std::cout << sql << std::endl;
+    bool ret = saveRows(writes);
+    for (size_t i = 0; i < messages.size(); ++i) {
+        saved(*messages[i], ret);
+    }
+    return ret;
+}
+
+bool Storage::saveRows(const std::vector<const ::google::protobuf::Message *> &messages) {
+    if (messages.empty()) {
+        return true;
+    }
+
+    // Rows can only share a VALUES list when they have the same table and
+    // the same set of present fields. Groups keep first-appearance order.
+    typedef std::pair<const ::google::protobuf::Descriptor *, std::string> ShapeKey;
+    std::map<ShapeKey, size_t> group_index;
+    std::vector<std::vector<const ::google::protobuf::Message *> > groups;
+
+    for (size_t i = 0; i < messages.size(); ++i) {
+        const ::google::protobuf::Message *message = messages[i];
+        const ::google::protobuf::Reflection *reflection = message->GetReflection();
+        const ::google::protobuf::Descriptor *descriptor = message->GetDescriptor();
+
+        // Like a single row save(), a row with no column to write fails,
+        // before anything of the batch is written.
+        const TableSchema *schema = TableSchema::get(descriptor);
+        if (schema->blobStorage() == false) {
+            const TableSchema::FieldList &all_columns = schema->columns();
+            size_t j = 0;
+            while (j < all_columns.size() && reflection->HasField(*message, all_columns[j]) == false) {
+                ++j;
+            }
+            if (j == all_columns.size()) {
+                printf("Nothing to save for %s.\n", message->GetTypeName().c_str());
+                return false;
+            }
+        }
+
+        std::string shape(descriptor->field_count(), '0');
+        for (int j = 0; j < descriptor->field_count(); ++j) {
+            if (reflection->HasField(*message, descriptor->field(j))) {
+                shape[j] = '1';
+            }
+        }
+
+        ShapeKey key(descriptor, shape);
+        std::map<ShapeKey, size_t>::iterator iter = group_index.find(key);
+        if (iter == group_index.end()) {
+            iter = group_index.insert(std::make_pair(key, groups.size())).first;
+            groups.resize(groups.size() + 1);
+        }
+        groups[iter->second].push_back(message);
+    }
+
+    ConnectionPool::Handle handle = checkout();
+    if (!handle) {
+        printf("ConnectionPool checkout failed.\n");
+        return false;
+    }
+
+    size_t max_statement_size = maxStatementSize(handle.get());
+
+    for (size_t i = 0; i < groups.size(); ++i) {
+        const ::google::protobuf::Descriptor *descriptor = groups[i][0]->GetDescriptor();
+        const TableSchema *schema = TableSchema::get(descriptor);
+
+        // Failed unless the whole group is written.
+        Metrics::Sample sample(metrics_, descriptor, Metrics::BATCH_SAVE);
+        sample.setFailed(true);
+        sample.addRowsOut(groups[i].size());
+
+        if (schema->blobStorage()) {
+            for (size_t j = 0; j < groups[i].size(); ++j) {
+                if (saveBlob(handle, *groups[i][j], sample) == false) {
+                    return false;
+                }
+            }
+            sample.setFailed(false);
+            continue;
+        }
+
+        SqlBuilder &sql = handle.connection()->sql();
+        sql.reset(handle.get());
+        if (buildSaveRows(sql, groups[i], max_statement_size, [this, &handle, &sample](const std::string &statement) {
+                    return execute(handle, statement, sample);
+                }) == false) {
+            return false;
+        }
+        sample.setFailed(false);
+    }
+
+    return true;
+}
+
+bool Storage::buildSaveRows(SqlBuilder &sql, const std::vector<const ::google::protobuf::Message *> &rows,
+        size_t max_statement_size, const StatementSink &execute) {
+    const ::google::protobuf::Message &first = *rows[0];
+    const ::google::protobuf::Reflection *reflection = first.GetReflection();
+    const TableSchema *schema = TableSchema::get(first.GetDescriptor());
+
+    const TableSchema::FieldList &all_columns = schema->columns();
+    TableSchema::FieldList columns;
+    // REPLACE INTO `table` (`field1`,`field2`) VALUES ('value1',value2),(...);
+    // or INSERT INTO ... ON DUPLICATE KEY UPDATE ... for tables with a primary key.
+    sql.append(schema->hasPrimaryKey() ? "INSERT INTO " : "REPLACE INTO ").append(schema->quotedTable()).append(" (");
+    for (size_t i = 0; i < all_columns.size(); ++i) {
+        if (reflection->HasField(first, all_columns[i]) == false) {
+            continue;
+        }
+        if (columns.empty() == false) {
+            sql.append(',');
+        }
+        sql.append(schema->quotedName(all_columns[i]));
+        columns.push_back(all_columns[i]);
+    }
+    sql.append(") VALUES ");
+
+    std::string tail;
+    if (schema->hasPrimaryKey()) {
+        schema->appendUpsertClause(tail, columns);
+    }
+
+    size_t head_size = sql.size();
+
+    for (size_t i = 0; i < rows.size(); ++i) {
+        const ::google::protobuf::Message &message = *rows[i];
+
+        // Rows are formatted in place, one that overflows the statement
+        // is carried over to the next one.
+        size_t row_begin = sql.size();
+        if (row_begin > head_size) {
+            sql.append(',');
+        }
+        sql.append('(');
+        for (size_t j = 0; j < columns.size(); ++j) {
+            if (j != 0) {
+                sql.append(',');
+            }
+            if (sql.appendValue(message, columns[j]) == false) {
+                return false;
+            }
+        }
+        sql.append(')');
+
+        if (row_begin > head_size && sql.size() + tail.size() > max_statement_size) {
+            std::string row(sql.str(), row_begin + 1);
+            sql.resize(row_begin);
+            sql.append(tail);
+            if (execute(sql.str()) == false) {
+                return false;
+            }
+            sql.resize(head_size);
+            sql.append(row);
+        }
+    }
+
+    sql.append(tail);
+    if (execute(sql.str()) == false) {
+        return false;
+    }
+    return true;
+}
+
+ConnectionPool::Handle Storage::checkout() {
+    Transaction *transaction = Transaction::current(*this);
+    if (transaction != NULL) {
+        return transaction->handle_.borrow();
+    }
+    return pool_.checkout();
+}
+
+bool Storage::inTransaction() const {
+    return Transaction::current(*this) != NULL;
+}
+
+bool Storage::import(const ::google::protobuf::Descriptor *descriptor, const MessageSource &source,
+        uint64_t *rows) {
+    Metrics::Sample sample(metrics_, descriptor, Metrics::BATCH_SAVE);
+    sample.setFailed(true);
+
+    ConnectionPool::Handle handle = checkout();
+    if (!handle) {
+        printf("ConnectionPool checkout failed.\n");
+        return false;
+    }
+
+    InfileStream stream(TableSchema::get(descriptor), source, [this](MYSQL *mysql) {
+        return pool_.killQuery(mysql);
+    });
+    SqlBuilder &sql = handle.connection()->sql();
+    sql.reset(handle.get());
+    stream.appendStatement(sql.buffer());
+
+    stream.install(handle.get());
+    bool ret = execute(handle, sql.str(), sample);
+    InfileStream::restore(handle.get());
+    if (stream.failed()) {
+        printf("Import of %s aborted, the source failed.\n", descriptor->full_name().c_str());
+        ret = false;
+    }
+
+    // Replaced rows may hold columns the messages leave unset, drop what
+    // is known about the type. Only now: a load racing with the import
+    // could cache the old rows again. A failed import may still have
+    // written rows when the connection broke after the server's reply.
+    Transaction *transaction = Transaction::current(*this);
+    if (cache_ != NULL) {
+        cache_->invalidate(descriptor);
+        if (transaction != NULL) {
+            transaction->imported_.push_back(descriptor);
+        }
+    }
+    if (tracker_ != NULL) {
+        tracker_->forget(descriptor);
+    }
+
+    sample.addRowsOut(stream.rows());
+    sample.addBytesOut(stream.bytes());
+    if (rows != NULL) {
+        *rows = stream.rows();
+    }
+    sample.setFailed(ret == false);
+    return ret;
+}
+
+bool Storage::exportTo(const ::google::protobuf::Message &query, std::ostream &output, uint64_t *rows) {
+    DelimitedWriter writer(output);
+    uint64_t count = 0;
+    bool ret = load(query, [&writer, &count](const ::google::protobuf::Message &row) {
+        ++count;
+        return writer.write(row);
+    });
+    ret = writer.flush() && ret;
+
+    if (rows != NULL) {
+        *rows = count;
+    }
+    return ret;
+}
+
+bool Storage::loadPrepared(ConnectionPool::Handle &handle, const ::google::protobuf::Message &query,
+        const FieldList *fields, std::vector< ::google::protobuf::Message *> &results, Metrics::Sample &sample) {
+    const ::google::protobuf::Reflection *reflection = query.GetReflection();
+    const ::google::protobuf::Descriptor *descriptor = query.GetDescriptor();
+
+    PreparedStatement::FieldList params;
+    PreparedStatement::FieldList columns;
+    std::string key = "L:" + query.GetTypeName() + ":";
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->field(i);
+        if (PreparedStatement::isBindable(field_descriptor) == false) {
+            continue;
+        }
+        if (fields == NULL) {
+            columns.push_back(field_descriptor);
+        }
+        if (reflection->HasField(query, field_descriptor)) {
+            params.push_back(field_descriptor);
+            key.push_back('1');
+        } else {
+            key.push_back('0');
+        }
+    }
+
+    // Projections are cached per field list too, by field number.
+    if (fields != NULL) {
+        if (fields->empty()) {
+            printf("%s: empty projection.\n", query.GetTypeName().c_str());
+            return false;
+        }
+        for (size_t i = 0; i < fields->size(); ++i) {
+            if (PreparedStatement::isBindable((*fields)[i]) == false) {
+                printf("%s: %s has no column.\n", query.GetTypeName().c_str(), (*fields)[i]->name().c_str());
+                return false;
+            }
+            columns.push_back((*fields)[i]);
+            key.append(i == 0 ? ":" : ",").append(std::to_string((*fields)[i]->number()));
+        }
+    }
+
+    PreparedStatement *statement = handle.connection()->statement(key);
+    if (statement == NULL) {
+        const TableSchema *schema = TableSchema::get(descriptor);
+
+        // SELECT `field1`,`field2` FROM `table` WHERE `field1`=?;
+        SqlBuilder &sql = handle.connection()->sql();
+        sql.reset(handle.get());
+        sql.append("SELECT ");
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (i != 0) {
+                sql.append(',');
+            }
+            sql.append(schema->quotedName(columns[i]));
+        }
+        sql.append(" FROM ").append(schema->quotedTable());
+        for (size_t i = 0; i < params.size(); ++i) {
+            sql.append(i == 0 ? " WHERE " : " AND ").append(schema->quotedName(params[i])).append("=?");
+        }
+
+        statement = prepare(handle, key, sql.str(), params, columns);
+        if (statement == NULL) {
+            return false;
+        }
+    }
+
+    if (executePrepared(handle, statement, key, query, sample) == false) {
+        return false;
+    }
+
+    size_t first = results.size();
+    for (;;) {
+        ::google::protobuf::Message *message = query.New();
+        if (statement->fetch(message) == false) {
+            delete message;
+            break;
+        }
+        results.push_back(message);
+    }
+    sample.addRowsIn(results.size() - first);
+
+    statement->freeResult();
+    sample.mark(Metrics::DECODE);
+    if (statement->fetchFailed()) {
+        for (size_t i = first; i < results.size(); ++i) {
+            delete results[i];
+        }
+        results.resize(first);
+        return false;
+    }
+    return true;
+}
+
+bool Storage::savePrepared(ConnectionPool::Handle &handle, const ::google::protobuf::Message &message,
+        Metrics::Sample &sample) {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    const ::google::protobuf::Descriptor *descriptor = message.GetDescriptor();
+
+    PreparedStatement::FieldList params;
+    std::string key = "S:" + message.GetTypeName() + ":";
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->field(i);
+        if (PreparedStatement::isBindable(field_descriptor) &&
+                reflection->HasField(message, field_descriptor)) {
+            params.push_back(field_descriptor);
+            key.push_back('1');
+        } else {
+            key.push_back('0');
+        }
+    }
+
+    // Same as the text protocol path.
+    if (params.empty()) {
+        printf("Nothing to save for %s.\n", message.GetTypeName().c_str());
+        return false;
+    }
+
+    PreparedStatement *statement = handle.connection()->statement(key);
+    if (statement == NULL) {
+        const TableSchema *schema = TableSchema::get(descriptor);
+
+        // REPLACE INTO `table` (`field1`,`field2`) VALUES (?,?);
+        // or INSERT INTO ... ON DUPLICATE KEY UPDATE ... for tables with a primary key.
+        SqlBuilder &sql = handle.connection()->sql();
+        sql.reset(handle.get());
+        sql.append(schema->hasPrimaryKey() ? "INSERT INTO " : "REPLACE INTO ").append(schema->quotedTable()).append(" (");
+        for (size_t i = 0; i < params.size(); ++i) {
+            if (i != 0) {
+                sql.append(',');
+            }
+            sql.append(schema->quotedName(params[i]));
+        }
+        sql.append(") VALUES (");
+        for (size_t i = 0; i < params.size(); ++i) {
+            sql.append(i == 0 ? "?" : ",?");
+        }
+        sql.append(')');
+        if (schema->hasPrimaryKey()) {
+            schema->appendUpsertClause(sql.buffer(), params);
+        }
+
+        statement = prepare(handle, key, sql.str(), params, PreparedStatement::FieldList());
+        if (statement == NULL) {
+            return false;
+        }
+    }
+
+    return executePrepared(handle, statement, key, message, sample);
+}
+
+bool Storage::saveBlob(ConnectionPool::Handle &handle, const ::google::protobuf::Message &message,
+        Metrics::Sample &sample) {
+    std::string key = "B:" + message.GetTypeName();
+    PreparedStatement *statement = handle.connection()->statement(key);
+    if (statement == NULL) {
+        const TableSchema *schema = TableSchema::get(message.GetDescriptor());
+
+        PreparedStatement::FieldList params(schema->columns());
+        params.push_back(NULL);
+
+        // INSERT INTO `table` (`key1`,`_pmo_data`) VALUES (?,?) ON DUPLICATE KEY UPDATE ...;
+        SqlBuilder &sql = handle.connection()->sql();
+        sql.reset(handle.get());
+        sql.append(schema->hasPrimaryKey() ? "INSERT INTO " : "REPLACE INTO ").append(schema->quotedTable()).append(" (");
+        for (size_t i = 0; i < schema->columns().size(); ++i) {
+            sql.append(schema->quotedName(schema->columns()[i])).append(',');
+        }
+        sql.append('`').append(TableSchema::blobColumn()).append("`) VALUES (");
+        for (size_t i = 0; i < params.size(); ++i) {
+            sql.append(i == 0 ? "?" : ",?");
+        }
+        sql.append(')');
+        if (schema->hasPrimaryKey()) {
+            schema->appendUpsertClause(sql.buffer(), params);
+        }
+
+        statement = prepare(handle, key, sql.str(), params, PreparedStatement::FieldList());
+        if (statement == NULL) {
+            return false;
+        }
+    }
+
+    return executePrepared(handle, statement, key, message, sample);
+}
+
+bool Storage::executePrepared(ConnectionPool::Handle &handle, PreparedStatement *statement, const std::string &key,
+        const ::google::protobuf::Message &message, Metrics::Sample &sample) {
+    sample.mark(Metrics::BUILD);
+    bool ret = statement->execute(message);
+    metrics_.slowQuery(sample.mark(Metrics::ROUND_TRIP), key);
+
+    if (ret == false && statement->errorCode() >= 2000) {
+        handle.setBroken();
+    }
+    return ret;
+}
+
+PreparedStatement *Storage::prepare(ConnectionPool::Handle &handle, const std::string &key,
+        const std::string &sql, const std::vector<const ::google::protobuf::FieldDescriptor *> &params,
+        const std::vector<const ::google::protobuf::FieldDescriptor *> &columns) {
+    PreparedStatement *statement = PreparedStatement::create(handle.get(), sql, params, columns);
+    if (statement == NULL) {
+        if (::mysql_errno(handle.get()) >= 2000) {
+            handle.setBroken();
+        }
+        return NULL;
+    }
+
+    handle.connection()->setStatement(key, statement);
+    return statement;
+}
+
+bool Storage::updateRow(const ::google::protobuf::Message &message, const TableSchema::FieldList &columns,
+        Metrics::Sample &sample, bool &matched) {
+    sample.addRowsOut(1);
+
+    ConnectionPool::Handle handle = checkout();
+    if (!handle) {
+        printf("ConnectionPool checkout failed.\n");
+        return false;
+    }
+
+    SqlBuilder &sql = handle.connection()->sql();
+    sql.reset(handle.get());
+    if (buildUpdate(sql, message, columns) == false || execute(handle, sql.str(), sample) == false) {
+        return false;
+    }
+    // Connections use CLIENT_FOUND_ROWS, rows left unchanged count too.
+    matched = ::mysql_affected_rows(handle.get()) != 0;
+    return true;
+}
+
+bool Storage::buildUpdate(SqlBuilder &sql, const ::google::protobuf::Message &message,
+        const TableSchema::FieldList &columns) {
+    const TableSchema *schema = TableSchema::get(message.GetDescriptor());
+
+    // UPDATE `table` SET `field2`=value2 WHERE `field1`=value1;
+    sql.append("UPDATE ").append(schema->quotedTable()).append(" SET");
+    for (size_t i = 0; i < columns.size(); ++i) {
+        sql.append(i == 0 ? " " : ", ").append(schema->quotedName(columns[i])).append('=');
+        if (sql.appendValue(message, columns[i]) == false) {
+            return false;
+        }
+    }
+
+    const TableSchema::FieldList &primary_key = schema->primaryKey();
+    sql.append(" WHERE");
+    for (size_t i = 0; i < primary_key.size(); ++i) {
+        sql.append(i == 0 ? " " : " AND ").append(schema->quotedName(primary_key[i])).append('=');
+        if (sql.appendValue(message, primary_key[i]) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Storage::saved(const ::google::protobuf::Message &message, bool ok) {
+    // A failed statement may still have reached the table, a row written
+    // in a transaction may still be rolled back.
+    Transaction *transaction = Transaction::current(*this);
+    if (transaction != NULL) {
+        ok = false;
+        if (cache_ != NULL) {
+            transaction->written_.push_back(std::unique_ptr< ::google::protobuf::Message>(message.New()));
+            transaction->written_.back()->CopyFrom(message);
+        }
+    }
+    if (cache_ != NULL) {
+        if (ok) {
+            cache_->update(message);
+        } else {
+            cache_->invalidate(message);
+        }
+    }
+    if (tracker_ != NULL) {
+        if (ok) {
+            tracker_->record(message);
+        } else {
+            tracker_->forget(message);
+        }
+    }
+}
+
+bool Storage::buildSelect(SqlBuilder &sql, const MessageOrm *orm, const Query &query) {
+    const ::google::protobuf::Message &filter = query.filter();
+    if (orm != NULL) {
+        return orm->buildSelect(filter, sql.mysql(), sql.buffer());
+    }
+
+    const ::google::protobuf::Descriptor *descriptor = filter.GetDescriptor();
+    const TableSchema *schema = TableSchema::get(descriptor);
+    const FieldList *fields = query.fields();
+
+    if (fields != NULL) {
+        if (fields->empty()) {
+            printf("%s: empty projection.\n", filter.GetTypeName().c_str());
+            return false;
+        }
+        sql.append("SELECT ");
+        for (size_t i = 0; i < fields->size(); ++i) {
+            if (std::find(schema->columns().begin(), schema->columns().end(), (*fields)[i]) ==
+                    schema->columns().end()) {
+                printf("%s: %s has no column.\n", filter.GetTypeName().c_str(), (*fields)[i]->name().c_str());
+                return false;
+            }
+            if (i != 0) {
+                sql.append(',');
+            }
+            sql.append(schema->quotedName((*fields)[i]));
+        }
+        sql.append(" FROM ").append(schema->quotedTable());
+    } else if (schema->blobStorage()) {
+        sql.append("SELECT `").append(TableSchema::blobColumn()).append("` FROM ").append(schema->quotedTable());
+    } else {
+        sql.append("SELECT * FROM ").append(schema->quotedTable());
+    }
+
+    const ::google::protobuf::Message *lower = query.lower();
+    const ::google::protobuf::Message *upper = query.upper();
+    bool between = lower != NULL && upper != NULL && query.lowerInclusive() && query.upperInclusive();
+
+    bool first_condition = true;
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->field(i);
+        if (field_descriptor->label() == ::google::protobuf::FieldDescriptor::LABEL_REPEATED) {
+            continue;
+        }
+
+        // `field`=value AND `field` BETWEEN low AND high AND `field`>=low ...
+        for (int side = 0; side < 3; ++side) {
+            const ::google::protobuf::Message *message = side == 0 ? &filter : (side == 1 ? lower : upper);
+            if (message == NULL || message->GetReflection()->HasField(*message, field_descriptor) == false) {
+                continue;
+            }
+            bool both = between && side == 1 && upper->GetReflection()->HasField(*upper, field_descriptor);
+            if (between && side == 2 && lower->GetReflection()->HasField(*lower, field_descriptor)) {
+                continue;
+            }
+
+            if (std::find(schema->columns().begin(), schema->columns().end(), field_descriptor) ==
+                    schema->columns().end()) {
+                if (schema->blobStorage()) {
+                    printf("%s: %s is inside %s and can not be queried.\n", filter.GetTypeName().c_str(),
+                        field_descriptor->name().c_str(), TableSchema::blobColumn());
+                } else {
+                    printf("%s: %s has no column.\n", filter.GetTypeName().c_str(),
+                        field_descriptor->name().c_str());
+                }
+                return false;
+            }
+
+            sql.append(first_condition ? " WHERE " : " AND ").append(schema->quotedName(field_descriptor));
+            first_condition = false;
+            if (side == 0) {
+                sql.append('=');
+            } else if (both) {
+                sql.append(" BETWEEN ");
+            } else if (side == 1) {
+                sql.append(query.lowerInclusive() ? ">=" : ">");
+            } else {
+                sql.append(query.upperInclusive() ? "<=" : "<");
+            }
+            if (sql.appendValue(*message, field_descriptor) == false) {
+                return false;
+            }
+            if (both) {
+                sql.append(" AND ");
+                if (sql.appendValue(*upper, field_descriptor) == false) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    const TableSchema::FieldList &primary_key = schema->primaryKey();
+    if (query.ordered() && primary_key.empty()) {
+        printf("%s: no primary key to order by.\n", filter.GetTypeName().c_str());
+        return false;
+    }
+
+    // Keyset position: (`a`,`b`) > (1,'x'), < when descending. Row
+    // comparison is lexicographic, the same order as ORDER BY `a`,`b`.
+    const ::google::protobuf::Message *position = query.position();
+    if (position != NULL) {
+        bool composite = primary_key.size() > 1;
+        sql.append(first_condition ? " WHERE " : " AND ");
+        sql.append(composite ? "(" : "");
+        for (size_t i = 0; i < primary_key.size(); ++i) {
+            sql.append(i == 0 ? "" : ",").append(schema->quotedName(primary_key[i]));
+        }
+        sql.append(composite ? ")" : "").append(query.descending() ? "<" : ">").append(composite ? "(" : "");
+        for (size_t i = 0; i < primary_key.size(); ++i) {
+            if (position->GetReflection()->HasField(*position, primary_key[i]) == false) {
+                printf("%s: position has no %s.\n", filter.GetTypeName().c_str(), primary_key[i]->name().c_str());
+                return false;
+            }
+            if (i != 0) {
+                sql.append(',');
+            }
+            if (sql.appendValue(*position, primary_key[i]) == false) {
+                return false;
+            }
+        }
+        sql.append(composite ? ")" : "");
+    }
+
+    if (query.ordered()) {
+        for (size_t i = 0; i < primary_key.size(); ++i) {
+            sql.append(i == 0 ? " ORDER BY " : ",").append(schema->quotedName(primary_key[i]));
+            if (query.descending()) {
+                sql.append(" DESC");
+            }
+        }
+    }
+
+    if (query.limitCount() != 0) {
+        sql.append(" LIMIT ");
+        sql.appendNumber((uint64_t)query.limitCount());
+    }
+
+    return true;
+}
+
+bool Storage::buildLoadCall(SqlBuilder &sql, const ::google::protobuf::Message &query) {
+    const TableSchema *schema = TableSchema::get(query.GetDescriptor());
+    const TableSchema::FieldList &primary_key = schema->primaryKey();
+
+    // CALL `pmo_load_table_by_key`(key1,key2);
+    sql.append("CALL `").append(schema->loadProcedure()).append("`(");
+    for (size_t i = 0; i < primary_key.size(); ++i) {
+        if (i != 0) {
+            sql.append(',');
+        }
+        if (sql.appendValue(query, primary_key[i]) == false) {
+            return false;
+        }
+    }
+    sql.append(')');
+    return true;
+}
+
+bool Storage::buildSaveCall(SqlBuilder &sql, const ::google::protobuf::Message &message) {
+    const TableSchema *schema = TableSchema::get(message.GetDescriptor());
+    const TableSchema::FieldList &columns = schema->columns();
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+
+    // CALL `pmo_save_table`(value1,NULL,value3); NULL keeps the stored value.
+    sql.append("CALL `").append(schema->saveProcedure()).append("`(");
+    for (size_t i = 0; i < columns.size(); ++i) {
+        if (i != 0) {
+            sql.append(',');
+        }
+        if (reflection->HasField(message, columns[i]) == false) {
+            sql.append("NULL");
+        } else if (sql.appendValue(message, columns[i]) == false) {
+            return false;
+        }
+    }
+    sql.append(')');
+    return true;
+}
+
+void Storage::drainResults(ConnectionPool::Handle &handle) {
+    // CALL always ends with a status result, it has to be consumed before
+    // the connection can run another statement.
+    int ret;
+    while ((ret = ::mysql_next_result(handle.get())) == 0) {
+        ::MYSQL_RES *res = ::mysql_store_result(handle.get());
+        if (res != NULL) {
+            ::mysql_free_result(res);
+        }
+    }
+    if (ret > 0) {
+        printf("mysql_next_result failed: %s.\n", ::mysql_error(handle.get()));
+        handle.setBroken();
+    }
+}
+
+std::string Storage::dumpMetrics() const {
+    ConnectionPool::Stats stats = pool_.stats();
+
+    std::ostringstream oss;
+    oss << metrics_.dump()
+        << "connections open=" << stats.open
+        << " idle=" << stats.idle
+        << " busy=" << stats.busy
+        << " created=" << stats.created
+        << " destroyed=" << stats.destroyed
+        << " checkouts=" << stats.checkouts
+        << " waits=" << stats.waits
+        << " timeouts=" << stats.timeouts
+        << " ping_failures=" << stats.ping_failures << "\n";
+    return oss.str();
+}
+
+size_t Storage::maxStatementSize(MYSQL *mysql) {
+    if (max_statement_size_ != 0) {
+        return max_statement_size_;
+    }
+
+    // Leave headroom below max_allowed_packet for the protocol header.
+    size_t max_allowed_packet = 1024 * 1024;
+    if (::mysql_real_query(mysql, "SELECT @@max_allowed_packet", 27) == 0) {
+        ::MYSQL_RES *res = ::mysql_store_result(mysql);
+        if (res != NULL) {
+            ::MYSQL_ROW row = ::mysql_fetch_row(res);
+            if (row != NULL && row[0] != NULL) {
+                max_allowed_packet = (size_t)strtoull(row[0], NULL, 10);
+            }
+            ::mysql_free_result(res);
+        }
+    }
+
+    max_statement_size_ = max_allowed_packet > 2048 ? max_allowed_packet - 1024 : max_allowed_packet;
+    return max_statement_size_;
+}
+
+bool Storage::execute(ConnectionPool::Handle &handle, const std::string &sql, Metrics::Sample &sample) {
+    sample.mark(Metrics::BUILD);
+    sample.addBytesOut(sql.size());
+    int ret = ::mysql_real_query(handle.get(), sql.c_str(), sql.length());
+    metrics_.slowQuery(sample.mark(Metrics::ROUND_TRIP), sql);
+    if (ret != 0) {
+        printf("mysql query error: %s, sql: %s\n", ::mysql_error(handle.get()), sql.c_str());
+        sample.setFailed(true);
+        // Client side errors (CR_*) mean the connection itself is gone.
+        if (::mysql_errno(handle.get()) >= 2000) {
+            handle.setBroken();
+        }
+        return false;
+    }
 
     return true;
 }
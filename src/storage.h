@@ -1,6 +1,9 @@
 #ifndef PMO_STORAGE_H
 #define PMO_STORAGE_H
 
+#include <atomic>
+#include <functional>
+#include <iosfwd>
 #include <map>
 #include <string>
 #include <vector>
@@ -9,9 +12,15 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "bulk_io.h"
+#include "connection_pool.h"
+#include "metrics.h"
+
 namespace google {
 namespace protobuf {
 
+class Descriptor;
+class FieldDescriptor;
 class Message;
 
 }  // namespace protobuf
@@ -19,33 +28,210 @@ class Message;
 
 namespace pmo {
 
+class LoadCache;
+class MessageOrm;
+class PreparedStatement;
+class Query;
+class SnapshotTracker;
+
+// Storage may be shared by any number of threads. Each call checks its own
+// connection out of the ConnectionPool, and the cache, snapshot tracker and
+// metrics it touches lock internally. The set*() options are read without
+// locking and must be configured before the Storage is shared.
 class Storage {
 public:
+    typedef std::vector<const google::protobuf::FieldDescriptor *> FieldList;
+
     Storage(const std::string &host, const std::string &database,
             const std::string &user, const std::string &passwd,
             uint32_t port = 3306);
+    explicit Storage(const ConnectionPoolOptions &options);
     virtual ~Storage();
 
-    void load(const std::string &type, const std::string &query, std::vector<std::string> &results);
-    void load(const google::protobuf::Message &query, std::vector<google::protobuf::Message *> &results);
+    bool load(const std::string &type, const std::string &query, std::vector<std::string> &results);
+    bool load(const google::protobuf::Message &query, std::vector<google::protobuf::Message *> &results);
+
+    // Loads the rows of many primary keys with a few WHERE `key` IN (...)
+    // statements, WHERE (`a`,`b`) IN ((...),(...)) for composite keys, each
+    // bounded by kLoadManyChunkSize keys and max_allowed_packet. Only the
+    // key fields of |keys| are read and they must all be of one type.
+    // Rows are returned by TableSchema::keyOf() and owned by the caller,
+    // also on failure. Indexes of |keys| without a row go to |missing|.
+    typedef std::map<std::string, google::protobuf::Message *> KeyedRows;
+    static const size_t kLoadManyChunkSize = 500;
+    bool loadMany(const std::vector<const google::protobuf::Message *> &keys, KeyedRows &results,
+            std::vector<size_t> &missing);
+    // Serialized form, results[i] is the row of keys[i] or empty if missing.
+    bool loadMany(const std::string &type, const std::vector<std::string> &keys,
+            std::vector<std::string> &results, std::vector<size_t> &missing);
+
+    // Streams the matching rows through |visitor| one at a time, reusing a
+    // single message, so memory does not grow with the result size. The
+    // visitor returns false to stop early, which closes the connection
+    // rather than reading the remaining rows, except inside a Transaction.
+    typedef std::function<bool (const google::protobuf::Message &)> RowVisitor;
+    bool load(const google::protobuf::Message &query, const RowVisitor &visitor);
+
+    // Projections: only the |fields| columns are selected and decoded, the
+    // other fields of the rows are left unset. See TableSchema::projection()
+    // to resolve a field list. These rows bypass the load cache.
+    bool load(const google::protobuf::Message &query, const FieldList &fields,
+            std::vector<google::protobuf::Message *> &results);
+    bool load(const google::protobuf::Message &query, const FieldList &fields, const RowVisitor &visitor);
+
+    // Range, order and limit queries, and pages of a Cursor. Always SQL
+    // text, they bypass the load cache, prepared statements and stored
+    // procedures unless the query is plain.
+    bool load(const Query &query, std::vector<google::protobuf::Message *> &results);
+    bool load(const Query &query, const RowVisitor &visitor);
+
+    bool save(const std::string &type, const std::string &data);
+    bool save(const google::protobuf::Message &message);
+
+    // Writes only the columns of |message| that differ from |baseline| with
+    // UPDATE ... SET <changed> WHERE <primary key>, no statement is sent when
+    // nothing changed. Falls back to save() when the key is not set, and
+    // when no row has the key, e.g. it was deleted since |baseline| was read.
+    bool update(const google::protobuf::Message &message, const google::protobuf::Message &baseline);
+
+    // Batched save, messages are grouped by type and set of present fields
+    // and written as multi-row INSERT ... ON DUPLICATE KEY UPDATE (REPLACE
+    // for tables without a primary key) statements bounded by
+    // max_allowed_packet.
+    bool save(const std::string &type, const std::vector<std::string> &datas);
+    bool save(const std::vector<const google::protobuf::Message *> &messages);
 
-    void save(const std::string &type, const std::string &data);
-    void save(const google::protobuf::Message &message);
+    // Bulk load of the messages of |source|, all of |descriptor|'s type,
+    // with one LOAD DATA LOCAL INFILE ... REPLACE statement. Rows are
+    // encoded while the server reads them, see InfileStream. Needs
+    // ConnectionPoolOptions::local_infile. Unset fields are stored as NULL,
+    // or as their proto default when they have one. Returns false, with
+    // nothing written, when |source| fails. The statement is aborted with
+    // KILL QUERY, inside a Transaction only the statement is rolled back.
+    bool import(const google::protobuf::Descriptor *descriptor, const MessageSource &source,
+            uint64_t *rows = NULL);
+    // Streams the rows matching |query| to |output| as length delimited
+    // messages, the format DelimitedReader reads back for import().
+    bool exportTo(const google::protobuf::Message &query, std::ostream &output, uint64_t *rows = NULL);
+
+    // Server side prepared statements with binary binding instead of SQL
+    // text, cached per connection for each (type, present fields) shape.
+    void setPreparedStatements(bool enable) { prepared_statements_ = enable; }
+
+    // Saves and primary key lookups call the pmo_save_* / pmo_load_*
+    // procedures generated into the .pb.sql file with positional arguments.
+    void setStoredProcedures(bool enable) { stored_procedures_ = enable; }
+
+    // Serves load() from |cache| and keeps it up to date on save(), the
+    // cache is not owned and may be shared by several Storage instances
+    // over the same database. Streaming loads bypass it.
+    void setCache(LoadCache *cache) { cache_ = cache; }
+
+    // Loaded and saved rows are recorded in |tracker|, save() of a row with
+    // a snapshot becomes update() against it and batched saves write only
+    // the key and changed columns. Saves inside a Transaction write whole
+    // rows, the snapshots may not reflect what the transaction changed.
+    // Not owned.
+    void setSnapshotTracker(SnapshotTracker *tracker) { tracker_ = tracker; }
+
+    ConnectionPool::Stats poolStats() const { return pool_.stats(); }
+    // Closes pooled connections idle past idle_timeout_ms. Expiry is
+    // otherwise only checked when connections are checked out or in, an
+    // application that goes quiet calls this periodically.
+    void shrinkPool() { pool_.shrink(); }
+
+    // Per type and operation counters and latencies, and the slow query
+    // log, see Metrics.
+    Metrics &metrics() { return metrics_; }
+    // metrics().dump() followed by the connection pool counters.
+    std::string dumpMetrics() const;
 
 private:
-    std::string mysqlEscape(const std::string &str);
+    friend class AsyncStorage;
+    friend class Transaction;
+    // Server-free tests of the statement builders, test/storage_test.cc.
+    friend class StorageTest;
+
+    static ConnectionPoolOptions poolOptions(const std::string &host, const std::string &database,
+            const std::string &user, const std::string &passwd, uint32_t port);
+
+    // The connection of the calling thread's Transaction on this Storage,
+    // otherwise one from the pool.
+    ConnectionPool::Handle checkout();
+    // Whether the calling thread has a Transaction open on this Storage.
+    // Its uncommitted rows must not reach the cache or the snapshots.
+    bool inTransaction() const;
+
+    bool loadRows(const Query &query, std::vector<google::protobuf::Message *> &results, Metrics::Sample &sample);
+    bool stream(const Query &query, const RowVisitor &visitor);
+    bool loadKeys(const std::vector<const google::protobuf::Message *> &keys, const std::vector<size_t> &pending,
+            KeyedRows &results);
+    // SELECT of the rows of keys[pending[begin]], keys[pending[begin + 1]]
+    // ... up to kLoadManyChunkSize keys, fewer when the statement would
+    // exceed |max_statement_size|. |end| is set past the last key taken.
+    static bool buildKeySelect(SqlBuilder &sql, const std::vector<const google::protobuf::Message *> &keys,
+            const std::vector<size_t> &pending, size_t begin, size_t max_statement_size, size_t &end);
+    // Buffers the result of the last statement and decodes it into new
+    // messages like |prototype|, |orm| may be NULL.
+    bool storeRows(ConnectionPool::Handle &handle, const google::protobuf::Message &prototype,
+            const MessageOrm *orm, std::vector<google::protobuf::Message *> &results, Metrics::Sample &sample);
+    // Fails on a row that does not decode, none of the rows are added then.
+    static bool decodeRows(MYSQL_RES *res, const google::protobuf::Message &prototype,
+            const MessageOrm *orm, std::vector<google::protobuf::Message *> &results, Metrics::Sample &sample);
+    bool saveRow(const google::protobuf::Message &message, Metrics::Sample &sample);
+    bool saveRows(const std::vector<const google::protobuf::Message *> &messages);
+    // Multi-row statements for |rows|, all of one type and one set of
+    // present fields, each kept below |max_statement_size| unless a single
+    // row is larger. Every statement is built in |sql| and passed to
+    // |execute|.
+    typedef std::function<bool (const std::string &sql)> StatementSink;
+    static bool buildSaveRows(SqlBuilder &sql, const std::vector<const google::protobuf::Message *> &rows,
+            size_t max_statement_size, const StatementSink &execute);
+    // |matched| tells whether a row has the key of |message|.
+    bool updateRow(const google::protobuf::Message &message, const std::vector<const google::protobuf::FieldDescriptor *> &columns,
+            Metrics::Sample &sample, bool &matched);
+    // Keeps the cache and snapshots in step with a write of |message|.
+    void saved(const google::protobuf::Message &message, bool ok);
+
+    // Statements are built into the SqlBuilder of the connection that
+    // runs them, see ConnectionPool::Connection::sql().
+    // |orm| is only used for plain queries.
+    static bool buildSelect(SqlBuilder &sql, const MessageOrm *orm, const Query &query);
+    bool buildLoadCall(SqlBuilder &sql, const google::protobuf::Message &query);
+    bool buildSaveCall(SqlBuilder &sql, const google::protobuf::Message &message);
+    // UPDATE ... SET |columns| WHERE <primary key> of |message|.
+    static bool buildUpdate(SqlBuilder &sql, const google::protobuf::Message &message,
+            const std::vector<const google::protobuf::FieldDescriptor *> &columns);
+    // INSERT ... ON DUPLICATE KEY UPDATE (REPLACE without a primary key) of
+    // the set columns, blob storage tables included.
+    bool buildSave(SqlBuilder &sql, const google::protobuf::Message &message);
+    void drainResults(ConnectionPool::Handle &handle);
+    size_t maxStatementSize(MYSQL *mysql);
 
-    bool connect();
-    void disconnect();
-    bool execute(const std::string &sql);
+    // Charges the time since the last mark to BUILD and the query itself to
+    // ROUND_TRIP.
+    bool execute(ConnectionPool::Handle &handle, const std::string &sql, Metrics::Sample &sample);
 
-    MYSQL *mysql_;
+    bool loadPrepared(ConnectionPool::Handle &handle, const google::protobuf::Message &query,
+            const FieldList *fields, std::vector<google::protobuf::Message *> &results, Metrics::Sample &sample);
+    bool savePrepared(ConnectionPool::Handle &handle, const google::protobuf::Message &message,
+            Metrics::Sample &sample);
+    // Key columns and the serialized message of a blob storage table.
+    bool saveBlob(ConnectionPool::Handle &handle, const google::protobuf::Message &message,
+            Metrics::Sample &sample);
+    bool executePrepared(ConnectionPool::Handle &handle, PreparedStatement *statement, const std::string &key,
+            const google::protobuf::Message &message, Metrics::Sample &sample);
+    PreparedStatement *prepare(ConnectionPool::Handle &handle, const std::string &key,
+            const std::string &sql, const std::vector<const google::protobuf::FieldDescriptor *> &params,
+            const std::vector<const google::protobuf::FieldDescriptor *> &columns);
 
-    std::string host_;
-    std::string database_;
-    uint32_t port_;
-    std::string user_;
-    std::string passwd_;
+    ConnectionPool pool_;
+    std::atomic<size_t> max_statement_size_;
+    bool prepared_statements_;
+    bool stored_procedures_;
+    LoadCache *cache_;
+    SnapshotTracker *tracker_;
+    Metrics metrics_;
 };
 
 }   // namespace pmo
@@ -0,0 +1,444 @@
+#include "table_schema.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "pmo_options.pb.h"
+
+namespace pmo {
+
+const TableSchema *TableSchema::get(const ::google::protobuf::Descriptor *descriptor) {
+    // Schemas never change once built, each thread keeps the ones it has
+    // seen and only takes the lock for a type new to it.
+    static thread_local std::map<const ::google::protobuf::Descriptor *, const TableSchema *> seen;
+    std::map<const ::google::protobuf::Descriptor *, const TableSchema *>::iterator iter = seen.find(descriptor);
+    if (iter != seen.end()) {
+        return iter->second;
+    }
+
+    static std::mutex mutex;
+    static std::map<const ::google::protobuf::Descriptor *, TableSchema *> schemas;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    TableSchema *&schema = schemas[descriptor];
+    if (schema == NULL) {
+        schema = new TableSchema(descriptor);
+    }
+    seen[descriptor] = schema;
+    return schema;
+}
+
+TableSchema::TableSchema(const ::google::protobuf::Descriptor *descriptor) :
+        descriptor_(descriptor),
+        blob_storage_(descriptor->options().GetExtension(pmo::blob_storage)) {
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->field(i);
+        const ::google::protobuf::FieldOptions &options = field_descriptor->options();
+        if (options.GetExtension(pmo::primary_key)) {
+            primary_key_.push_back(field_descriptor);
+        }
+        if (options.GetExtension(pmo::primary_key) || options.GetExtension(pmo::unique) ||
+                options.GetExtension(pmo::index)) {
+            indexed_.push_back(field_descriptor);
+        }
+    }
+
+    const ::google::protobuf::MessageOptions &options = descriptor->options();
+    if (primary_key_.empty() && options.GetExtension(pmo::composite_primary_key).empty() == false) {
+        parseColumnList(descriptor, options.GetExtension(pmo::composite_primary_key), primary_key_);
+        indexed_.insert(indexed_.end(), primary_key_.begin(), primary_key_.end());
+    }
+    for (int i = 0; i < options.ExtensionSize(pmo::composite_unique); ++i) {
+        parseColumnList(descriptor, options.GetExtension(pmo::composite_unique, i), indexed_);
+    }
+    for (int i = 0; i < options.ExtensionSize(pmo::composite_index); ++i) {
+        parseColumnList(descriptor, options.GetExtension(pmo::composite_index, i), indexed_);
+    }
+
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->field(i);
+        if (isColumn(field_descriptor) && (blob_storage_ == false || isIndexed(field_descriptor))) {
+            columns_.push_back(field_descriptor);
+        }
+    }
+
+    quoted_table_ = "`" + descriptor->full_name() + "`";
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        quoted_names_.push_back("`" + descriptor->field(i)->name() + "`");
+    }
+
+    // Same naming as the generator: dots of the full name become '_'.
+    std::string name = descriptor->full_name();
+    for (size_t i = 0; i < name.size(); ++i) {
+        if (name[i] == '.') {
+            name[i] = '_';
+        }
+    }
+    save_procedure_ = "pmo_save_" + name;
+    if (primary_key_.empty() == false) {
+        load_procedure_ = "pmo_load_" + name + "_by";
+        for (size_t i = 0; i < primary_key_.size(); ++i) {
+            load_procedure_ += "_" + primary_key_[i]->name();
+        }
+    }
+}
+
+const std::string &TableSchema::table() const {
+    return descriptor_->full_name();
+}
+
+const std::string &TableSchema::quotedName(const ::google::protobuf::FieldDescriptor *field_descriptor) const {
+    return quoted_names_[field_descriptor->index()];
+}
+
+void TableSchema::parseColumnList(const ::google::protobuf::Descriptor *descriptor, const std::string &list,
+        FieldList &fields) {
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        size_t first = list.find_first_not_of(" \t", begin);
+        size_t last = list.find_last_not_of(" \t", end - 1);
+        std::string name;
+        if (first != std::string::npos && first < end) {
+            name = list.substr(first, last - first + 1);
+        }
+        const ::google::protobuf::FieldDescriptor *field_descriptor = descriptor->FindFieldByName(name);
+        if (field_descriptor == NULL) {
+            printf("%s: unknown key column(%s).\n", descriptor->full_name().c_str(), name.c_str());
+        } else {
+            fields.push_back(field_descriptor);
+        }
+        begin = end + 1;
+    }
+}
+
+bool TableSchema::projection(const std::string &list, FieldList &fields) const {
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        size_t first = list.find_first_not_of(" \t", begin);
+        size_t last = list.find_last_not_of(" \t", end - 1);
+        std::string name;
+        if (first != std::string::npos && first < end) {
+            name = list.substr(first, last - first + 1);
+        }
+
+        const ::google::protobuf::FieldDescriptor *field_descriptor = NULL;
+        if (name.empty() == false && name.find_first_not_of("0123456789") == std::string::npos) {
+            field_descriptor = descriptor_->FindFieldByNumber(atoi(name.c_str()));
+        } else {
+            field_descriptor = descriptor_->FindFieldByName(name);
+        }
+        if (field_descriptor == NULL) {
+            printf("%s: unknown field(%s).\n", descriptor_->full_name().c_str(), name.c_str());
+            return false;
+        }
+        if (std::find(columns_.begin(), columns_.end(), field_descriptor) == columns_.end()) {
+            printf("%s: %s has no column.\n", descriptor_->full_name().c_str(), name.c_str());
+            return false;
+        }
+        fields.push_back(field_descriptor);
+        begin = end + 1;
+    }
+    return true;
+}
+
+bool TableSchema::isIndexed(const ::google::protobuf::FieldDescriptor *field_descriptor) const {
+    for (size_t i = 0; i < indexed_.size(); ++i) {
+        if (indexed_[i] == field_descriptor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TableSchema::isColumn(const ::google::protobuf::FieldDescriptor *field_descriptor) {
+    if (field_descriptor->label() == ::google::protobuf::FieldDescriptor::LABEL_REPEATED) {
+        return false;
+    }
+
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool TableSchema::isPrimaryKey(const ::google::protobuf::FieldDescriptor *field_descriptor) const {
+    for (size_t i = 0; i < primary_key_.size(); ++i) {
+        if (primary_key_[i] == field_descriptor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TableSchema::isKeyQuery(const ::google::protobuf::Message &query) const {
+    if (primary_key_.empty()) {
+        return false;
+    }
+
+    const ::google::protobuf::Reflection *reflection = query.GetReflection();
+    for (size_t i = 0; i < columns_.size(); ++i) {
+        if (reflection->HasField(query, columns_[i]) != isPrimaryKey(columns_[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TableSchema::changedColumns(const ::google::protobuf::Message &message,
+        const ::google::protobuf::Message &baseline, FieldList &changed) const {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+
+    for (size_t i = 0; i < columns_.size(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = columns_[i];
+        if (reflection->HasField(message, field_descriptor) == false) {
+            continue;
+        }
+        if (reflection->HasField(baseline, field_descriptor) == false) {
+            changed.push_back(field_descriptor);
+            continue;
+        }
+
+        if (sameValue(message, baseline, field_descriptor) == false) {
+            changed.push_back(field_descriptor);
+        }
+    }
+}
+
+bool TableSchema::keyOf(const ::google::protobuf::Message &message, std::string &key) const {
+    if (primary_key_.empty()) {
+        return false;
+    }
+
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    key.clear();
+    for (size_t i = 0; i < primary_key_.size(); ++i) {
+        if (reflection->HasField(message, primary_key_[i]) == false ||
+                appendKeyValue(message, primary_key_[i], key) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+::google::protobuf::Message *TableSchema::newKeyMessage(const ::google::protobuf::Message &message) const {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    ::google::protobuf::Message *key = message.New();
+    for (size_t i = 0; i < primary_key_.size(); ++i) {
+        if (reflection->HasField(message, primary_key_[i])) {
+            copyValue(message, key, primary_key_[i]);
+        }
+    }
+    return key;
+}
+
+bool TableSchema::sameValue(const ::google::protobuf::Message &message, const ::google::protobuf::Message &other,
+        const ::google::protobuf::FieldDescriptor *field_descriptor) {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            return reflection->GetInt32(message, field_descriptor) == reflection->GetInt32(other, field_descriptor);
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            return reflection->GetUInt32(message, field_descriptor) == reflection->GetUInt32(other, field_descriptor);
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            return reflection->GetInt64(message, field_descriptor) == reflection->GetInt64(other, field_descriptor);
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            return reflection->GetUInt64(message, field_descriptor) == reflection->GetUInt64(other, field_descriptor);
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+            return reflection->GetDouble(message, field_descriptor) == reflection->GetDouble(other, field_descriptor);
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+            return reflection->GetFloat(message, field_descriptor) == reflection->GetFloat(other, field_descriptor);
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+            return reflection->GetBool(message, field_descriptor) == reflection->GetBool(other, field_descriptor);
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+            return reflection->GetEnum(message, field_descriptor) == reflection->GetEnum(other, field_descriptor);
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+            std::string message_scratch;
+            std::string other_scratch;
+            return reflection->GetStringReference(message, field_descriptor, &message_scratch) ==
+                reflection->GetStringReference(other, field_descriptor, &other_scratch);
+        }
+        default:
+            return false;
+    }
+}
+
+void TableSchema::copyValue(const ::google::protobuf::Message &from, ::google::protobuf::Message *to,
+        const ::google::protobuf::FieldDescriptor *field_descriptor) {
+    const ::google::protobuf::Reflection *reflection = from.GetReflection();
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            reflection->SetInt32(to, field_descriptor, reflection->GetInt32(from, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            reflection->SetUInt32(to, field_descriptor, reflection->GetUInt32(from, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            reflection->SetInt64(to, field_descriptor, reflection->GetInt64(from, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            reflection->SetUInt64(to, field_descriptor, reflection->GetUInt64(from, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE:
+            reflection->SetDouble(to, field_descriptor, reflection->GetDouble(from, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
+            reflection->SetFloat(to, field_descriptor, reflection->GetFloat(from, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+            reflection->SetBool(to, field_descriptor, reflection->GetBool(from, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+            reflection->SetEnum(to, field_descriptor, reflection->GetEnum(from, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+            std::string scratch;
+            reflection->SetString(to, field_descriptor,
+                reflection->GetStringReference(from, field_descriptor, &scratch));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+bool TableSchema::appendKeyValue(const ::google::protobuf::Message &message,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, std::string &key) {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    char buffer[32];
+    int length = 0;
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            length = snprintf(buffer, sizeof(buffer), "%d|", reflection->GetInt32(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            length = snprintf(buffer, sizeof(buffer), "%u|", reflection->GetUInt32(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            length = snprintf(buffer, sizeof(buffer), "%lld|",
+                (long long)reflection->GetInt64(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            length = snprintf(buffer, sizeof(buffer), "%llu|",
+                (unsigned long long)reflection->GetUInt64(message, field_descriptor));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_BOOL:
+            length = snprintf(buffer, sizeof(buffer), "%d|", reflection->GetBool(message, field_descriptor) ? 1 : 0);
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
+            length = snprintf(buffer, sizeof(buffer), "%d|", reflection->GetEnum(message, field_descriptor)->number());
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_STRING: {
+            // Length prefixed so composite keys stay unambiguous.
+            std::string scratch;
+            const std::string &value = reflection->GetStringReference(message, field_descriptor, &scratch);
+            length = snprintf(buffer, sizeof(buffer), "%zu:", value.size());
+            key.append(buffer, length);
+            key.append(value);
+            return true;
+        }
+        default:
+            // Floating point keys are not supported.
+            return false;
+    }
+    key.append(buffer, length);
+    return true;
+}
+
+bool TableSchema::ordinalOf(const ::google::protobuf::Message &message,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, uint64_t &ordinal) {
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    if (reflection->HasField(message, field_descriptor) == false) {
+        return false;
+    }
+
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            ordinal = (uint64_t)(int64_t)reflection->GetInt32(message, field_descriptor) ^ (1ULL << 63);
+            return true;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            ordinal = (uint64_t)reflection->GetInt64(message, field_descriptor) ^ (1ULL << 63);
+            return true;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            ordinal = reflection->GetUInt32(message, field_descriptor);
+            return true;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            ordinal = reflection->GetUInt64(message, field_descriptor);
+            return true;
+        default:
+            return false;
+    }
+}
+
+void TableSchema::setOrdinal(::google::protobuf::Message *message,
+        const ::google::protobuf::FieldDescriptor *field_descriptor, uint64_t ordinal) {
+    const ::google::protobuf::Reflection *reflection = message->GetReflection();
+    switch (field_descriptor->cpp_type()) {
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT32:
+            reflection->SetInt32(message, field_descriptor, (int32_t)(int64_t)(ordinal ^ (1ULL << 63)));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_INT64:
+            reflection->SetInt64(message, field_descriptor, (int64_t)(ordinal ^ (1ULL << 63)));
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT32:
+            reflection->SetUInt32(message, field_descriptor, (uint32_t)ordinal);
+            break;
+        case ::google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
+            reflection->SetUInt64(message, field_descriptor, ordinal);
+            break;
+        default:
+            break;
+    }
+}
+
+void TableSchema::appendUpsertClause(std::string &sql, const FieldList &columns) const {
+    sql.append(" ON DUPLICATE KEY UPDATE ");
+
+    bool first_column = true;
+    for (size_t i = 0; i < columns.size(); ++i) {
+        if (isPrimaryKey(columns[i])) {
+            continue;
+        }
+        if (first_column == false) {
+            sql.append(",");
+        }
+        first_column = false;
+        if (columns[i] != NULL) {
+            const std::string &name = quotedName(columns[i]);
+            sql.append(name).append("=VALUES(").append(name).append(")");
+        } else {
+            sql.append("`").append(blobColumn()).append("`=VALUES(`").append(blobColumn()).append("`)");
+        }
+    }
+
+    // Only key columns were given, keep the existing row as it is.
+    if (first_column && primary_key_.empty() == false) {
+        const std::string &name = quotedName(primary_key_[0]);
+        sql.append(name).append("=").append(name);
+    }
+}
+
+}  // namespace pmo
@@ -0,0 +1,123 @@
+#ifndef PMO_TABLE_SCHEMA_H
+#define PMO_TABLE_SCHEMA_H
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class Descriptor;
+class FieldDescriptor;
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+// Table level facts derived from a message's pmo_options.proto options,
+// built once per Descriptor.
+class TableSchema {
+public:
+    typedef std::vector<const google::protobuf::FieldDescriptor *> FieldList;
+
+    static const TableSchema *get(const google::protobuf::Descriptor *descriptor);
+
+    const google::protobuf::Descriptor *descriptor() const { return descriptor_; }
+    const std::string &table() const;
+    // Identifiers quoted once up front for statement building: "`table`"
+    // and "`field`" of any field of the message.
+    const std::string &quotedTable() const { return quoted_table_; }
+    const std::string &quotedName(const google::protobuf::FieldDescriptor *field_descriptor) const;
+
+    // Fields stored in a column of their own, in declaration order. For
+    // blob storage tables only the key and index fields.
+    const FieldList &columns() const { return columns_; }
+    static bool isColumn(const google::protobuf::FieldDescriptor *field_descriptor);
+
+    // Resolves a projection such as "name, 3" to columns(), fields are
+    // given by name or number. Returns false on unknown fields and fields
+    // without a column of their own.
+    bool projection(const std::string &list, FieldList &fields) const;
+
+    // From (pmo.blob_storage): rows hold the serialized message in
+    // blobColumn() next to columns(), it is written and read as a whole.
+    bool blobStorage() const { return blob_storage_; }
+    static const char *blobColumn() { return "_pmo_data"; }
+
+    // From (pmo.primary_key) field options or (pmo.composite_primary_key).
+    const FieldList &primaryKey() const { return primary_key_; }
+    bool hasPrimaryKey() const { return primary_key_.empty() == false; }
+    bool isPrimaryKey(const google::protobuf::FieldDescriptor *field_descriptor) const;
+
+    // Whether exactly the primary key columns are set in |query|.
+    bool isKeyQuery(const google::protobuf::Message &query) const;
+
+    // Columns set in |message| that are unset in |baseline| or hold a
+    // different value. Columns cleared in |message| are not reported, save
+    // never writes absent fields either.
+    void changedColumns(const google::protobuf::Message &message,
+            const google::protobuf::Message &baseline, FieldList &changed) const;
+
+    // Encodes the primary key values of |message| into a string usable as a
+    // map key, returns false if the table has no key or a key field is unset.
+    bool keyOf(const google::protobuf::Message &message, std::string &key) const;
+    // New message of the type holding only the primary key fields set in
+    // |message|, e.g. the query load() would be given for its row.
+    google::protobuf::Message *newKeyMessage(const google::protobuf::Message &message) const;
+
+    // Value of one singular column field, compared, copied or encoded.
+    static bool sameValue(const google::protobuf::Message &message, const google::protobuf::Message &other,
+            const google::protobuf::FieldDescriptor *field_descriptor);
+    static void copyValue(const google::protobuf::Message &from, google::protobuf::Message *to,
+            const google::protobuf::FieldDescriptor *field_descriptor);
+    // Appends an unambiguous encoding of the value to |key|, returns false
+    // for floating point fields.
+    static bool appendKeyValue(const google::protobuf::Message &message,
+            const google::protobuf::FieldDescriptor *field_descriptor, std::string &key);
+    // Maps integer field values onto uint64_t keeping their order, so
+    // ranges of signed and unsigned keys are handled the same way. Returns
+    // false when the field is unset or no integer.
+    static bool ordinalOf(const google::protobuf::Message &message,
+            const google::protobuf::FieldDescriptor *field_descriptor, uint64_t &ordinal);
+    static void setOrdinal(google::protobuf::Message *message,
+            const google::protobuf::FieldDescriptor *field_descriptor, uint64_t ordinal);
+
+    // Stored procedures emitted by protoc --mysql_out, loadProcedure() is
+    // empty for tables without a primary key.
+    const std::string &saveProcedure() const { return save_procedure_; }
+    const std::string &loadProcedure() const { return load_procedure_; }
+
+    // Appends " ON DUPLICATE KEY UPDATE ..." assigning every non key
+    // column of an INSERT over |columns|, a NULL entry stands for
+    // blobColumn().
+    void appendUpsertClause(std::string &sql, const FieldList &columns) const;
+
+private:
+    explicit TableSchema(const google::protobuf::Descriptor *descriptor);
+
+    // Resolves a "a, b" column list of a composite key option.
+    static void parseColumnList(const google::protobuf::Descriptor *descriptor, const std::string &list,
+            FieldList &fields);
+    bool isIndexed(const google::protobuf::FieldDescriptor *field_descriptor) const;
+
+    const google::protobuf::Descriptor *descriptor_;
+    bool blob_storage_;
+    FieldList columns_;
+    FieldList primary_key_;
+    // Fields of the primary, unique and secondary keys.
+    FieldList indexed_;
+    std::string quoted_table_;
+    // Indexed by FieldDescriptor::index().
+    std::vector<std::string> quoted_names_;
+    std::string save_procedure_;
+    std::string load_procedure_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_TABLE_SCHEMA_H
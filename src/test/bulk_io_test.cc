@@ -0,0 +1,185 @@
+// LOAD DATA row encoding and the delimited message stream, no server is
+// needed.
+
+#include <sstream>
+#include <string>
+
+#include <mysql.h>
+#include <google/protobuf/message.h>
+
+#include "bulk_io.h"
+#include "pb_orm_test.pb.h"
+#include "table_schema.h"
+#include "test_common.h"
+
+namespace pmo {
+namespace test {
+
+// Reverses LOAD DATA's default ESCAPED BY '\\' on one field.
+static std::string unescape(const std::string &field) {
+    std::string out;
+    for (size_t i = 0; i < field.size(); ++i) {
+        if (field[i] != '\\' || i + 1 == field.size()) {
+            out.push_back(field[i]);
+            continue;
+        }
+        switch (field[++i]) {
+            case 't': out.push_back('\t'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case '0': out.push_back('\0'); break;
+            default: out.push_back(field[i]); break;
+        }
+    }
+    return out;
+}
+
+static std::string encodedRow(const ::google::protobuf::Message &message) {
+    std::string row;
+    InfileStream::appendRow(row, TableSchema::get(message.GetDescriptor()), message);
+    return row;
+}
+
+static void testRowEscaping() {
+    tutorial::PbOrmTest message;
+    message.set_id(5);
+    message.set_name(std::string("a\tb\\c\nd\re\0f", 11));
+    message.set_type(3);
+    message.set_value2("\\N");
+
+    // Unset value1 is NULL, a literal \N string is escaped.
+    PMO_CHECK_EQ(std::string("5\ta\\tb\\\\c\\nd\\re\\0f\t3\t\\N\t\\\\N\n"), encodedRow(message));
+    PMO_CHECK_EQ(message.name(), unescape("a\\tb\\\\c\\nd\\re\\0f"));
+}
+
+// The serialized message of a blob storage row comes back intact.
+static void testBlobRow() {
+    tutorial::PbOrmBlobTest message;
+    message.set_id(10);
+    message.add_items()->set_id(9);
+    message.mutable_items(0)->set_count(13);
+    message.mutable_detail()->set_id(10);
+    message.mutable_detail()->set_value2(std::string("\t\n\r\0\\", 5));
+
+    std::string row = encodedRow(message);
+    PMO_CHECK(row.size() > 1 && row[row.size() - 1] == '\n');
+    // Escaping leaves no raw separator inside a field.
+    std::string body = row.substr(0, row.size() - 1);
+    PMO_CHECK(body.find('\n') == std::string::npos);
+
+    size_t first = body.find('\t');
+    size_t second = body.find('\t', first + 1);
+    PMO_CHECK(first != std::string::npos && second != std::string::npos);
+    if (first == std::string::npos || second == std::string::npos) {
+        return;
+    }
+    PMO_CHECK_EQ(std::string("10"), body.substr(0, first));
+    PMO_CHECK_EQ(std::string("\\N"), body.substr(first + 1, second - first - 1));
+    PMO_CHECK(body.find('\t', second + 1) == std::string::npos);
+
+    tutorial::PbOrmBlobTest decoded;
+    PMO_CHECK(decoded.ParseFromString(unescape(body.substr(second + 1))));
+    PMO_CHECK_EQ(message.DebugString(), decoded.DebugString());
+}
+
+static void testStatement() {
+    InfileStream stream(TableSchema::get(tutorial::PbOrmTest::descriptor()),
+        [](const ::google::protobuf::Message *&message) {
+            message = NULL;
+            return true;
+        });
+    std::string sql;
+    stream.appendStatement(sql);
+    PMO_CHECK_EQ((size_t)0, sql.find("LOAD DATA LOCAL INFILE 'pmo' REPLACE INTO TABLE "));
+    std::string columns(" CHARACTER SET binary (`id`,`name`,`type`,`value1`,`value2`)");
+    PMO_CHECK(sql.size() > columns.size() && sql.compare(sql.size() - columns.size(), columns.size(), columns) == 0);
+
+    InfileStream blob(TableSchema::get(tutorial::PbOrmBlobTest::descriptor()),
+        [](const ::google::protobuf::Message *&message) {
+            message = NULL;
+            return true;
+        });
+    sql.clear();
+    blob.appendStatement(sql);
+    columns = " CHARACTER SET binary (`id`,`type`,`_pmo_data`)";
+    PMO_CHECK(sql.size() > columns.size() && sql.compare(sql.size() - columns.size(), columns.size(), columns) == 0);
+    PMO_CHECK(stream.failed() == false);
+}
+
+static std::string writeMessages(int count) {
+    std::ostringstream output;
+    {
+        DelimitedWriter writer(output);
+        tutorial::PbOrmTest message;
+        for (int i = 0; i < count; ++i) {
+            message.set_id(i + 1);
+            message.set_name(std::string("row\0\n", 5));
+            message.set_value1(i * 1000);
+            PMO_CHECK(writer.write(message));
+        }
+        PMO_CHECK(writer.flush());
+    }
+    return output.str();
+}
+
+static void testDelimitedRoundTrip() {
+    std::istringstream input(writeMessages(300));
+    DelimitedReader reader(input, tutorial::PbOrmTest::default_instance());
+    MessageSource source = reader.source();
+
+    int count = 0;
+    const ::google::protobuf::Message *message = NULL;
+    while (source(message) && message != NULL) {
+        const tutorial::PbOrmTest &row = static_cast<const tutorial::PbOrmTest &>(*message);
+        PMO_CHECK_EQ((uint64_t)(count + 1), (uint64_t)row.id());
+        PMO_CHECK_EQ(std::string("row\0\n", 5), row.name());
+        PMO_CHECK_EQ((uint32_t)(count * 1000), row.value1());
+        ++count;
+    }
+    PMO_CHECK_EQ(300, count);
+    PMO_CHECK(message == NULL);
+    PMO_CHECK(reader.failed() == false);
+}
+
+static void testEmptyStream() {
+    std::istringstream input("");
+    DelimitedReader reader(input, tutorial::PbOrmTest::default_instance());
+    PMO_CHECK(reader.next() == NULL);
+    PMO_CHECK(reader.failed() == false);
+}
+
+// A record cut short fails the source instead of ending it, so an import
+// of a damaged file is not committed.
+static void testTruncatedRecord() {
+    std::string data = writeMessages(2);
+
+    std::istringstream body(data.substr(0, data.size() - 2));
+    DelimitedReader body_reader(body, tutorial::PbOrmTest::default_instance());
+    MessageSource source = body_reader.source();
+    const ::google::protobuf::Message *message = NULL;
+    PMO_CHECK(source(message) && message != NULL);
+    PMO_CHECK(source(message) == false);
+    PMO_CHECK(message == NULL);
+    PMO_CHECK(body_reader.failed());
+
+    // A size varint missing its last byte.
+    std::istringstream size(data + std::string(1, '\x80'));
+    DelimitedReader size_reader(size, tutorial::PbOrmTest::default_instance());
+    PMO_CHECK(size_reader.next() != NULL);
+    PMO_CHECK(size_reader.next() != NULL);
+    PMO_CHECK(size_reader.next() == NULL);
+    PMO_CHECK(size_reader.failed());
+}
+
+}  // namespace test
+}  // namespace pmo
+
+int main() {
+    PMO_RUN(pmo::test::testRowEscaping);
+    PMO_RUN(pmo::test::testBlobRow);
+    PMO_RUN(pmo::test::testStatement);
+    PMO_RUN(pmo::test::testDelimitedRoundTrip);
+    PMO_RUN(pmo::test::testEmptyStream);
+    PMO_RUN(pmo::test::testTruncatedRecord);
+    return pmo::test::finish();
+}
@@ -0,0 +1,13 @@
+cd `dirname $0`/..
+protoc --cpp_out=. pmo_options.proto
+protoc --cpp_out=. pb_orm_test.proto
+LIB_SRCS="storage.cc query.cc parallel_loader.cc connection_pool.cc prepared_statement.cc row_decoder.cc message_orm.cc sql_builder.cc table_schema.cc load_cache.cc bulk_io.cc transaction.cc snapshot_tracker.cc metrics.cc write_behind.cc pmo_options.pb.cc pb_orm_test.pb.cc"
+LIBS="-lmysqlclient -lprotobuf -lpthread -L/home/taohan/open_src/protobuf/protobuf-2.6.1/src/.libs -L/usr/local/mysql/lib"
+# Self-checking, none of them needs a server. Each exits non-zero on a failed check.
+TESTS="row_decoder_test sql_builder_test bulk_io_test write_behind_test storage_test"
+for test in $TESTS; do
+    g++ -g -std=c++11 -I. -Itest -o test/$test test/$test.cc bench/bench_common.cc $LIB_SRCS $LIBS || exit 1
+done
+for test in $TESTS; do
+    ./test/$test || exit 1
+done
@@ -0,0 +1,184 @@
+// RowDecoder against synthetic text protocol rows, no server is needed.
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <mysql.h>
+#include <string.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "bench/bench_common.h"
+#include "pb_orm_test.pb.h"
+#include "row_decoder.h"
+#include "table_schema.h"
+#include "test_common.h"
+
+namespace pmo {
+namespace test {
+
+static std::vector<std::string> fieldNames(const ::google::protobuf::Descriptor *descriptor) {
+    std::vector<std::string> names;
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        names.push_back(descriptor->field(i)->name());
+    }
+    return names;
+}
+
+// Every field type of the bench table decodes to the value it was
+// formatted from.
+static void testDecodeRows() {
+    bench::BenchTable table(12, 20);
+    bench::SyntheticResult result(table, 50);
+    RowDecoder decoder(table.descriptor(), fieldNames(table.descriptor()));
+    PMO_CHECK_EQ((size_t)table.descriptor()->field_count(), decoder.columnCount());
+
+    std::unique_ptr< ::google::protobuf::Message> decoded(table.newMessage());
+    std::unique_ptr< ::google::protobuf::Message> expected(table.newMessage());
+    for (size_t i = 0; i < result.rows(); ++i) {
+        decoded->Clear();
+        decoder.decode(result.row(i), result.lengths(i), decoded.get());
+        table.fill(expected.get(), i + 1);
+        PMO_CHECK_EQ(expected->DebugString(), decoded->DebugString());
+    }
+}
+
+static void testNullCellsStayUnset() {
+    bench::BenchTable table(6, 8);
+    bench::SyntheticResult result(table, 1);
+    RowDecoder decoder(table.descriptor(), fieldNames(table.descriptor()));
+
+    std::vector<char *> cells(result.row(0), result.row(0) + table.descriptor()->field_count());
+    cells[2] = NULL;
+    std::unique_ptr< ::google::protobuf::Message> message(table.newMessage());
+    decoder.decode(&cells[0], result.lengths(0), message.get());
+
+    const ::google::protobuf::Reflection *reflection = message->GetReflection();
+    for (int i = 0; i < table.descriptor()->field_count(); ++i) {
+        PMO_CHECK_EQ(i != 2, reflection->HasField(*message, table.descriptor()->field(i)));
+    }
+}
+
+static void testStringsKeepNul() {
+    std::vector<std::string> names;
+    names.push_back("id");
+    names.push_back("value2");
+    RowDecoder decoder(tutorial::PbOrmTest::descriptor(), names);
+
+    std::string id("7");
+    std::string value("a\0b\0", 4);
+    char *cells[] = { &id[0], &value[0] };
+    unsigned long lengths[] = { id.size(), value.size() };
+
+    tutorial::PbOrmTest message;
+    PMO_CHECK(decoder.decode(cells, lengths, &message));
+    PMO_CHECK_EQ((uint64_t)7, (uint64_t)message.id());
+    PMO_CHECK_EQ(value, message.value2());
+}
+
+static void testUnknownColumnsIgnored() {
+    std::vector<std::string> names;
+    names.push_back("id");
+    names.push_back("not_a_field");
+    names.push_back("value1");
+    RowDecoder decoder(tutorial::PbOrmTest::descriptor(), names);
+
+    std::string id("3");
+    std::string unknown("x");
+    std::string value1("4000000000");
+    char *cells[] = { &id[0], &unknown[0], &value1[0] };
+    unsigned long lengths[] = { id.size(), unknown.size(), value1.size() };
+
+    tutorial::PbOrmTest message;
+    decoder.decode(cells, lengths, &message);
+    PMO_CHECK_EQ((uint64_t)3, (uint64_t)message.id());
+    PMO_CHECK_EQ(4000000000u, message.value1());
+    PMO_CHECK(message.has_name() == false);
+}
+
+// The blob column holds the whole message, the key columns are copies.
+static void testBlobColumn() {
+    tutorial::PbOrmBlobTest expected;
+    expected.set_id(9);
+    expected.set_type(2);
+    expected.add_items()->set_id(1);
+    expected.mutable_items(0)->set_count(5);
+    expected.mutable_detail()->set_id(9);
+    expected.mutable_detail()->set_value2(std::string("\0'\\", 3));
+
+    std::vector<std::string> names;
+    names.push_back("id");
+    names.push_back("type");
+    names.push_back(TableSchema::blobColumn());
+    RowDecoder decoder(tutorial::PbOrmBlobTest::descriptor(), names);
+
+    std::string id("9");
+    std::string type("2");
+    std::string data = expected.SerializeAsString();
+    char *cells[] = { &id[0], &type[0], &data[0] };
+    unsigned long lengths[] = { id.size(), type.size(), data.size() };
+
+    tutorial::PbOrmBlobTest message;
+    PMO_CHECK(decoder.decode(cells, lengths, &message));
+    PMO_CHECK_EQ(expected.DebugString(), message.DebugString());
+}
+
+// A blob that does not parse fails the row instead of leaving a half
+// filled message.
+static void testBadBlobFails() {
+    std::vector<std::string> names;
+    names.push_back("id");
+    names.push_back(TableSchema::blobColumn());
+    RowDecoder decoder(tutorial::PbOrmBlobTest::descriptor(), names);
+
+    std::string id("9");
+    // Field 1 as a length delimited value running past the end.
+    std::string data("\x0a\x05" "ab", 4);
+    char *cells[] = { &id[0], &data[0] };
+    unsigned long lengths[] = { id.size(), data.size() };
+
+    tutorial::PbOrmBlobTest message;
+    PMO_CHECK(decoder.decode(cells, lengths, &message) == false);
+}
+
+// Plans are shared per (type, column layout).
+static void testGetCachesPerLayout() {
+    char id[] = "id";
+    char value1[] = "value1";
+    char value2[] = "value2";
+    MYSQL_FIELD fields[2];
+    memset(fields, 0, sizeof(fields));
+    fields[0].name = id;
+    fields[1].name = value1;
+
+    const ::google::protobuf::Descriptor *descriptor = tutorial::PbOrmTest::descriptor();
+    const RowDecoder *first = RowDecoder::get(descriptor, fields, 2);
+    PMO_CHECK(first != NULL);
+    PMO_CHECK(first == RowDecoder::get(descriptor, fields, 2));
+    PMO_CHECK(first->matches(fields, 2));
+    PMO_CHECK(first->matches(fields, 1) == false);
+
+    fields[1].name = value2;
+    const RowDecoder *second = RowDecoder::get(descriptor, fields, 2);
+    PMO_CHECK(second != first);
+    PMO_CHECK(first->matches(fields, 2) == false);
+    PMO_CHECK(second == RowDecoder::get(descriptor, fields, 2));
+
+    const RowDecoder *blob = RowDecoder::get(tutorial::PbOrmBlobTest::descriptor(), fields, 2);
+    PMO_CHECK(blob != second);
+}
+
+}  // namespace test
+}  // namespace pmo
+
+int main() {
+    PMO_RUN(pmo::test::testDecodeRows);
+    PMO_RUN(pmo::test::testNullCellsStayUnset);
+    PMO_RUN(pmo::test::testStringsKeepNul);
+    PMO_RUN(pmo::test::testUnknownColumnsIgnored);
+    PMO_RUN(pmo::test::testBlobColumn);
+    PMO_RUN(pmo::test::testBadBlobFails);
+    PMO_RUN(pmo::test::testGetCachesPerLayout);
+    return pmo::test::finish();
+}
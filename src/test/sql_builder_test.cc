@@ -0,0 +1,162 @@
+// SqlBuilder literals and escaping, no server is needed.
+
+#include <limits>
+#include <string>
+
+#include <mysql.h>
+#include <stdlib.h>
+#include <google/protobuf/descriptor.h>
+
+#include "pb_orm_test.pb.h"
+#include "sql_builder.h"
+#include "test_common.h"
+
+namespace pmo {
+namespace test {
+
+// What mysql_real_escape_string() produces for ASCII compatible charsets.
+static std::string referenceQuoted(const std::string &value) {
+    std::string out("'");
+    for (size_t i = 0; i < value.size(); ++i) {
+        switch (value[i]) {
+            case '\0': out += "\\0"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\\': out += "\\\\"; break;
+            case '\'': out += "\\'"; break;
+            case '"': out += "\\\""; break;
+            case '\032': out += "\\Z"; break;
+            default: out.push_back(value[i]); break;
+        }
+    }
+    out.push_back('\'');
+    return out;
+}
+
+static std::string quoted(const std::string &value) {
+    SqlBuilder sql;
+    sql.appendQuoted(value);
+    return sql.str();
+}
+
+static void testEscapeSpecialBytes() {
+    PMO_CHECK_EQ(std::string("''"), quoted(""));
+    PMO_CHECK_EQ(std::string("'plain'"), quoted("plain"));
+    PMO_CHECK_EQ(std::string("'it\\'s'"), quoted("it's"));
+    PMO_CHECK_EQ(std::string("'a\\\\b'"), quoted("a\\b"));
+    PMO_CHECK_EQ(std::string("'\\\"\\n\\r\\Z'"), quoted("\"\n\r\032"));
+    PMO_CHECK_EQ(std::string("'a\\0b'"), quoted(std::string("a\0b", 3)));
+    // Bytes above 0x7f are copied, utf8 text included.
+    PMO_CHECK_EQ(std::string("'\xe4\xbd\xa0\xff'"), quoted("\xe4\xbd\xa0\xff"));
+}
+
+// Special bytes at every offset of strings longer than one vector scan,
+// so both the bulk and the tail loop meet them.
+static void testEscapeMatchesReference() {
+    const char specials[] = { '\0', '\n', '\r', '\\', '\'', '"', '\032' };
+    for (size_t length = 1; length <= 70; ++length) {
+        for (size_t position = 0; position < length; ++position) {
+            std::string value(length, 'x');
+            value[position] = specials[(length + position) % sizeof(specials)];
+            PMO_CHECK_EQ(referenceQuoted(value), quoted(value));
+        }
+    }
+
+    srand(7);
+    for (int i = 0; i < 2000; ++i) {
+        std::string value(rand() % 100, '\0');
+        for (size_t j = 0; j < value.size(); ++j) {
+            value[j] = (char)(rand() % 4 == 0 ? specials[rand() % sizeof(specials)] : rand() % 256);
+        }
+        PMO_CHECK_EQ(referenceQuoted(value), quoted(value));
+    }
+}
+
+static void testFreeFunctionsMatchBuilder() {
+    std::string value("o'neil\\ \n");
+    std::string sql;
+    appendQuoted(sql, NULL, value);
+    PMO_CHECK_EQ(quoted(value), sql);
+}
+
+// sql_mode NO_BACKSLASH_ESCAPES as reported by the server: quotes are
+// doubled and backslashes are plain characters.
+static void testNoBackslashEscapes() {
+    MYSQL *mysql = ::mysql_init(NULL);
+    PMO_CHECK(mysql != NULL);
+    if (mysql == NULL) {
+        return;
+    }
+    PMO_CHECK_EQ((int)SqlBuilder::ESCAPE_BACKSLASH, (int)SqlBuilder::escapingOf(mysql));
+
+    mysql->server_status |= SERVER_STATUS_NO_BACKSLASH_ESCAPES;
+    SqlBuilder sql(mysql);
+    PMO_CHECK_EQ((int)SqlBuilder::ESCAPE_QUOTES, (int)sql.escaping());
+    sql.appendQuoted(std::string("it's a\\b ''"));
+    PMO_CHECK_EQ(std::string("'it''s a\\b '''''"), sql.str());
+
+    // reset() picks the mode up again.
+    sql.reset(NULL);
+    PMO_CHECK_EQ((int)SqlBuilder::ESCAPE_BACKSLASH, (int)sql.escaping());
+    PMO_CHECK(sql.str().empty());
+    ::mysql_close(mysql);
+}
+
+static void testNumbers() {
+    SqlBuilder sql;
+    sql.appendNumber(std::numeric_limits<int32_t>::min());
+    sql.append(',');
+    sql.appendNumber(std::numeric_limits<int64_t>::min());
+    sql.append(',');
+    sql.appendNumber(std::numeric_limits<uint64_t>::max());
+    sql.append(',');
+    sql.appendNumber((uint32_t)0);
+    sql.append(',');
+    sql.appendNumber((int32_t)-7);
+    sql.append(',');
+    sql.appendNumber(3.0);
+    sql.append(',');
+    sql.appendNumber(0.5);
+    sql.append(',');
+    sql.appendNumber(-0.0);
+    sql.append(',');
+    sql.appendNumber(0.1f);
+    sql.append(',');
+    sql.appendBool(true);
+    PMO_CHECK_EQ(std::string("-2147483648,-9223372036854775808,18446744073709551615,0,-7,3,0.5,-0,"
+            "0.100000001,1"), sql.str());
+
+    // Integral values beyond 2^53 keep the floating point form.
+    SqlBuilder large;
+    large.appendNumber(1e20);
+    PMO_CHECK_EQ(std::string("1e+20"), large.str());
+}
+
+static void testAppendValue() {
+    tutorial::PbOrmTest message;
+    message.set_id(18446744073709551615ULL);
+    message.set_value1(42);
+    message.set_name("a'b");
+
+    const ::google::protobuf::Descriptor *descriptor = message.GetDescriptor();
+    SqlBuilder sql;
+    PMO_CHECK(sql.appendValue(message, descriptor->FindFieldByName("id")));
+    sql.append(',');
+    PMO_CHECK(sql.appendValue(message, descriptor->FindFieldByName("value1")));
+    sql.append(',');
+    PMO_CHECK(sql.appendValue(message, descriptor->FindFieldByName("name")));
+    PMO_CHECK_EQ(std::string("18446744073709551615,42,'a\\'b'"), sql.str());
+}
+
+}  // namespace test
+}  // namespace pmo
+
+int main() {
+    PMO_RUN(pmo::test::testEscapeSpecialBytes);
+    PMO_RUN(pmo::test::testEscapeMatchesReference);
+    PMO_RUN(pmo::test::testFreeFunctionsMatchBuilder);
+    PMO_RUN(pmo::test::testNoBackslashEscapes);
+    PMO_RUN(pmo::test::testNumbers);
+    PMO_RUN(pmo::test::testAppendValue);
+    return pmo::test::finish();
+}
@@ -0,0 +1,542 @@
+// Storage statement builders, no server is needed.
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <mysql.h>
+#include <google/protobuf/message.h>
+
+#include "load_cache.h"
+#include "pb_orm_test.pb.h"
+#include "query.h"
+#include "snapshot_tracker.h"
+#include "sql_builder.h"
+#include "storage.h"
+#include "table_schema.h"
+#include "test_common.h"
+
+namespace pmo {
+
+// Reaches the private builders of Storage.
+class StorageTest {
+public:
+    static bool buildSaveRows(SqlBuilder &sql, const std::vector<const ::google::protobuf::Message *> &rows,
+            size_t max_statement_size, const Storage::StatementSink &execute) {
+        return Storage::buildSaveRows(sql, rows, max_statement_size, execute);
+    }
+
+    static bool buildKeySelect(SqlBuilder &sql, const std::vector<const ::google::protobuf::Message *> &keys,
+            const std::vector<size_t> &pending, size_t begin, size_t max_statement_size, size_t &end) {
+        return Storage::buildKeySelect(sql, keys, pending, begin, max_statement_size, end);
+    }
+
+    static bool buildSelect(SqlBuilder &sql, const Query &query) {
+        return Storage::buildSelect(sql, NULL, query);
+    }
+
+    static bool buildUpdate(SqlBuilder &sql, const ::google::protobuf::Message &message,
+            const TableSchema::FieldList &columns) {
+        return Storage::buildUpdate(sql, message, columns);
+    }
+};
+
+namespace test {
+
+// Statements passed to the sink of buildSaveRows().
+static std::vector<std::string> saveStatements(const std::vector<const ::google::protobuf::Message *> &rows,
+        size_t max_statement_size) {
+    std::vector<std::string> statements;
+    SqlBuilder sql;
+    bool ok = StorageTest::buildSaveRows(sql, rows, max_statement_size, [&statements](const std::string &statement) {
+        statements.push_back(statement);
+        return true;
+    });
+    PMO_CHECK(ok);
+    return statements;
+}
+
+// A pool that never gets a connection: nothing listens on port 1.
+static ConnectionPoolOptions unreachable() {
+    ConnectionPoolOptions options;
+    options.host = "127.0.0.1";
+    options.port = 1;
+    options.min_size = 0;
+    options.max_size = 1;
+    options.checkout_timeout_ms = 0;
+    return options;
+}
+
+static bool startsWith(const std::string &str, const std::string &prefix) {
+    return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+static bool endsWith(const std::string &str, const std::string &suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static void testSaveRowsOneStatement() {
+    tutorial::PbOrmTest first;
+    first.set_id(1);
+    first.set_value1(10);
+    tutorial::PbOrmTest second;
+    second.set_id(2);
+    second.set_value1(20);
+    std::vector<const ::google::protobuf::Message *> rows;
+    rows.push_back(&first);
+    rows.push_back(&second);
+
+    std::vector<std::string> statements = saveStatements(rows, 1024 * 1024);
+    PMO_CHECK_EQ((size_t)1, statements.size());
+    if (statements.size() == 1) {
+        PMO_CHECK_EQ(std::string("INSERT INTO `pmo.tutorial.PbOrmTest` (`id`,`value1`) VALUES (1,10),(2,20)"
+                " ON DUPLICATE KEY UPDATE `value1`=VALUES(`value1`)"), statements[0]);
+    }
+}
+
+// Rows are split over statements below the limit, in order, none lost
+// or repeated.
+static void testSaveRowsBoundedByPacket() {
+    const std::string head("INSERT INTO `pmo.tutorial.PbOrmTest` (`id`,`value2`) VALUES ");
+    const std::string tail(" ON DUPLICATE KEY UPDATE `value2`=VALUES(`value2`)");
+    const size_t max_statement_size = 1000;
+
+    std::vector<tutorial::PbOrmTest> messages(200);
+    std::vector<const ::google::protobuf::Message *> rows;
+    std::string expected_values;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        messages[i].set_id(i + 1);
+        messages[i].set_value2(std::string(i % 37, 'v'));
+        rows.push_back(&messages[i]);
+        expected_values += (i == 0 ? "(" : ",(") + std::to_string(i + 1) + ",'" + messages[i].value2() + "')";
+    }
+
+    std::vector<std::string> statements = saveStatements(rows, max_statement_size);
+    PMO_CHECK(statements.size() > 1);
+
+    std::string values;
+    for (size_t i = 0; i < statements.size(); ++i) {
+        const std::string &statement = statements[i];
+        PMO_CHECK(statement.size() <= max_statement_size);
+        PMO_CHECK(startsWith(statement, head));
+        PMO_CHECK(endsWith(statement, tail));
+        if (statement.size() < head.size() + tail.size()) {
+            continue;
+        }
+        values += (i == 0 ? "" : ",") + statement.substr(head.size(), statement.size() - head.size() - tail.size());
+    }
+    PMO_CHECK_EQ(expected_values, values);
+}
+
+// A row larger than the limit goes out alone rather than being dropped.
+static void testSaveRowsOversizedRow() {
+    std::vector<tutorial::PbOrmTest> messages(3);
+    std::vector<const ::google::protobuf::Message *> rows;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        messages[i].set_id(i + 1);
+        messages[i].set_value2(i == 1 ? std::string(500, 'x') : std::string("y"));
+        rows.push_back(&messages[i]);
+    }
+
+    std::vector<std::string> statements = saveStatements(rows, 200);
+    PMO_CHECK_EQ((size_t)3, statements.size());
+    for (size_t i = 0; i < statements.size(); ++i) {
+        PMO_CHECK(statements[i].find("VALUES (" + std::to_string(i + 1) + ",") != std::string::npos);
+    }
+}
+
+// A failing statement stops the batch.
+static void testSaveRowsStopsOnFailure() {
+    std::vector<tutorial::PbOrmTest> messages(50);
+    std::vector<const ::google::protobuf::Message *> rows;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        messages[i].set_id(i + 1);
+        rows.push_back(&messages[i]);
+    }
+
+    size_t calls = 0;
+    SqlBuilder sql;
+    bool ok = StorageTest::buildSaveRows(sql, rows, 100, [&calls](const std::string &) {
+        ++calls;
+        return false;
+    });
+    PMO_CHECK(ok == false);
+    PMO_CHECK_EQ((size_t)1, calls);
+}
+
+// SELECT statements of all |pending| keys, chunk by chunk.
+static std::vector<std::string> keyStatements(const std::vector<const ::google::protobuf::Message *> &keys,
+        const std::vector<size_t> &pending, size_t max_statement_size) {
+    std::vector<std::string> statements;
+    size_t begin = 0;
+    while (begin < pending.size()) {
+        SqlBuilder sql;
+        size_t end = begin;
+        PMO_CHECK(StorageTest::buildKeySelect(sql, keys, pending, begin, max_statement_size, end));
+        PMO_CHECK(end > begin);
+        if (end <= begin) {
+            break;
+        }
+        statements.push_back(sql.str());
+        begin = end;
+    }
+    return statements;
+}
+
+static void testKeySelect() {
+    std::vector<tutorial::PbOrmTest> messages(3);
+    std::vector<const ::google::protobuf::Message *> keys;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        messages[i].set_id(10 + i);
+        keys.push_back(&messages[i]);
+    }
+    std::vector<size_t> pending;
+    pending.push_back(2);
+    pending.push_back(0);
+
+    std::vector<std::string> statements = keyStatements(keys, pending, 1024 * 1024);
+    PMO_CHECK_EQ((size_t)1, statements.size());
+    if (statements.size() == 1) {
+        PMO_CHECK_EQ(std::string("SELECT * FROM `pmo.tutorial.PbOrmTest` WHERE `id` IN (12,10)"), statements[0]);
+    }
+
+    tutorial::PbOrmBlobTest blob;
+    blob.set_id(4);
+    keys.assign(1, &blob);
+    pending.assign(1, 0);
+    statements = keyStatements(keys, pending, 1024 * 1024);
+    PMO_CHECK_EQ((size_t)1, statements.size());
+    if (statements.size() == 1) {
+        PMO_CHECK_EQ(std::string("SELECT `_pmo_data` FROM `pmo.tutorial.PbOrmBlobTest` WHERE `id` IN (4)"),
+            statements[0]);
+    }
+}
+
+// Chunks hold at most kLoadManyChunkSize keys and stay below the limit,
+// every key is asked for once.
+static void testKeySelectChunks() {
+    const std::string head("SELECT * FROM `pmo.tutorial.PbOrmTest` WHERE `id` IN (");
+    std::vector<tutorial::PbOrmTest> messages(1234);
+    std::vector<const ::google::protobuf::Message *> keys;
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        messages[i].set_id(1000000 + i);
+        keys.push_back(&messages[i]);
+        pending.push_back(i);
+    }
+
+    const size_t limits[] = { 1024 * 1024, 2000, 100 };
+    for (size_t l = 0; l < sizeof(limits) / sizeof(limits[0]); ++l) {
+        std::vector<std::string> statements = keyStatements(keys, pending, limits[l]);
+        std::string ids;
+        for (size_t i = 0; i < statements.size(); ++i) {
+            const std::string &statement = statements[i];
+            PMO_CHECK(statement.size() <= limits[l]);
+            PMO_CHECK(startsWith(statement, head));
+            PMO_CHECK(endsWith(statement, ")"));
+            if (statement.size() <= head.size()) {
+                continue;
+            }
+            std::string list = statement.substr(head.size(), statement.size() - head.size() - 1);
+            PMO_CHECK((size_t)std::count(list.begin(), list.end(), ',') + 1 <= Storage::kLoadManyChunkSize);
+            ids += (i == 0 ? "" : ",") + list;
+        }
+
+        std::string expected;
+        for (size_t i = 0; i < messages.size(); ++i) {
+            expected += (i == 0 ? "" : ",") + std::to_string(messages[i].id());
+        }
+        PMO_CHECK_EQ(expected, ids);
+    }
+    PMO_CHECK_EQ((size_t)3, keyStatements(keys, pending, 1024 * 1024).size());
+}
+
+// Keys served by the cache, rows and known misses alike, never reach the
+// server. Indexes without a row are reported once per occurrence.
+static void testLoadManyMissingKeys() {
+    Storage storage(unreachable());
+    LoadCache cache;
+    storage.setCache(&cache);
+
+    const ::google::protobuf::Descriptor *descriptor = tutorial::PbOrmTest::descriptor();
+    tutorial::PbOrmTest row;
+    row.set_id(1);
+    row.set_value1(7);
+    tutorial::PbOrmTest key1;
+    key1.set_id(1);
+    tutorial::PbOrmTest key2;
+    key2.set_id(2);
+    cache.put(key1, std::vector< ::google::protobuf::Message *>(1, &row), cache.generation(descriptor));
+    cache.put(key2, std::vector< ::google::protobuf::Message *>(), cache.generation(descriptor));
+
+    std::vector<const ::google::protobuf::Message *> keys;
+    keys.push_back(&key1);
+    keys.push_back(&key2);
+    keys.push_back(&key1);
+    keys.push_back(&key2);
+
+    Storage::KeyedRows results;
+    std::vector<size_t> missing;
+    PMO_CHECK(storage.loadMany(keys, results, missing));
+    PMO_CHECK_EQ((uint64_t)0, storage.poolStats().checkouts);
+    PMO_CHECK_EQ((size_t)1, results.size());
+    if (results.size() == 1) {
+        PMO_CHECK_EQ(row.DebugString(), results.begin()->second->DebugString());
+    }
+    PMO_CHECK_EQ((size_t)2, missing.size());
+    if (missing.size() == 2) {
+        PMO_CHECK_EQ((size_t)1, missing[0]);
+        PMO_CHECK_EQ((size_t)3, missing[1]);
+    }
+    for (Storage::KeyedRows::iterator iter = results.begin(); iter != results.end(); ++iter) {
+        delete iter->second;
+    }
+    results.clear();
+    missing.clear();
+
+    // A key without its primary key fails the whole call.
+    tutorial::PbOrmTest incomplete;
+    incomplete.set_value1(1);
+    keys.push_back(&incomplete);
+    PMO_CHECK(storage.loadMany(keys, results, missing) == false);
+    PMO_CHECK_EQ((uint64_t)0, storage.poolStats().checkouts);
+    for (Storage::KeyedRows::iterator iter = results.begin(); iter != results.end(); ++iter) {
+        delete iter->second;
+    }
+}
+
+// The statement buildSelect() makes of |query|, empty when it fails.
+static std::string select(const Query &query) {
+    SqlBuilder sql;
+    if (StorageTest::buildSelect(sql, query) == false) {
+        return std::string();
+    }
+    return sql.str();
+}
+
+static void testSelectBounds() {
+    const std::string from("SELECT * FROM `pmo.tutorial.PbOrmTest`");
+    tutorial::PbOrmTest filter;
+    filter.set_type(2);
+    tutorial::PbOrmTest low;
+    low.set_value1(10);
+    tutorial::PbOrmTest high;
+    high.set_value1(20);
+
+    PMO_CHECK_EQ(from + " WHERE `type`=2", select(Query(filter)));
+    PMO_CHECK_EQ(from + " WHERE `type`=2 AND `value1`>=10 AND `value1`<20",
+        select(Query(filter).lowerBound(low).upperBound(high)));
+    PMO_CHECK_EQ(from + " WHERE `type`=2 AND `value1`>10 AND `value1`<=20",
+        select(Query(filter).lowerBound(low, false).upperBound(high, true)));
+    PMO_CHECK_EQ(from + " WHERE `value1`>=10", select(Query(tutorial::PbOrmTest()).lowerBound(low)));
+    PMO_CHECK_EQ(from + " WHERE `value1`<20", select(Query(tutorial::PbOrmTest()).upperBound(high)));
+
+    // Strings are quoted and escaped like equality values.
+    tutorial::PbOrmTest name;
+    name.set_name("o'k");
+    PMO_CHECK_EQ(from + " WHERE `name`>='o\\'k'", select(Query(tutorial::PbOrmTest()).lowerBound(name)));
+}
+
+// Inclusive bounds on both sides of a column become BETWEEN, columns
+// bounded on one side only keep their comparison.
+static void testSelectBetween() {
+    const std::string from("SELECT * FROM `pmo.tutorial.PbOrmTest`");
+    tutorial::PbOrmTest low;
+    low.set_value1(10);
+    low.set_type(1);
+    tutorial::PbOrmTest high;
+    high.set_value1(20);
+    high.set_id(99);
+
+    PMO_CHECK_EQ(from + " WHERE `id`<=99 AND `type`>=1 AND `value1` BETWEEN 10 AND 20",
+        select(Query(tutorial::PbOrmTest()).between(low, high)));
+    // Exclusive on either side is not BETWEEN.
+    PMO_CHECK_EQ(from + " WHERE `id`<99 AND `type`>=1 AND `value1`>=10 AND `value1`<20",
+        select(Query(tutorial::PbOrmTest()).lowerBound(low).upperBound(high)));
+    PMO_CHECK_EQ(from + " WHERE `id`<=99 AND `type`>1 AND `value1`>10 AND `value1`<=20",
+        select(Query(tutorial::PbOrmTest()).lowerBound(low, false).upperBound(high, true)));
+}
+
+// after() resumes past a key: > in ascending order, < in descending,
+// always with ORDER BY the key so pages do not overlap.
+static void testSelectKeysetPosition() {
+    const std::string from("SELECT * FROM `pmo.tutorial.PbOrmTest`");
+    tutorial::PbOrmTest last;
+    last.set_id(5);
+    last.set_name("row five");
+    last.set_value1(50);
+
+    PMO_CHECK_EQ(from + " WHERE `id`>5 ORDER BY `id` LIMIT 10",
+        select(Query(tutorial::PbOrmTest()).after(last).limit(10)));
+    PMO_CHECK_EQ(from + " WHERE `id`<5 ORDER BY `id` DESC LIMIT 10",
+        select(Query(tutorial::PbOrmTest()).orderByKey(true).after(last).limit(10)));
+
+    tutorial::PbOrmTest filter;
+    filter.set_type(3);
+    tutorial::PbOrmTest high;
+    high.set_value1(100);
+    PMO_CHECK_EQ(from + " WHERE `type`=3 AND `value1`<100 AND `id`>5 ORDER BY `id`",
+        select(Query(filter).upperBound(high).after(last)));
+
+    // The position is the key of the row, the row itself may go away.
+    Query query(filter);
+    {
+        tutorial::PbOrmTest row(last);
+        query.after(row);
+    }
+    PMO_CHECK_EQ(from + " WHERE `type`=3 AND `id`>5 ORDER BY `id`", select(query));
+}
+
+static void testSelectProjectionAndErrors() {
+    const ::google::protobuf::Descriptor *descriptor = tutorial::PbOrmTest::descriptor();
+    Query::FieldList fields;
+    fields.push_back(descriptor->FindFieldByName("id"));
+    fields.push_back(descriptor->FindFieldByName("value2"));
+    tutorial::PbOrmTest filter;
+    filter.set_type(1);
+    PMO_CHECK_EQ(std::string("SELECT `id`,`value2` FROM `pmo.tutorial.PbOrmTest` WHERE `type`=1"),
+        select(Query(filter).select(fields)));
+
+    Query::FieldList none;
+    PMO_CHECK_EQ(std::string(), select(Query(filter).select(none)));
+
+    // Blob storage rows can only be queried by their key columns.
+    tutorial::PbOrmBlobTest blob;
+    blob.set_type(2);
+    PMO_CHECK_EQ(std::string("SELECT `_pmo_data` FROM `pmo.tutorial.PbOrmBlobTest` WHERE `type`=2"),
+        select(Query(blob)));
+    tutorial::PbOrmBlobTest inside;
+    inside.mutable_detail()->set_id(1);
+    PMO_CHECK_EQ(std::string(), select(Query(blob).lowerBound(inside)));
+}
+
+// Names of the columns changedColumns() reports, comma separated.
+static std::string changed(const ::google::protobuf::Message &message, const ::google::protobuf::Message &baseline) {
+    TableSchema::FieldList columns;
+    TableSchema::get(message.GetDescriptor())->changedColumns(message, baseline, columns);
+    std::string names;
+    for (size_t i = 0; i < columns.size(); ++i) {
+        names += (i == 0 ? "" : ",") + columns[i]->name();
+    }
+    return names;
+}
+
+static void testChangedColumns() {
+    tutorial::PbOrmTest baseline;
+    baseline.set_id(1);
+    baseline.set_type(2);
+    baseline.set_value1(5);
+    baseline.set_value2("a");
+
+    PMO_CHECK_EQ(std::string(), changed(baseline, baseline));
+
+    tutorial::PbOrmTest message(baseline);
+    message.set_value1(6);
+    message.set_name("n");
+    // Cleared fields are not written, so they are not a change either.
+    message.clear_value2();
+    PMO_CHECK_EQ(std::string("name,value1"), changed(message, baseline));
+
+    // Same value, set again.
+    message.CopyFrom(baseline);
+    message.set_value2("a");
+    PMO_CHECK_EQ(std::string(), changed(message, baseline));
+    // Strings compare by bytes.
+    message.set_value2(std::string("a\0", 2));
+    PMO_CHECK_EQ(std::string("value2"), changed(message, baseline));
+
+    // Against an empty baseline every set column is new.
+    PMO_CHECK_EQ(std::string("id,type,value1,value2"), changed(baseline, tutorial::PbOrmTest()));
+}
+
+static void testBuildUpdate() {
+    tutorial::PbOrmTest message;
+    message.set_id(1);
+    message.set_name("it's");
+    message.set_value1(6);
+    const ::google::protobuf::Descriptor *descriptor = message.GetDescriptor();
+    TableSchema::FieldList columns;
+    columns.push_back(descriptor->FindFieldByName("name"));
+    columns.push_back(descriptor->FindFieldByName("value1"));
+
+    SqlBuilder sql;
+    PMO_CHECK(StorageTest::buildUpdate(sql, message, columns));
+    PMO_CHECK_EQ(std::string("UPDATE `pmo.tutorial.PbOrmTest` SET `name`='it\\'s', `value1`=6 WHERE `id`=1"),
+        sql.str());
+}
+
+// update() sends nothing when nothing changed, and falls back to a save
+// when the key is not set. The pool never connects, its checkout count
+// tells whether a statement was attempted.
+static void testUpdateSkipsUnchangedRows() {
+    Storage storage(unreachable());
+    tutorial::PbOrmTest baseline;
+    baseline.set_id(1);
+    baseline.set_value1(5);
+
+    tutorial::PbOrmTest message(baseline);
+    message.clear_value1();
+    PMO_CHECK(storage.update(message, baseline));
+    PMO_CHECK(storage.update(baseline, baseline));
+    PMO_CHECK_EQ((uint64_t)0, storage.poolStats().checkouts);
+
+    tutorial::PbOrmBlobTest blob;
+    blob.set_id(1);
+    blob.add_items()->set_id(2);
+    PMO_CHECK(storage.update(blob, blob));
+    PMO_CHECK_EQ((uint64_t)0, storage.poolStats().checkouts);
+
+    message.CopyFrom(baseline);
+    message.set_value1(6);
+    PMO_CHECK(storage.update(message, baseline) == false);
+    PMO_CHECK_EQ((uint64_t)1, storage.poolStats().checkouts);
+
+    // Without a key it can only be saved.
+    message.clear_id();
+    PMO_CHECK(storage.update(message, baseline) == false);
+    PMO_CHECK_EQ((uint64_t)2, storage.poolStats().checkouts);
+}
+
+// save() of a row the tracker knows unchanged is not sent either.
+static void testSaveSkipsTrackedRows() {
+    Storage storage(unreachable());
+    SnapshotTracker tracker;
+    storage.setSnapshotTracker(&tracker);
+
+    tutorial::PbOrmTest row;
+    row.set_id(1);
+    row.set_value1(5);
+    row.set_value2("x");
+    tracker.record(row);
+
+    PMO_CHECK(storage.save(row));
+    std::vector<const ::google::protobuf::Message *> rows(1, &row);
+    PMO_CHECK(storage.save(rows));
+    PMO_CHECK_EQ((uint64_t)0, storage.poolStats().checkouts);
+
+    row.set_value1(6);
+    PMO_CHECK(storage.save(row) == false);
+    PMO_CHECK_EQ((uint64_t)1, storage.poolStats().checkouts);
+}
+
+}  // namespace test
+}  // namespace pmo
+
+int main() {
+    PMO_RUN(pmo::test::testSaveRowsOneStatement);
+    PMO_RUN(pmo::test::testSaveRowsBoundedByPacket);
+    PMO_RUN(pmo::test::testSaveRowsOversizedRow);
+    PMO_RUN(pmo::test::testSaveRowsStopsOnFailure);
+    PMO_RUN(pmo::test::testKeySelect);
+    PMO_RUN(pmo::test::testKeySelectChunks);
+    PMO_RUN(pmo::test::testLoadManyMissingKeys);
+    PMO_RUN(pmo::test::testSelectBounds);
+    PMO_RUN(pmo::test::testSelectBetween);
+    PMO_RUN(pmo::test::testSelectKeysetPosition);
+    PMO_RUN(pmo::test::testSelectProjectionAndErrors);
+    PMO_RUN(pmo::test::testChangedColumns);
+    PMO_RUN(pmo::test::testBuildUpdate);
+    PMO_RUN(pmo::test::testUpdateSkipsUnchangedRows);
+    PMO_RUN(pmo::test::testSaveSkipsTrackedRows);
+    return pmo::test::finish();
+}
@@ -0,0 +1,63 @@
+#ifndef PMO_TEST_COMMON_H
+#define PMO_TEST_COMMON_H
+
+#include <sstream>
+#include <string>
+
+#include <stdio.h>
+
+namespace pmo {
+namespace test {
+
+// Failed checks of the running test binary, main() returns non-zero when
+// there were any.
+inline int &failures() {
+    static int count = 0;
+    return count;
+}
+
+template <typename Expected, typename Actual>
+void checkEqual(const Expected &expected, const Actual &actual, const char *text,
+        const char *file, int line) {
+    if (expected == actual) {
+        return;
+    }
+    std::ostringstream message;
+    message << file << ":" << line << ": " << text << "\n  expected: " << expected
+        << "\n  actual:   " << actual;
+    printf("%s\n", message.str().c_str());
+    ++failures();
+}
+
+// Runs |test| and reports it with the checks it failed.
+inline void run(const char *name, void (*test)()) {
+    int before = failures();
+    test();
+    printf("%-40s %s\n", name, failures() == before ? "ok" : "FAILED");
+}
+
+inline int finish() {
+    if (failures() != 0) {
+        printf("%d check(s) failed.\n", failures());
+        return 1;
+    }
+    return 0;
+}
+
+}  // namespace test
+}  // namespace pmo
+
+#define PMO_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            ++pmo::test::failures(); \
+        } \
+    } while (0)
+
+#define PMO_CHECK_EQ(expected, actual) \
+    pmo::test::checkEqual((expected), (actual), #actual, __FILE__, __LINE__)
+
+#define PMO_RUN(function) pmo::test::run(#function, function)
+
+#endif  // PMO_TEST_COMMON_H
@@ -0,0 +1,237 @@
+// WriteBehind queueing, coalescing and flush over a recording BatchWriter,
+// no server is needed.
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <google/protobuf/message.h>
+
+#include "pb_orm_test.pb.h"
+#include "test_common.h"
+#include "write_behind.h"
+
+namespace pmo {
+namespace test {
+
+// Keeps copies of every batch written.
+class RecordingWriter {
+public:
+    RecordingWriter() : ok_(true) {}
+
+    WriteBehind::BatchWriter writer() {
+        return [this](const std::vector<const ::google::protobuf::Message *> &messages) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            batches_.push_back(std::vector<std::shared_ptr< ::google::protobuf::Message> >());
+            for (size_t i = 0; i < messages.size(); ++i) {
+                batches_.back().push_back(std::shared_ptr< ::google::protobuf::Message>(messages[i]->New()));
+                batches_.back().back()->CopyFrom(*messages[i]);
+            }
+            return ok_.load();
+        };
+    }
+
+    void setOk(bool ok) { ok_ = ok; }
+
+    // Rows of every batch in write order.
+    std::vector<std::shared_ptr< ::google::protobuf::Message> > rows() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::shared_ptr< ::google::protobuf::Message> > rows;
+        for (size_t i = 0; i < batches_.size(); ++i) {
+            rows.insert(rows.end(), batches_[i].begin(), batches_[i].end());
+        }
+        return rows;
+    }
+
+private:
+    std::mutex mutex_;
+    std::atomic<bool> ok_;
+    std::vector<std::vector<std::shared_ptr< ::google::protobuf::Message> > > batches_;
+};
+
+// Nothing is written until flush().
+static WriteBehindOptions idleOptions() {
+    WriteBehindOptions options;
+    options.batch_size = 1000;
+    options.flush_interval_ms = 60000;
+    return options;
+}
+
+// Saves write only the fields they set, a coalesced save must keep the
+// columns of the one it joins.
+static void testCoalescePartialSaves() {
+    RecordingWriter recorder;
+    WriteBehind queue(recorder.writer(), idleOptions());
+
+    std::atomic<int> succeeded(0);
+    WriteBehind::Completion completion = [&succeeded](bool ok) {
+        if (ok) {
+            ++succeeded;
+        }
+    };
+
+    tutorial::PbOrmTest first;
+    first.set_id(1);
+    first.set_value1(5);
+    first.set_type(2);
+    PMO_CHECK(queue.save(first, completion));
+
+    tutorial::PbOrmTest second;
+    second.set_id(1);
+    second.set_value2("six");
+    second.set_type(3);
+    PMO_CHECK(queue.save(second, completion));
+    PMO_CHECK_EQ((uint64_t)1, queue.coalesced());
+
+    queue.flush();
+    std::vector<std::shared_ptr< ::google::protobuf::Message> > rows = recorder.rows();
+    PMO_CHECK_EQ((size_t)1, rows.size());
+    if (rows.size() != 1) {
+        return;
+    }
+    const tutorial::PbOrmTest &row = static_cast<const tutorial::PbOrmTest &>(*rows[0]);
+    PMO_CHECK_EQ((uint64_t)1, (uint64_t)row.id());
+    PMO_CHECK(row.has_value1());
+    PMO_CHECK_EQ(5u, row.value1());
+    PMO_CHECK_EQ(std::string("six"), row.value2());
+    // The later save wins where both set a column.
+    PMO_CHECK_EQ(3u, row.type());
+    PMO_CHECK(row.has_name() == false);
+    PMO_CHECK_EQ(2, succeeded.load());
+}
+
+// Blob storage rows are written whole, the latest version replaces the
+// queued one.
+static void testCoalesceBlobReplaces() {
+    RecordingWriter recorder;
+    WriteBehind queue(recorder.writer(), idleOptions());
+
+    tutorial::PbOrmBlobTest first;
+    first.set_id(4);
+    first.set_type(1);
+    first.add_items()->set_id(1);
+    first.add_items()->set_id(2);
+    queue.save(first);
+
+    tutorial::PbOrmBlobTest second;
+    second.set_id(4);
+    second.add_items()->set_id(3);
+    queue.save(second);
+
+    queue.flush();
+    std::vector<std::shared_ptr< ::google::protobuf::Message> > rows = recorder.rows();
+    PMO_CHECK_EQ((size_t)1, rows.size());
+    if (rows.size() == 1) {
+        PMO_CHECK_EQ(second.DebugString(), rows[0]->DebugString());
+    }
+}
+
+// Rows without their primary key can not be matched, each is written.
+static void testUnkeyedRowsNotCoalesced() {
+    RecordingWriter recorder;
+    WriteBehind queue(recorder.writer(), idleOptions());
+
+    tutorial::PbOrmTest message;
+    message.set_value1(1);
+    queue.save(message);
+    queue.save(message);
+    message.set_id(8);
+    queue.save(message);
+    message.set_id(9);
+    queue.save(message);
+
+    queue.flush();
+    PMO_CHECK_EQ((size_t)4, recorder.rows().size());
+    PMO_CHECK_EQ((uint64_t)0, queue.coalesced());
+    PMO_CHECK_EQ((size_t)0, queue.pending());
+}
+
+static void testFailureReachesCompletions() {
+    RecordingWriter recorder;
+    recorder.setOk(false);
+    WriteBehind queue(recorder.writer(), idleOptions());
+
+    std::atomic<int> failed(0);
+    tutorial::PbOrmTest message;
+    for (int i = 0; i < 3; ++i) {
+        message.set_id(i + 1);
+        queue.save(message, [&failed](bool ok) {
+            if (ok == false) {
+                ++failed;
+            }
+        });
+    }
+    queue.flush();
+    PMO_CHECK_EQ(3, failed.load());
+}
+
+// Batches are cut at batch_size, in enqueue order.
+static void testBatchSize() {
+    RecordingWriter recorder;
+    WriteBehindOptions options = idleOptions();
+    options.batch_size = 7;
+    WriteBehind queue(recorder.writer(), options);
+
+    tutorial::PbOrmTest message;
+    for (int i = 0; i < 50; ++i) {
+        message.set_id(i + 1);
+        queue.save(message);
+    }
+    queue.flush();
+
+    std::vector<std::shared_ptr< ::google::protobuf::Message> > rows = recorder.rows();
+    PMO_CHECK_EQ((size_t)50, rows.size());
+    for (size_t i = 0; i < rows.size(); ++i) {
+        PMO_CHECK_EQ((uint64_t)(i + 1), (uint64_t)static_cast<const tutorial::PbOrmTest &>(*rows[i]).id());
+    }
+}
+
+// flush() waits for the saves queued before it, not for a queue other
+// threads keep filling.
+static void testFlushIgnoresLaterSaves() {
+    RecordingWriter recorder;
+    WriteBehindOptions options = idleOptions();
+    options.batch_size = 16;
+    options.threads = 2;
+    WriteBehind queue(recorder.writer(), options);
+
+    std::atomic<bool> stop(false);
+    std::thread producer([&queue, &stop]() {
+        tutorial::PbOrmTest message;
+        for (uint64_t id = 1000; stop == false; ++id) {
+            message.set_id(id);
+            queue.save(message);
+        }
+    });
+
+    tutorial::PbOrmTest mine;
+    mine.set_id(1);
+    mine.set_value1(11);
+    queue.save(mine);
+    queue.flush();
+
+    bool found = false;
+    std::vector<std::shared_ptr< ::google::protobuf::Message> > rows = recorder.rows();
+    for (size_t i = 0; i < rows.size(); ++i) {
+        found = found || static_cast<const tutorial::PbOrmTest &>(*rows[i]).id() == 1;
+    }
+    PMO_CHECK(found);
+
+    stop = true;
+    producer.join();
+}
+
+}  // namespace test
+}  // namespace pmo
+
+int main() {
+    PMO_RUN(pmo::test::testCoalescePartialSaves);
+    PMO_RUN(pmo::test::testCoalesceBlobReplaces);
+    PMO_RUN(pmo::test::testUnkeyedRowsNotCoalesced);
+    PMO_RUN(pmo::test::testFailureReachesCompletions);
+    PMO_RUN(pmo::test::testBatchSize);
+    PMO_RUN(pmo::test::testFlushIgnoresLaterSaves);
+    return pmo::test::finish();
+}
@@ -0,0 +1,98 @@
+#include "transaction.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <google/protobuf/message.h>
+
+#include "load_cache.h"
+#include "storage.h"
+
+namespace pmo {
+
+thread_local Transaction *Transaction::current_ = NULL;
+
+Transaction::Transaction(Storage &storage) :
+        storage_(storage),
+        active_(false),
+        pinned_(false) {
+    if (current_ != NULL) {
+        printf("Transaction: one is already open on this thread.\n");
+        return;
+    }
+
+    handle_ = storage_.pool_.checkout();
+    if (!handle_) {
+        printf("ConnectionPool checkout failed.\n");
+        return;
+    }
+
+    current_ = this;
+    pinned_ = true;
+    active_ = execute("START TRANSACTION");
+}
+
+Transaction::~Transaction() {
+    if (active_) {
+        rollback();
+    }
+    finish();
+}
+
+Transaction *Transaction::current(const Storage &storage) {
+    if (current_ != NULL && &current_->storage_ == &storage) {
+        return current_;
+    }
+    return NULL;
+}
+
+bool Transaction::commit() {
+    if (active_ == false) {
+        return false;
+    }
+    active_ = false;
+    bool ret = execute("COMMIT");
+    // Also when COMMIT failed, it may have reached the server.
+    if (storage_.cache_ != NULL) {
+        for (size_t i = 0; i < written_.size(); ++i) {
+            storage_.cache_->invalidate(*written_[i]);
+        }
+        for (size_t i = 0; i < imported_.size(); ++i) {
+            storage_.cache_->invalidate(imported_[i]);
+        }
+    }
+    finish();
+    return ret;
+}
+
+bool Transaction::rollback() {
+    if (active_ == false) {
+        return false;
+    }
+    active_ = false;
+    bool ret = execute("ROLLBACK");
+    finish();
+    return ret;
+}
+
+bool Transaction::execute(const char *statement) {
+    if (::mysql_real_query(handle_.get(), statement, strlen(statement)) != 0) {
+        printf("%s failed: %s.\n", statement, ::mysql_error(handle_.get()));
+        // A connection in an unknown transaction state must not go back
+        // to the pool.
+        handle_.setBroken();
+        return false;
+    }
+    return true;
+}
+
+void Transaction::finish() {
+    if (pinned_) {
+        current_ = NULL;
+        pinned_ = false;
+    }
+    written_.clear();
+    imported_.clear();
+    handle_.release();
+}
+
+}  // namespace pmo
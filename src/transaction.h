@@ -0,0 +1,73 @@
+#ifndef PMO_TRANSACTION_H
+#define PMO_TRANSACTION_H
+
+#include <memory>
+#include <vector>
+
+#include "connection_pool.h"
+
+namespace google {
+namespace protobuf {
+
+class Descriptor;
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+class Storage;
+
+// Explicit transaction scope. The constructor checks a connection out of
+// |storage|'s pool and starts a transaction on it; until the scope ends
+// every Storage call made on the same thread runs on that connection, so
+//
+//   Transaction transaction(storage);
+//   storage.save(a);
+//   storage.save(b);
+//   transaction.commit();
+//
+// writes both rows with one commit. Without commit() the transaction is
+// rolled back on destruction. Transactions do not nest, and a streaming
+// load must finish before the next statement of the transaction.
+class Transaction {
+public:
+    explicit Transaction(Storage &storage);
+    ~Transaction();
+
+    // Started and neither committed nor rolled back.
+    bool active() const { return active_; }
+
+    bool commit();
+    bool rollback();
+
+private:
+    friend class Storage;
+
+    Transaction(const Transaction &);
+    Transaction &operator=(const Transaction &);
+
+    // The transaction open on |storage| in the calling thread, if any.
+    static Transaction *current(const Storage &storage);
+
+    bool execute(const char *statement);
+    void finish();
+
+    Storage &storage_;
+    ConnectionPool::Handle handle_;
+    bool active_;
+    bool pinned_;
+    // Rows saved in the transaction, their cache entries are invalidated
+    // again on commit: a load between the save and the commit still reads
+    // the old rows and may have cached them.
+    std::vector<std::unique_ptr<google::protobuf::Message> > written_;
+    // Types imported in the transaction, invalidated whole on commit.
+    std::vector<const google::protobuf::Descriptor *> imported_;
+
+    static thread_local Transaction *current_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_TRANSACTION_H
@@ -0,0 +1,248 @@
+#include "write_behind.h"
+
+#include <chrono>
+
+#include <stdio.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "storage.h"
+#include "table_schema.h"
+
+namespace pmo {
+
+WriteBehind::WriteBehind(Storage &storage, const WriteBehindOptions &options) :
+        writer_([&storage](const std::vector<const ::google::protobuf::Message *> &messages) {
+            return storage.save(messages);
+        }),
+        options_(options),
+        sequence_(0),
+        coalesced_(0),
+        flush_requests_(0),
+        stopping_(false) {
+    start();
+}
+
+WriteBehind::WriteBehind(const BatchWriter &writer, const WriteBehindOptions &options) :
+        writer_(writer),
+        options_(options),
+        sequence_(0),
+        coalesced_(0),
+        flush_requests_(0),
+        stopping_(false) {
+    start();
+}
+
+void WriteBehind::start() {
+    if (options_.threads == 0) {
+        options_.threads = 1;
+    }
+    if (options_.batch_size == 0) {
+        options_.batch_size = 1;
+    }
+    if (options_.max_pending < options_.batch_size) {
+        options_.max_pending = options_.batch_size;
+    }
+
+    for (size_t i = 0; i < options_.threads; ++i) {
+        threads_.push_back(std::thread(&WriteBehind::run, this));
+    }
+}
+
+WriteBehind::~WriteBehind() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+    written_.notify_all();
+    space_.notify_all();
+
+    for (size_t i = 0; i < threads_.size(); ++i) {
+        threads_[i].join();
+    }
+}
+
+bool WriteBehind::save(const ::google::protobuf::Message &message, const Completion &completion) {
+    // Rows without a usable primary key can not be coalesced.
+    std::string key;
+    bool keyed = TableSchema::get(message.GetDescriptor())->keyOf(message, key);
+    if (keyed) {
+        key = message.GetTypeName() + '\0' + key;
+    }
+
+    ::google::protobuf::Message *copy = message.New();
+    copy->CopyFrom(message);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    uint64_t sequence = sequence_++;
+    if (keyed == false) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)sequence);
+        key.assign(1, '\0').append(buffer);
+    }
+
+    std::map<std::string, Entry>::iterator iter = pending_.find(key);
+    if (iter == pending_.end()) {
+        while (stopping_ == false && pending_.size() >= options_.max_pending) {
+            space_.wait(lock);
+        }
+        iter = pending_.find(key);
+    }
+
+    if (stopping_) {
+        lock.unlock();
+        delete copy;
+        return false;
+    }
+
+    if (iter != pending_.end()) {
+        delete copy;
+        coalesce(iter->second.message, message);
+        if (completion) {
+            iter->second.completions.push_back(completion);
+        }
+        ++coalesced_;
+        return true;
+    }
+
+    Entry &entry = pending_[key];
+    entry.message = copy;
+    entry.sequence = sequence;
+    unwritten_.insert(sequence);
+    if (completion) {
+        entry.completions.push_back(completion);
+    }
+    order_.push_back(key);
+
+    if (ready()) {
+        wakeup_.notify_one();
+    }
+    return true;
+}
+
+void WriteBehind::coalesce(::google::protobuf::Message *queued, const ::google::protobuf::Message &message) {
+    const TableSchema *schema = TableSchema::get(message.GetDescriptor());
+    if (schema->blobStorage()) {
+        queued->CopyFrom(message);
+        return;
+    }
+
+    const ::google::protobuf::Reflection *reflection = message.GetReflection();
+    for (size_t i = 0; i < schema->columns().size(); ++i) {
+        const ::google::protobuf::FieldDescriptor *field_descriptor = schema->columns()[i];
+        if (reflection->HasField(message, field_descriptor)) {
+            TableSchema::copyValue(message, queued, field_descriptor);
+        }
+    }
+}
+
+void WriteBehind::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Saves queued later by other threads are not waited for. A row
+    // coalesced after this point keeps its older sequence, so it still
+    // counts, and is written with the later columns merged in.
+    uint64_t target = sequence_;
+    ++flush_requests_;
+    wakeup_.notify_all();
+    while (unwritten_.empty() == false && *unwritten_.begin() < target) {
+        drained_.wait(lock);
+    }
+    --flush_requests_;
+}
+
+size_t WriteBehind::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_.size() + writing_.size();
+}
+
+uint64_t WriteBehind::coalesced() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return coalesced_;
+}
+
+bool WriteBehind::ready() const {
+    return pending_.size() >= options_.batch_size;
+}
+
+void WriteBehind::run() {
+    std::chrono::milliseconds interval(options_.flush_interval_ms);
+    std::vector<std::string> keys;
+    std::vector<uint64_t> sequences;
+    std::vector<Entry> entries;
+    std::vector<const ::google::protobuf::Message *> messages;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        if (stopping_ == false && flush_requests_ == 0 && ready() == false) {
+            wakeup_.wait_for(lock, interval);
+        }
+
+        // Take up to batch_size rows in enqueue order, skipping keys another
+        // writer still has in flight so versions of a row land in order.
+        std::deque<std::string> skipped;
+        while (order_.empty() == false && keys.size() < options_.batch_size) {
+            std::string key = order_.front();
+            order_.pop_front();
+            if (writing_.count(key) != 0) {
+                skipped.push_back(key);
+                continue;
+            }
+
+            std::map<std::string, Entry>::iterator iter = pending_.find(key);
+            entries.push_back(iter->second);
+            sequences.push_back(iter->second.sequence);
+            pending_.erase(iter);
+            writing_.insert(key);
+            keys.push_back(key);
+        }
+        order_.insert(order_.begin(), skipped.begin(), skipped.end());
+
+        if (keys.empty()) {
+            if (stopping_ && pending_.empty()) {
+                break;
+            }
+            if (pending_.empty() == false) {
+                // Everything left is being written by another thread.
+                written_.wait(lock);
+            } else if (flush_requests_ != 0) {
+                // A flush waits for other writers, do not spin meanwhile.
+                wakeup_.wait_for(lock, interval);
+            }
+            continue;
+        }
+
+        space_.notify_all();
+        lock.unlock();
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+            messages.push_back(entries[i].message);
+        }
+        bool ok = writer_(messages);
+        if (ok == false) {
+            printf("WriteBehind save of %zu rows failed.\n", messages.size());
+        }
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+            for (size_t j = 0; j < entries[i].completions.size(); ++j) {
+                entries[i].completions[j](ok);
+            }
+            delete entries[i].message;
+        }
+        messages.clear();
+        entries.clear();
+
+        lock.lock();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            writing_.erase(keys[i]);
+            unwritten_.erase(sequences[i]);
+        }
+        keys.clear();
+        sequences.clear();
+
+        drained_.notify_all();
+        written_.notify_all();
+    }
+}
+
+}  // namespace pmo
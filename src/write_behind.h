@@ -0,0 +1,118 @@
+#ifndef PMO_WRITE_BEHIND_H
+#define PMO_WRITE_BEHIND_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace google {
+namespace protobuf {
+
+class Message;
+
+}  // namespace protobuf
+}  // namespace google
+
+namespace pmo {
+
+class Storage;
+
+struct WriteBehindOptions {
+    WriteBehindOptions() :
+            threads(1),
+            max_pending(100000),
+            batch_size(500),
+            flush_interval_ms(100) {}
+
+    // Writer threads, each uses its own pooled connection.
+    size_t threads;
+    // save() blocks while this many rows are queued.
+    size_t max_pending;
+    // Rows written per batched statement, reaching it also triggers a flush.
+    size_t batch_size;
+    // Queued rows are written at least this often.
+    uint32_t flush_interval_ms;
+};
+
+// Asynchronous write-behind queue in front of Storage::save. save() copies
+// the message and returns, writer threads flush the queue with batched
+// statements. Pending saves of the same primary key are coalesced: saves
+// only write the fields they set, so the set columns of a later save are
+// merged into the queued row, blob storage rows are replaced whole. Rows
+// of the same key are never written concurrently.
+class WriteBehind {
+public:
+    // Called on a writer thread once the row is written or failed.
+    typedef std::function<void (bool ok)> Completion;
+    // Writes one batch, Storage::save() of the messages by default.
+    typedef std::function<bool (const std::vector<const google::protobuf::Message *> &messages)> BatchWriter;
+
+    WriteBehind(Storage &storage, const WriteBehindOptions &options = WriteBehindOptions());
+    WriteBehind(const BatchWriter &writer, const WriteBehindOptions &options = WriteBehindOptions());
+    // Writes everything still queued before returning.
+    ~WriteBehind();
+
+    // Returns false after the queue has been stopped.
+    bool save(const google::protobuf::Message &message, const Completion &completion = Completion());
+
+    // Blocks until every save queued before the call has been written.
+    void flush();
+
+    size_t pending() const;
+    uint64_t coalesced() const;
+
+private:
+    WriteBehind(const WriteBehind &);
+    WriteBehind &operator=(const WriteBehind &);
+
+    struct Entry {
+        Entry() : message(NULL), sequence(0) {}
+
+        google::protobuf::Message *message;
+        std::vector<Completion> completions;
+        // Sequence of the first save coalesced into the entry.
+        uint64_t sequence;
+    };
+
+    void start();
+    void run();
+    bool ready() const;
+    // Folds a later save of the same row into the queued one.
+    static void coalesce(google::protobuf::Message *queued, const google::protobuf::Message &message);
+
+    BatchWriter writer_;
+    WriteBehindOptions options_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::condition_variable space_;
+    std::condition_variable drained_;
+    std::condition_variable written_;
+    // Coalescing key -> queued row, |order_| keeps first enqueue order.
+    std::map<std::string, Entry> pending_;
+    std::deque<std::string> order_;
+    // Keys being written right now.
+    std::set<std::string> writing_;
+    // Sequence numbers of the queued and in-flight entries, every save
+    // numbered below the smallest one has been written.
+    std::set<uint64_t> unwritten_;
+    // Next save() sequence number.
+    uint64_t sequence_;
+    uint64_t coalesced_;
+    size_t flush_requests_;
+    bool stopping_;
+    std::vector<std::thread> threads_;
+};
+
+}   // namespace pmo
+
+#endif  // PMO_WRITE_BEHIND_H